@@ -0,0 +1,208 @@
+/*
+ * bench_pwm_driver.c
+ *
+ *	CPU cost of the public entry points, measured against a null transport (driver cost only,
+ *	reads return 0) and the simulated bus (driver + register model). No hardware needed.
+ *
+ *	Build: make bench_pwm_driver (or gcc -O2 bench_pwm_driver.c pwm-pca9685-user.c pwm-pca9685-sim.c -o bench_pwm_driver)
+ *	Usage: ./bench_pwm_driver [label] [iterations]
+ *
+ *	Prints one JSON object per line:
+ *	{"label":..,"bench":..,"mode":..,"transport":..,"param":..,"iters":..,"ns_per_call":..,"sleep_ns_per_call":..,
+ *	"allocs_per_call":..}
+ *
+ *	Channel values alternate every iteration so the planner always has something to send.
+ *	Calls that wait for the oscillator (wake) have the measured cost of that sleep reported in
+ *	sleep_ns_per_call and taken out of ns_per_call. Any error stops the run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "pwm-pca9685-user.h"
+#include "pwm-pca9685-sim.h"
+
+#define DEFAULT_ITERS 200000
+#define ADDRESS 0x80
+#define DUTY_A 1000
+#define DUTY_B 1100
+
+//count heap allocations by wrapping glibc's allocator
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static unsigned long n_allocs;
+
+void* malloc(size_t size){ ++n_allocs; return __libc_malloc(size); }
+void* calloc(size_t n, size_t size){ ++n_allocs; return __libc_calloc(n, size); }
+void* realloc(void* ptr, size_t size){ ++n_allocs; return __libc_realloc(ptr, size); }
+
+//a failing path would be timed as a fast one: stop instead
+#define RUN(...) do{ if(run(__VA_ARGS__)) exit(EXIT_FAILURE); }while(0)
+
+typedef int (*bench_fn)(PCA9685_config* config, uint32_t arg, unsigned long iter);
+
+static const char* label = "dev";
+static unsigned long iters = DEFAULT_ITERS;
+
+static PCA9685_config myConfig;
+static PCA9685_sim sim;
+static PCA9685_transport null_transport;
+
+//reads come back as 0, like a device with every register cleared
+static int null_transfer(void* ctx, PCA9685_msg* msgs, int n_msgs){
+	int i;
+	(void)ctx;
+	for(i=0;i<n_msgs;++i)
+		if(msgs[i].flags & PCA9685_MSG_RD)
+			memset(msgs[i].buf, 0, msgs[i].len);
+	return PCA9685_ERR_NOERR;
+}
+
+static uint64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void set_duty(PCA9685_config* config, unsigned long iter){
+	int i;
+	for(i=0;i<PCA9685_MAXCHAN;++i)
+		config->channels[i].dutyTime_us = (iter & 1) ? DUTY_B : DUTY_A;
+}
+
+static int b_updateChannel(PCA9685_config* config, uint32_t arg, unsigned long iter){
+	config->channels[arg].dutyTime_us = (iter & 1) ? DUTY_B : DUTY_A;
+	return PCA9685_updateChannel(arg, config);
+}
+
+static int b_updateChannels(PCA9685_config* config, uint32_t arg, unsigned long iter){
+	set_duty(config, iter);
+	return PCA9685_updateChannels(arg, config);
+}
+
+static int b_updateChannelRange(PCA9685_config* config, uint32_t arg, unsigned long iter){
+	set_duty(config, iter);
+	return PCA9685_updateChannelRange(0, arg - 1, config);
+}
+
+static int b_writeReg(PCA9685_config* config, uint32_t arg, unsigned long iter){
+	(void)iter;
+	return PCA9685_writeReg(PCA9685_REG_MODE2, PCA9685_SETTING_MODE2_OUTDRV, config, arg);
+}
+
+static int b_config(PCA9685_config* config, uint32_t arg, unsigned long iter){
+	(void)iter;
+	return PCA9685_config_only(config, -1, ADDRESS, arg, PCA9685_SETTING_MODE2_OUTDRV, PCA9685_FUTABAS3004_PWM_PERIOD, PCA9685_DEFAULT_OSC);
+}
+
+static int b_wake(PCA9685_config* config, uint32_t arg, unsigned long iter){
+	(void)arg;
+	set_duty(config, iter);
+	return PCA9685_wake(config);
+}
+
+//what n oscillator start-up waits cost on this machine, sleep overshoot included
+static uint64_t sleep_ns(unsigned long n){
+	unsigned long i;
+	uint64_t t = now_ns();
+	for(i=0;i<n;++i)
+		usleep(PCA9685_OSC_STARTUP_us);
+	return now_ns() - t;
+}
+
+static int run(const char* name, bench_fn fn, uint32_t arg, const char* param,
+		uint8_t mode1, PCA9685_transport* transport, const char* transport_name){
+
+	unsigned long i, n = iters;
+	unsigned long allocs;
+	uint64_t t, slept = 0;
+	int err;
+
+	PCA9685_simInit(&sim);
+	PCA9685_simAddDevice(&sim, ADDRESS);
+	memset(&myConfig, 0, sizeof(myConfig));
+	PCA9685_setTransport(transport, &myConfig);
+
+	if(err = PCA9685_config_only(&myConfig, -1, ADDRESS, mode1, PCA9685_SETTING_MODE2_OUTDRV, PCA9685_FUTABAS3004_PWM_PERIOD, PCA9685_DEFAULT_OSC))
+		return err;
+
+	//wake sleeps for the oscillator, keep its run short
+	if(fn == b_wake && n > 1000)
+		n = 1000;
+
+	//warm up
+	for(i=0;i<n/10 + 2;++i)
+		if(err = fn(&myConfig, arg, i))
+			goto fail;
+
+	allocs = n_allocs;
+	t = now_ns();
+	for(i=0;i<n;++i)
+		if(err = fn(&myConfig, arg, i))
+			goto fail;
+	t = now_ns() - t;
+	allocs = n_allocs - allocs;
+
+	//the internal oscillator wait is a fixed sleep, not driver cost
+	if(fn == b_wake && !(mode1 & PCA9685_SETTING_MODE1_EXTCLK)){
+		slept = sleep_ns(n);
+		t = t > slept ? t - slept : 0;
+	}
+
+	printf("{\"label\":\"%s\",\"bench\":\"%s\",\"mode\":\"%s\",\"transport\":\"%s\",\"param\":\"%s\","
+			"\"iters\":%lu,\"ns_per_call\":%.1f,\"sleep_ns_per_call\":%.1f,\"allocs_per_call\":%.3f}\n",
+			label, name, (mode1 & PCA9685_SETTING_MODE1_AUTOINCR) ? "autoincr" : "per_register",
+			transport_name, param, n, (double)t / n, (double)slept / n, (double)allocs / n);
+
+	return PCA9685_ERR_NOERR;
+
+fail:
+	fprintf(stderr, "%s %s %s: error %d at iteration %lu\n", name, param, transport_name, err, i);
+	return err;
+}
+
+int main(int argc, char** argv){
+
+	static const uint32_t masks[] = {0x0001, 0x0101, 0x1111, 0x5555, 0x00FF, 0xFFFF};
+	static const uint32_t ranges[] = {1, 2, 4, 8, 16};
+	uint8_t modes[] = {PCA9685_SETTING_MODE1_ALLCALL | PCA9685_SETTING_MODE1_AUTOINCR, PCA9685_SETTING_MODE1_ALLCALL};
+	PCA9685_transport* transports[] = {&null_transport, &sim.transport};
+	const char* transport_names[] = {"null", "sim"};
+	char param[32];
+	int m, t, i;
+
+	if(argc > 1)
+		label = argv[1];
+	if(argc > 2)
+		iters = strtoul(argv[2], NULL, 0);
+
+	null_transport.transfer = null_transfer;
+
+	for(t=0;t<2;++t){
+		for(m=0;m<2;++m){
+
+			RUN("updateChannel", b_updateChannel, 5, "channel=5", modes[m], transports[t], transport_names[t]);
+
+			for(i=0;i<(int)(sizeof(masks)/sizeof(masks[0]));++i){
+				snprintf(param, sizeof(param), "mask=0x%04x", masks[i]);
+				RUN("updateChannels", b_updateChannels, masks[i], param, modes[m], transports[t], transport_names[t]);
+			}
+
+			for(i=0;i<(int)(sizeof(ranges)/sizeof(ranges[0]));++i){
+				snprintf(param, sizeof(param), "channels=%u", ranges[i]);
+				RUN("updateChannelRange", b_updateChannelRange, ranges[i], param, modes[m], transports[t], transport_names[t]);
+			}
+
+			RUN("writeReg", b_writeReg, 0xFF, "mask=0xff", modes[m], transports[t], transport_names[t]);
+			RUN("writeReg", b_writeReg, PCA9685_SETTING_MODE2_OUTDRV, "mask=0x04", modes[m], transports[t], transport_names[t]);
+			RUN("config_only", b_config, modes[m], "", modes[m], transports[t], transport_names[t]);
+			RUN("wake", b_wake, 0, "", modes[m], transports[t], transport_names[t]);
+		}
+	}
+
+	return 0;
+}
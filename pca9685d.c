@@ -0,0 +1,163 @@
+/*
+ * pca9685d.c
+ *
+ *	Daemon that owns the i2c buses and drives every PCA9685 on them on behalf of other processes.
+ *	Clients publish duty times through pwm-pca9685-shm.h; the daemon sends at most one coalesced
+ *	frame per board per PWM period (the driver's governor).
+ *
+ *	Build: gcc -O2 pca9685d.c pwm-pca9685-user.c pwm-pca9685-shm.c pwm-pca9685-sim.c pwm-pca9685-rt.c -pthread -o pca9685d
+ *	Usage: pca9685d [-n shm_name] [-p pwm_period_us] [-s] [-r priority[:cpu]] bus:address ...
+ *		-s	run against the simulated bus instead of /dev/i2c-N
+ *		-r	real-time profile for the daemon loop: SCHED_FIFO priority, optional cpu pinning,
+ *			locked and prefaulted memory
+ *		address is the 8-bit write address, e.g. 1:0x80
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "pwm-pca9685-user.h"
+#include "pwm-pca9685-shm.h"
+#include "pwm-pca9685-sim.h"
+#include "pwm-pca9685-rt.h"
+
+#define MAX_BUSES 8
+#define MY_MODE1 (PCA9685_SETTING_MODE1_AUTOINCR | PCA9685_SETTING_MODE1_ALLCALL)
+#define MY_MODE2 (PCA9685_SETTING_MODE2_OUTDRV)
+
+static volatile sig_atomic_t running = 1;
+
+static PCA9685_config configs[PCA9685_SHM_MAXBOARDS];
+static PCA9685_sim sims[MAX_BUSES];
+static int bus_files[MAX_BUSES];
+
+static void on_signal(int sig){
+	(void)sig;
+	running = 0;
+}
+
+static int open_bus(int bus, int simulated){
+	char i2cpath[16];
+
+	if(bus_files[bus] >= 0)
+		return bus_files[bus];
+
+	if(simulated){
+		PCA9685_simInit(&sims[bus]);
+		bus_files[bus] = bus;
+		return bus;
+	}
+
+	snprintf(i2cpath, sizeof(i2cpath), "/dev/i2c-%d", bus);
+	bus_files[bus] = open(i2cpath, O_RDWR);
+	if(bus_files[bus] < 0)
+		perror("i2cOpen");
+
+	return bus_files[bus];
+}
+
+int main(int argc, char** argv){
+
+	const char* name = PCA9685_SHM_DEFAULT_NAME;
+	uint32_t period = PCA9685_FUTABAS3004_PWM_PERIOD;
+	int simulated = 0;
+	PCA9685_rtProfile rt = {0, -1, 0, 0};
+	PCA9685_rtStatus rt_status;
+	PCA9685_shm* shm;
+	PCA9685_WORD_t dirty;
+	unsigned bus, address;
+	int opt, board, n_boards = 0, err;//n_boards: boards brought up so far
+
+	while((opt = getopt(argc, argv, "n:p:sr:")) != -1){
+		switch(opt){
+		case 'n': name = optarg; break;
+		case 'p': period = strtoul(optarg, NULL, 0); break;
+		case 's': simulated = 1; break;
+		case 'r':
+			sscanf(optarg, "%d:%d", &rt.priority, &rt.cpu);
+			rt.lock_memory = 1;
+			rt.prefault_stack = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n shm_name] [-p pwm_period_us] [-s] [-r priority[:cpu]] bus:address ...\n", argv[0]);
+			return -1;
+		}
+	}
+
+	memset(bus_files, -1, sizeof(bus_files));
+
+	if(err = PCA9685_shmCreate(&shm, name)){
+		fprintf(stderr, "couldnt create %s: err %d\n", name, err);
+		return -1;
+	}
+
+	for(;optind<argc;++optind){
+		if(sscanf(argv[optind], "%u:%i", &bus, &address) != 2 || bus >= MAX_BUSES){
+			fprintf(stderr, "bad board %s\n", argv[optind]);
+			goto out;
+		}
+
+		if((board = PCA9685_shmAddBoard(shm, bus, address)) < 0 || open_bus(bus, simulated) < 0)
+			goto out;
+
+		if(simulated){
+			PCA9685_simAddDevice(&sims[bus], address);
+			PCA9685_setTransport(&sims[bus].transport, &configs[board]);
+		}
+		configs[board].i2c_bus = bus;
+
+		if((err = PCA9685_config_only(&configs[board], bus_files[bus], address, MY_MODE1, MY_MODE2, period, PCA9685_DEFAULT_OSC)) ||
+				(err = PCA9685_wake(&configs[board]))){
+			fprintf(stderr, "couldnt bring up %u:0x%02x: err %d\n", bus, address, err);
+			goto out;
+		}
+
+		PCA9685_setGovernor(1, &configs[board]);
+		++n_boards;
+	}
+
+	if(rt.priority > 0){
+		//the daemon owns its process, so it locks the memory for the profile
+		PCA9685_rtLockMemory();
+		PCA9685_rtApply(&rt);
+		PCA9685_rtPrefault(shm, sizeof(*shm));
+		PCA9685_rtPrefault(configs, sizeof(configs));
+
+		if(PCA9685_rtCheck(&rt, &rt_status))
+			fprintf(stderr, "real-time profile incomplete: requested 0x%x, active 0x%x\n",
+					rt_status.requested, rt_status.active);
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	while(running){
+
+		PCA9685_shmWait(shm, period);
+
+		for(board=0;board<n_boards;++board){
+			dirty = PCA9685_shmCollect(shm, board, &configs[board]);
+
+			if(err = dirty ? PCA9685_updateChannels(dirty, &configs[board]) : PCA9685_service(&configs[board]))
+				fprintf(stderr, "board %d: err %d\n", board, err);
+		}
+
+		for(shm->frames=0, board=0;board<n_boards;++board)
+			shm->frames += configs[board].stats.frames;
+	}
+
+out:
+	for(board=0;board<n_boards;++board)
+		PCA9685_sleep(&configs[board]);
+
+	for(bus=0;bus<MAX_BUSES;++bus)
+		if(!simulated && bus_files[bus] >= 0)
+			close(bus_files[bus]);
+
+	PCA9685_shmDestroy(shm, name);
+
+	return 0;
+}
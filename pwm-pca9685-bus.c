@@ -0,0 +1,228 @@
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+
+#include "pwm-pca9685-bus.h"
+
+static int __bus_transfer(void* ctx, PCA9685_msg* msgs, int n_msgs);
+static int __bus_urgent(void* ctx, PCA9685_msg* msgs, int n_msgs);
+static int __bus_run(PCA9685_bus* bus, int prio, PCA9685_msg* msgs, int n_msgs);
+static uint64_t __now_ns(void);
+
+/*
+ *
+ * Opens /dev/i2c-N for the cross-process lock (and for transfers when inner is NULL).
+ * Pass i2cbus < 0 to arbitrate in-process only, e.g. on the simulated bus.
+ */
+int PCA9685_busInit(PCA9685_bus* bus,
+		int i2cbus,
+		PCA9685_transport* inner)
+{
+	char i2cpath[20];
+
+	memset(bus, 0, sizeof(*bus));
+
+	bus->transport.transfer = __bus_transfer;
+	bus->transport.ctx = bus;
+	bus->transport.urgent = __bus_urgent;
+	bus->inner = inner;
+	bus->i2cbus = i2cbus;
+	bus->lock_fd = -1;
+
+	if(i2cbus >= 0){
+		snprintf(i2cpath, sizeof(i2cpath), "/dev/i2c-%d", i2cbus);
+		bus->lock_fd = open(i2cpath, O_RDWR);
+		if(bus->lock_fd < 0){
+			perror("i2cOpen");
+			return PCA9685_ERR_I2CfOPEN;
+		}
+	}
+	else if(!inner)
+		return PCA9685_ERR_NO_FILE;
+
+	pthread_mutex_init(&bus->mutex, NULL);
+	pthread_cond_init(&bus->cond, NULL);
+
+	return PCA9685_ERR_NOERR;
+}
+
+int PCA9685_busDestroy(PCA9685_bus* bus)
+{
+	if(bus->lock_fd >= 0)
+		close(bus->lock_fd);
+
+	pthread_cond_destroy(&bus->cond);
+	pthread_mutex_destroy(&bus->mutex);
+
+	return PCA9685_ERR_NOERR;
+}
+
+int PCA9685_busSetBudget(PCA9685_bus* bus,
+		int prio,
+		uint32_t budget_us)
+{
+	if(prio < 0 || prio >= PCA9685_BUS_NPRIO)
+		return PCA9685_ERR_BOUNDS;
+
+	bus->budget_ns[prio] = (uint64_t)budget_us * 1000;
+
+	return PCA9685_ERR_NOERR;
+}
+
+int PCA9685_busAttach(PCA9685_bus* bus,
+		PCA9685_config* config)
+{
+	if(!config)
+		return PCA9685_ERR_NO_CONFIG;
+
+	return PCA9685_setTransport(&bus->transport, config);
+}
+
+/*
+ *
+ * Waits for the bus. A waiter is granted when the bus is free, nobody of a higher priority is
+ * queued, and it is at the head of its own priority's queue.
+ */
+int PCA9685_busAcquire(PCA9685_bus* bus,
+		int prio,
+		uint64_t* waited_ns)
+{
+	uint64_t t0, waited;
+	uint32_t ticket;
+	int p, ahead;
+
+	if(prio < 0 || prio >= PCA9685_BUS_NPRIO)
+		return PCA9685_ERR_BOUNDS;
+
+	t0 = __now_ns();
+
+	pthread_mutex_lock(&bus->mutex);
+
+	ticket = bus->next_ticket[prio]++;
+	bus->waiting[prio]++;
+
+	for(;;){
+		for(ahead=0, p=0;p<prio;++p)
+			ahead |= bus->waiting[p];
+
+		if(!bus->busy && !ahead && bus->serving[prio] == ticket)
+			break;
+
+		pthread_cond_wait(&bus->cond, &bus->mutex);
+	}
+
+	bus->waiting[prio]--;
+	bus->serving[prio]++;
+	bus->busy = 1;
+	bus->owner_prio = prio;
+
+	pthread_mutex_unlock(&bus->mutex);
+
+	if(bus->lock_fd >= 0 && flock(bus->lock_fd, LOCK_EX)){
+		perror("i2cLock");
+		PCA9685_busRelease(bus);
+		return PCA9685_ERR_BUS_LOCK;
+	}
+
+	bus->acquired_ns = __now_ns();
+	waited = bus->acquired_ns - t0;
+
+	bus->stats.acquisitions[prio]++;
+	bus->stats.total_wait_ns[prio] += waited;
+	if(waited > bus->stats.max_wait_ns[prio])
+		bus->stats.max_wait_ns[prio] = waited;
+	if(bus->budget_ns[prio] && waited > bus->budget_ns[prio])
+		bus->stats.wait_overruns[prio]++;
+
+	if(waited_ns)
+		*waited_ns = waited;
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Hands the bus on. A hold longer than the PWM budget is what delays servo frames, so it is
+ * counted against the owner's priority.
+ */
+int PCA9685_busRelease(PCA9685_bus* bus)
+{
+	uint64_t held = __now_ns() - bus->acquired_ns;
+	int prio = bus->owner_prio;
+
+	if(held > bus->stats.max_hold_ns[prio])
+		bus->stats.max_hold_ns[prio] = held;
+	if(bus->budget_ns[PCA9685_BUS_PRIO_PWM] && held > bus->budget_ns[PCA9685_BUS_PRIO_PWM])
+		bus->stats.hold_overruns[prio]++;
+
+	if(bus->lock_fd >= 0)
+		flock(bus->lock_fd, LOCK_UN);
+
+	pthread_mutex_lock(&bus->mutex);
+	bus->busy = 0;
+	pthread_cond_broadcast(&bus->cond);
+	pthread_mutex_unlock(&bus->mutex);
+
+	return PCA9685_ERR_NOERR;
+}
+
+int PCA9685_busGetStats(PCA9685_bus* bus,
+		PCA9685_busStats* stats)
+{
+	pthread_mutex_lock(&bus->mutex);
+	*stats = bus->stats;
+	pthread_mutex_unlock(&bus->mutex);
+
+	return PCA9685_ERR_NOERR;
+}
+
+static int __bus_transfer(void* ctx,
+		PCA9685_msg* msgs,
+		int n_msgs)
+{
+	return __bus_run((PCA9685_bus*)ctx, PCA9685_BUS_PRIO_PWM, msgs, n_msgs);
+}
+
+static int __bus_urgent(void* ctx,
+		PCA9685_msg* msgs,
+		int n_msgs)
+{
+	return __bus_run((PCA9685_bus*)ctx, PCA9685_BUS_PRIO_URGENT, msgs, n_msgs);
+}
+
+static int __bus_run(PCA9685_bus* bus,
+		int prio,
+		PCA9685_msg* msgs,
+		int n_msgs)
+{
+	int err;
+
+	if(err = PCA9685_busAcquire(bus, prio, NULL))
+		return err;
+
+	if(bus->inner && prio == PCA9685_BUS_PRIO_URGENT && bus->inner->urgent)
+		err = bus->inner->urgent(bus->inner->ctx, msgs, n_msgs);
+	else if(bus->inner)
+		err = bus->inner->transfer(bus->inner->ctx, msgs, n_msgs);
+	else
+		err = PCA9685_i2cdevTransfer((void*)(intptr_t)bus->lock_fd, msgs, n_msgs);
+
+	PCA9685_busRelease(bus);
+
+	return err;
+}
+
+static uint64_t __now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
@@ -0,0 +1,86 @@
+/*
+ * pwm-pca9685-bus.h
+ *
+ *	Bus arbitration between this driver and other i2c drivers (IMUs, ADCs, ...) on the same bus.
+ *
+ *	In-process, users queue for the bus by priority (FIFO within a priority), so a PWM frame
+ *	goes ahead of any queued sensor read. Across processes, the owner also holds an advisory
+ *	flock() on /dev/i2c-N. Any driver that honours the same lock can share the bus; flock has
+ *	no notion of priority, so cross-process waits are only reported, not reordered.
+ *
+ *	Attach a config with PCA9685_busAttach and its transfers acquire the bus at
+ *	PCA9685_BUS_PRIO_PWM. Other drivers wrap their own transactions in
+ *	PCA9685_busAcquire / PCA9685_busRelease. Waits longer than the priority's budget and holds
+ *	longer than the PWM budget are counted in the stats.
+ *
+ */
+#ifndef PWM_PCA9685_BUS_H_
+#define PWM_PCA9685_BUS_H_
+
+#include <pthread.h>
+#include "pwm-pca9685-user.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define PCA9685_BUS_PRIO_URGENT		0
+#define PCA9685_BUS_PRIO_PWM		1
+#define PCA9685_BUS_PRIO_NORMAL		2
+#define PCA9685_BUS_NPRIO			3
+
+typedef struct PCA9685_busStats{
+	uint32_t acquisitions[PCA9685_BUS_NPRIO];
+	uint64_t total_wait_ns[PCA9685_BUS_NPRIO];
+	uint64_t max_wait_ns[PCA9685_BUS_NPRIO];
+	uint32_t wait_overruns[PCA9685_BUS_NPRIO];//waits longer than the priority's budget
+	uint64_t max_hold_ns[PCA9685_BUS_NPRIO];
+	uint32_t hold_overruns[PCA9685_BUS_NPRIO];//holds longer than the PWM budget
+} PCA9685_busStats;
+
+typedef struct PCA9685_bus{
+	PCA9685_transport transport;//what attached configs use
+	PCA9685_transport* inner;//NULL: i2c-dev on lock_fd
+	int i2cbus;
+	int lock_fd;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	uint8_t busy;
+	int owner_prio;
+	uint64_t acquired_ns;
+	uint32_t waiting[PCA9685_BUS_NPRIO];
+	uint32_t next_ticket[PCA9685_BUS_NPRIO];
+	uint32_t serving[PCA9685_BUS_NPRIO];
+	uint64_t budget_ns[PCA9685_BUS_NPRIO];
+
+	PCA9685_busStats stats;
+} PCA9685_bus;
+
+int PCA9685_busInit(PCA9685_bus* bus,
+		int i2cbus,
+		PCA9685_transport* inner);
+
+int PCA9685_busDestroy(PCA9685_bus* bus);
+
+int PCA9685_busSetBudget(PCA9685_bus* bus,
+		int prio,
+		uint32_t budget_us);
+
+int PCA9685_busAttach(PCA9685_bus* bus,
+		PCA9685_config* config);
+
+int PCA9685_busAcquire(PCA9685_bus* bus,
+		int prio,
+		uint64_t* waited_ns);
+
+int PCA9685_busRelease(PCA9685_bus* bus);
+
+int PCA9685_busGetStats(PCA9685_bus* bus,
+		PCA9685_busStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PWM_PCA9685_BUS_H_ */
@@ -0,0 +1,478 @@
+/*
+ * pwm-pca9685-coro.hpp
+ *
+ *	C++20 coroutine layer for event loop applications.
+ *
+ *	An Executor runs the blocking driver calls (and so the i2c transfers) on its worker threads,
+ *	one queue per worker. Boards are routed by bus (their transport, or their i2c-dev descriptor),
+ *	buses handed to the workers in turn, so the transfers of a bus stay in order. Completions
+ *	are signalled on an eventfd: register Executor::fd() in epoll (or any poller) and call
+ *	Executor::poll() on the loop thread when it is readable; the awaiting coroutines resume there.
+ *
+ *		pca9685::Task<void> ramp(pca9685::Executor& ex, PCA9685_config* cfg, std::stop_token st){
+ *			for(uint32_t us = 1000; us <= 2000; us += 10){
+ *				cfg->channels[0].dutyTime_us = us;
+ *				if(co_await ex.flush(cfg, 1, st))
+ *					co_return;
+ *			}
+ *		}
+ *		pca9685::spawn(ramp(ex, &cfg, stop.get_token()));
+ *
+ *	An operation still queued when its stop_token is triggered completes with
+ *	PCA9685_ERR_CANCELLED without touching the bus; once started, a transfer runs to the end.
+ *	A config belongs to the worker while an operation on it is in flight: do not touch it from
+ *	the loop thread until the co_await returns, and keep at most one operation per config.
+ *	Destroying the Executor (on the loop thread) lets running calls finish, completes queued ones
+ *	as PCA9685_ERR_CANCELLED and resumes every waiting coroutine, so none is left suspended.
+ *
+ *	Build: g++ -std=c++20 ... pwm-pca9685-user.c -pthread (compile the .c as C, or with g++ -x c)
+ *
+ */
+#ifndef PWM_PCA9685_CORO_HPP_
+#define PWM_PCA9685_CORO_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "pwm-pca9685-user.h"
+
+namespace pca9685{
+
+class Executor;
+
+/*
+ *
+ * One queued driver call. Lives in the awaiting coroutine's frame until it resumes.
+ */
+struct Op{
+	enum{ QUEUED, RUNNING, CANCELLED };
+
+	int state = QUEUED;//guarded by the worker's mutex
+	unsigned worker = 0;
+	int err = PCA9685_ERR_NOERR;
+	std::coroutine_handle<> waiter;
+
+	virtual int run() = 0;//on the worker thread
+
+protected:
+	~Op() = default;
+};
+
+class Executor{
+public:
+	explicit Executor(unsigned n_workers = 1)
+		: efd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+		  workers_(n_workers ? n_workers : 1)
+	{
+		for(unsigned i=0;i<workers_.size();++i)
+			workers_[i].thread = std::jthread([this, i](std::stop_token st){ work(i, st); });
+	}
+
+	~Executor()
+	{
+		for(auto& w : workers_){
+			w.thread.request_stop();
+			w.cv.notify_all();
+		}
+		for(auto& w : workers_)
+			w.thread.join();
+
+		//what never started is cancelled; anything a resumed coroutine submits now is cancelled too
+		stopping_ = true;
+		for(auto& w : workers_){
+			for(Op* op : w.queue){
+				op->state = Op::CANCELLED;
+				op->err = PCA9685_ERR_CANCELLED;
+				complete(op);
+			}
+			w.queue.clear();
+		}
+		while(poll() > 0)
+			;
+
+		workers_.clear();
+
+		if(efd_ >= 0)
+			close(efd_);
+	}
+
+	Executor(const Executor&) = delete;
+	Executor& operator=(const Executor&) = delete;
+
+	//readable when operations have completed
+	int fd() const { return efd_; }
+
+	/*
+	 *
+	 * Resumes the coroutines whose operations have completed. Call from the loop thread.
+	 * Returns how many were resumed.
+	 */
+	int poll()
+	{
+		uint64_t n;
+		std::vector<Op*> done;
+
+		if(read(efd_, &n, sizeof(n)) < 0 && errno != EAGAIN)
+			return PCA9685_ERR_BOUNDS;
+
+		{
+			std::lock_guard<std::mutex> lock(done_mutex_);
+			done.swap(done_);
+		}
+
+		for(Op* op : done)
+			op->waiter.resume();
+
+		return (int)done.size();
+	}
+
+	template<class F> class Call;
+
+	//any blocking driver call, e.g. ex.call(cfg, [cfg]{ return PCA9685_updateChannelRange(0, 3, cfg); })
+	template<class F>
+	Call<F> call(PCA9685_config* config,
+			F fn,
+			std::stop_token st = {})
+	{
+		return Call<F>(*this, route(config), std::move(fn), std::move(st));
+	}
+
+	auto flush(PCA9685_config* config,
+			PCA9685_WORD_t channels,
+			std::stop_token st = {});
+
+	auto updateRange(PCA9685_config* config,
+			uint8_t channel_start,
+			uint8_t channel_end,
+			std::stop_token st = {});
+
+	auto service(PCA9685_config* config,
+			std::stop_token st = {});
+
+	//*value is written before the coroutine resumes
+	auto readReg(PCA9685_config* config,
+			uint8_t reg,
+			char* value,
+			std::stop_token st = {});
+
+private:
+	struct Worker{
+		std::mutex mutex;
+		std::condition_variable_any cv;
+		std::deque<Op*> queue;
+		std::jthread thread;
+	};
+
+	//the worker of the config's bus, same notion of a bus as the driver's batch calls
+	unsigned route(PCA9685_config* config)
+	{
+		uintptr_t bus = config->transport ? (uintptr_t)config->transport : ~(uintptr_t)config->i2cFile;
+		auto it = routes_.find(bus);
+
+		if(it == routes_.end())
+			it = routes_.emplace(bus, (unsigned)(routes_.size() % workers_.size())).first;
+
+		return it->second;
+	}
+
+	void submit(Op* op)
+	{
+		Worker& w = workers_[op->worker];
+
+		if(stopping_){
+			op->state = Op::CANCELLED;
+			op->err = PCA9685_ERR_CANCELLED;
+			complete(op);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(w.mutex);
+			op->state = Op::QUEUED;
+			w.queue.push_back(op);
+		}
+		w.cv.notify_one();
+	}
+
+	//takes a still queued operation out of its queue and completes it as cancelled
+	void cancel(Op* op)
+	{
+		Worker& w = workers_[op->worker];
+		{
+			std::lock_guard<std::mutex> lock(w.mutex);
+			if(op->state != Op::QUEUED)
+				return;
+
+			for(auto it = w.queue.begin();it != w.queue.end();++it){
+				if(*it == op){
+					w.queue.erase(it);
+					break;
+				}
+			}
+			op->state = Op::CANCELLED;
+		}
+
+		op->err = PCA9685_ERR_CANCELLED;
+		complete(op);
+	}
+
+	void complete(Op* op)
+	{
+		uint64_t one = 1;
+		{
+			std::lock_guard<std::mutex> lock(done_mutex_);
+			done_.push_back(op);
+		}
+		//the counter only saturates after 2^64 - 1 posts, the write cannot block in practice
+		(void)!write(efd_, &one, sizeof(one));
+	}
+
+	void work(unsigned i,
+			std::stop_token st)
+	{
+		Worker& w = workers_[i];
+		Op* op;
+
+		for(;;){
+			{
+				std::unique_lock<std::mutex> lock(w.mutex);
+				//on stop, leave the queue to the destructor even if it is not empty
+				if(!w.cv.wait(lock, st, [&w]{ return !w.queue.empty(); }) || st.stop_requested())
+					return;
+
+				op = w.queue.front();
+				w.queue.pop_front();
+				op->state = Op::RUNNING;
+			}
+
+			op->err = op->run();
+			complete(op);
+		}
+	}
+
+	int efd_;
+	std::mutex done_mutex_;
+	std::vector<Op*> done_;
+	std::vector<Worker> workers_;
+	std::unordered_map<uintptr_t, unsigned> routes_;//bus -> worker, loop thread only
+	bool stopping_ = false;
+};
+
+/*
+ *
+ * Awaitable returned by Executor::call and friends; co_await yields the driver's error code.
+ */
+template<class F>
+class Executor::Call : private Op{
+public:
+	Call(Executor& ex,
+			unsigned worker,
+			F fn,
+			std::stop_token st)
+		: ex_(ex), fn_(std::move(fn)), st_(std::move(st))
+	{
+		this->worker = worker;
+	}
+
+	bool await_ready()
+	{
+		if(!st_.stop_requested())
+			return false;
+
+		err = PCA9685_ERR_CANCELLED;
+		return true;
+	}
+
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		waiter = h;
+		ex_.submit(this);
+		//resumption only happens in poll() on this thread, so the op outlives this call
+		if(st_.stop_possible())
+			cancel_.emplace(st_, Canceller{this});
+	}
+
+	int await_resume()
+	{
+		cancel_.reset();
+		return err;
+	}
+
+private:
+	struct Canceller{
+		Call* call;
+		void operator()() const { call->ex_.cancel(call); }
+	};
+
+	int run() override { return fn_(); }
+
+	Executor& ex_;
+	F fn_;
+	std::stop_token st_;
+	std::optional<std::stop_callback<Canceller>> cancel_;
+};
+
+inline auto Executor::flush(PCA9685_config* config,
+		PCA9685_WORD_t channels,
+		std::stop_token st)
+{
+	return call(config, [config, channels]{ return PCA9685_updateChannels(channels, config); }, std::move(st));
+}
+
+inline auto Executor::updateRange(PCA9685_config* config,
+		uint8_t channel_start,
+		uint8_t channel_end,
+		std::stop_token st)
+{
+	return call(config, [config, channel_start, channel_end]{
+		return PCA9685_updateChannelRange(channel_start, channel_end, config); }, std::move(st));
+}
+
+inline auto Executor::service(PCA9685_config* config,
+		std::stop_token st)
+{
+	return call(config, [config]{ return PCA9685_service(config); }, std::move(st));
+}
+
+inline auto Executor::readReg(PCA9685_config* config,
+		uint8_t reg,
+		char* value,
+		std::stop_token st)
+{
+	return call(config, [config, reg, value]{ return PCA9685_readReg(reg, value, config); }, std::move(st));
+}
+
+template<class T> class Task;
+
+namespace detail{
+
+template<class T>
+struct PromiseBase{
+	std::coroutine_handle<> continuation;
+	std::exception_ptr exception;
+
+	struct FinalAwaiter{
+		bool await_ready() noexcept { return false; }
+		template<class P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			auto next = h.promise().continuation;
+			return next ? next : std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template<class T>
+struct Promise : PromiseBase<T>{
+	std::optional<T> value;
+
+	Task<T> get_return_object();
+	void return_value(T v) { value.emplace(std::move(v)); }
+	T result()
+	{
+		if(this->exception)
+			std::rethrow_exception(this->exception);
+		return std::move(*value);
+	}
+};
+
+template<>
+struct Promise<void> : PromiseBase<void>{
+	Task<void> get_return_object();
+	void return_void() {}
+	void result()
+	{
+		if(this->exception)
+			std::rethrow_exception(this->exception);
+	}
+};
+
+}//namespace detail
+
+/*
+ *
+ * Lazy coroutine: starts when awaited (or spawned), resumes its awaiter when it finishes.
+ */
+template<class T = int>
+class Task{
+public:
+	using promise_type = detail::Promise<T>;
+
+	explicit Task(std::coroutine_handle<promise_type> h) : h_(h) {}
+	Task(Task&& o) noexcept : h_(std::exchange(o.h_, {})) {}
+	Task(const Task&) = delete;
+	~Task() { if(h_) h_.destroy(); }
+
+	bool await_ready() const noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+	{
+		h_.promise().continuation = awaiter;
+		return h_;
+	}
+
+	T await_resume() { return h_.promise().result(); }
+
+private:
+	std::coroutine_handle<promise_type> h_;
+};
+
+template<class T>
+Task<T> detail::Promise<T>::get_return_object()
+{
+	return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> detail::Promise<void>::get_return_object()
+{
+	return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+namespace detail{
+
+struct Detached{
+	struct promise_type{
+		Detached get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+}//namespace detail
+
+/*
+ *
+ * Runs a task to completion on its own; it frees itself when done. It runs on the calling
+ * thread up to its first co_await and then on whichever thread calls Executor::poll().
+ */
+template<class T>
+inline void spawn(Task<T> task)
+{
+	[](Task<T> t) -> detail::Detached { co_await t; }(std::move(task));
+}
+
+}//namespace pca9685
+
+#endif /* PWM_PCA9685_CORO_HPP_ */
@@ -0,0 +1,322 @@
+
+
+#include <string.h>
+
+#include "pwm-pca9685-emu.h"
+
+#define MODE1_SLEEP (1<<4)
+#define LED_FULL (1<<4)
+#define TICKS 4096
+
+static void __emu_run(PCA9685_emu* emu, int d, uint64_t until_ns);
+static void __emu_sync(PCA9685_emu* emu, int d);
+static void __emu_write(PCA9685_emu* emu, int d, int channel);
+static void __emu_apply(PCA9685_emuChannel* c);
+static void __emu_level(PCA9685_emu* emu, int d, int channel, uint64_t t_ns, int level);
+static uint64_t __emu_width(PCA9685_emuDevice* dev, PCA9685_emuChannel* c);
+static uint64_t __emu_osc_Hz(PCA9685_emu* emu, uint8_t prescale, uint8_t mode1);
+
+void PCA9685_emuInit(PCA9685_emu* emu,
+		uint32_t osc_freq_Hz,
+		uint32_t bus_clock_Hz)
+{
+	memset(emu, 0, sizeof(*emu));
+
+	PCA9685_simInit(&emu->sim);
+	emu->transport.transfer = PCA9685_emuTransfer;
+	emu->transport.ctx = emu;
+	emu->osc_freq = osc_freq_Hz;
+	emu->bus_clock = bus_clock_Hz;
+}
+
+int PCA9685_emuAddDevice(PCA9685_emu* emu,
+		uint8_t dev_address)
+{
+	PCA9685_simDevice* sdev = PCA9685_simAddDevice(&emu->sim, dev_address);
+	int d, i;
+
+	if(!sdev)
+		return PCA9685_ERR_BOUNDS;
+
+	d = sdev - emu->sim.devs;
+	memset(&emu->devs[d], 0, sizeof(emu->devs[d]));
+	emu->devs[d].mode1 = sdev->regs[PCA9685_REG_MODE1];
+	memcpy(emu->devs[d].led, &sdev->regs[PCA9685_REG_LEDX_ON_L], PCA9685_LED_REGS);
+	emu->devs[d].processed_ns = emu->now_ns;
+
+	for(i=0;i<PCA9685_MAXCHAN;++i)
+		emu->devs[d].ch[i].full_off = 1;
+
+	return d;
+}
+
+void PCA9685_emuAdvance(PCA9685_emu* emu,
+		uint64_t ns)
+{
+	int d;
+
+	emu->now_ns += ns;
+
+	for(d=0;d<emu->sim.n_devs;++d)
+		__emu_run(emu, d, emu->now_ns);
+}
+
+PCA9685_emuChannel* PCA9685_emuChannelOf(PCA9685_emu* emu,
+		uint8_t dev_address,
+		uint8_t channel)
+{
+	PCA9685_simDevice* sdev = PCA9685_simFindDevice(&emu->sim, dev_address);
+
+	if(!sdev || channel >= PCA9685_MAXCHAN)
+		return NULL;
+
+	return &emu->devs[sdev - emu->sim.devs].ch[channel];
+}
+
+/*
+ *
+ * Runs the transfer on the register model, advances the clock by its wire time and applies
+ * whatever changed at the STOP.
+ */
+int PCA9685_emuTransfer(void* ctx,
+		PCA9685_msg* msgs,
+		int n_msgs)
+{
+	PCA9685_emu* emu = (PCA9685_emu*)ctx;
+	uint64_t bits = 1;//STOP
+	int i, d, err;
+
+	err = PCA9685_simTransfer(&emu->sim, msgs, n_msgs);
+
+	for(i=0;i<n_msgs;++i)
+		bits += 1 + 9 * (1 + msgs[i].len);//START, address, payload
+
+	PCA9685_emuAdvance(emu, bits * 1000000000u / emu->bus_clock);
+
+	for(d=0;d<emu->sim.n_devs;++d)
+		__emu_sync(emu, d);
+
+	return err;
+}
+
+static void __emu_sync(PCA9685_emu* emu,
+		int d)
+{
+	PCA9685_emuDevice* dev = &emu->devs[d];
+	uint8_t* regs = emu->sim.devs[d].regs;
+	uint8_t mode1 = regs[PCA9685_REG_MODE1];
+	int i;
+
+	if((dev->mode1 ^ mode1) & MODE1_SLEEP){
+		if(mode1 & MODE1_SLEEP){
+			for(i=0;i<PCA9685_MAXCHAN;++i)
+				__emu_level(emu, d, i, emu->now_ns, 0);
+			dev->running = 0;
+		}
+		else{
+			dev->running = 1;
+			dev->cycle_ns = (uint64_t)TICKS * (regs[PCA9685_REG_PRESCALE] + 1) * 1000000000u /
+					__emu_osc_Hz(emu, regs[PCA9685_REG_PRESCALE], mode1);
+			dev->origin_ns = emu->now_ns + ((mode1 & PCA9685_SETTING_MODE1_EXTCLK) ? 0 : PCA9685_EMU_OSC_STARTUP_ns);
+			dev->cycle = 0;
+			dev->processed_ns = emu->now_ns;
+		}
+	}
+	dev->mode1 = mode1;
+
+	for(i=0;i<PCA9685_MAXCHAN;++i){
+		if(memcmp(&dev->led[i << 2], &regs[PCA9685_REG_LEDX_ON_L + (i << 2)], 4)){
+			memcpy(&dev->led[i << 2], &regs[PCA9685_REG_LEDX_ON_L + (i << 2)], 4);
+			__emu_write(emu, d, i);
+		}
+	}
+}
+
+static void __emu_write(PCA9685_emu* emu,
+		int d,
+		int channel)
+{
+	PCA9685_emuDevice* dev = &emu->devs[d];
+	PCA9685_emuChannel* c = &dev->ch[channel];
+	uint8_t* led = &dev->led[channel << 2];
+
+	c->p_on = ((led[1] & 0x0F) << 8) | led[0];
+	c->p_off = ((led[3] & 0x0F) << 8) | led[2];
+	c->p_full_on = !!(led[1] & LED_FULL);
+	c->p_full_off = !!(led[3] & LED_FULL);
+	c->has_pending = 1;
+	c->writes++;
+
+	//a stopped counter has no cycle to wait for
+	if(emu->apply_mode == PCA9685_EMU_APPLY_IMMEDIATE || !dev->running){
+		__emu_apply(c);
+		if(c->full_off || c->full_on)
+			__emu_level(emu, d, channel, emu->now_ns, c->full_on && !c->full_off);
+		else if(!dev->running)
+			__emu_level(emu, d, channel, emu->now_ns, 0);
+	}
+}
+
+static void __emu_apply(PCA9685_emuChannel* c)
+{
+	if(!c->has_pending)
+		return;
+
+	c->on = c->p_on;
+	c->off = c->p_off;
+	c->full_on = c->p_full_on;
+	c->full_off = c->p_full_off;
+	c->has_pending = 0;
+}
+
+/*
+ *
+ * Plays the counter forward to until_ns, one cycle (or part of one) at a time.
+ */
+static void __emu_run(PCA9685_emu* emu,
+		int d,
+		uint64_t until_ns)
+{
+	PCA9685_emuDevice* dev = &emu->devs[d];
+	PCA9685_emuChannel* c;
+	uint64_t start, end, seg_end, t_on, t_off;
+	int i;
+
+	while(dev->running && dev->processed_ns < until_ns){
+
+		start = dev->origin_ns + dev->cycle * dev->cycle_ns;
+		end = start + dev->cycle_ns;
+
+		//oscillator still starting
+		if(until_ns <= start)
+			break;
+		if(dev->processed_ns < start)
+			dev->processed_ns = start;
+
+		seg_end = until_ns < end ? until_ns : end;
+
+		for(i=0;i<PCA9685_MAXCHAN;++i){
+			c = &dev->ch[i];
+
+			if(c->full_off || c->full_on){
+				__emu_level(emu, d, i, dev->processed_ns, c->full_on && !c->full_off);
+				continue;
+			}
+
+			t_on = start + c->on * dev->cycle_ns / TICKS;
+			t_off = start + c->off * dev->cycle_ns / TICKS;
+
+			if(c->on == c->off){
+				if(t_off >= dev->processed_ns && t_off < seg_end)
+					__emu_level(emu, d, i, t_off, 0);
+			}
+			else if(c->on < c->off){
+				if(t_on >= dev->processed_ns && t_on < seg_end)
+					__emu_level(emu, d, i, t_on, 1);
+				if(t_off >= dev->processed_ns && t_off < seg_end)
+					__emu_level(emu, d, i, t_off, 0);
+			}
+			else{
+				if(t_off >= dev->processed_ns && t_off < seg_end)
+					__emu_level(emu, d, i, t_off, 0);
+				if(t_on >= dev->processed_ns && t_on < seg_end)
+					__emu_level(emu, d, i, t_on, 1);
+			}
+		}
+
+		dev->processed_ns = seg_end;
+
+		if(seg_end == end){
+			dev->cycle++;
+			for(i=0;i<PCA9685_MAXCHAN;++i){
+				c = &dev->ch[i];
+				if(c->writes > 1)
+					c->dropped += c->writes - 1;
+				c->writes = 0;
+				__emu_apply(c);
+			}
+		}
+	}
+
+	if(!dev->running)
+		dev->processed_ns = until_ns;
+}
+
+static void __emu_level(PCA9685_emu* emu,
+		int d,
+		int channel,
+		uint64_t t_ns,
+		int level)
+{
+	PCA9685_emuDevice* dev = &emu->devs[d];
+	PCA9685_emuChannel* c = &dev->ch[channel];
+	uint64_t width, expected, tol = dev->cycle_ns / TICKS + 1;
+
+	if(c->level == level)
+		return;
+
+	c->level = level;
+
+	if(emu->on_edge)
+		emu->on_edge(emu->edge_ctx, d, channel, t_ns, level);
+
+	if(level){
+		c->rise_ns = t_ns;
+		c->rise_expected_ns = __emu_width(dev, c);
+		return;
+	}
+
+	width = t_ns - c->rise_ns;
+	expected = __emu_width(dev, c);
+
+	c->pulses++;
+	c->last_width_ns = width;
+
+	if(emu->runt_ns && width < emu->runt_ns)
+		c->runts++;
+
+	//a full-on pulse is as long as the output was held, not one cycle
+	if(c->rise_expected_ns >= dev->cycle_ns || !dev->running)
+		return;
+
+	if((width > c->rise_expected_ns + tol || width + tol < c->rise_expected_ns) &&
+			(width > expected + tol || width + tol < expected))
+		c->glitches++;
+}
+
+static uint64_t __emu_width(PCA9685_emuDevice* dev,
+		PCA9685_emuChannel* c)
+{
+	if(c->full_off)
+		return 0;
+	if(c->full_on)
+		return dev->cycle_ns;
+
+	return ((c->off - c->on) & (TICKS - 1)) * dev->cycle_ns / TICKS;
+}
+
+/*
+ *
+ * The internal oscillator runs faster at high prescale values; modelled the way the driver's
+ * prescale calculation assumes (pwm-pca9685-user.c), so a requested period comes out as asked.
+ * An external clock runs at its nominal frequency.
+ */
+static uint64_t __emu_osc_Hz(PCA9685_emu* emu,
+		uint8_t prescale,
+		uint8_t mode1)
+{
+	uint64_t hz;
+
+	if(mode1 & PCA9685_SETTING_MODE1_EXTCLK)
+		return emu->osc_freq;
+
+	if(prescale <= PCA9685_INTOSC_LOW_PRESCALE)
+		hz = PCA9685_INTOSC_LOW_Hz;
+	else if(prescale >= PCA9685_INTOSC_HIGH_PRESCALE)
+		hz = PCA9685_INTOSC_HIGH_Hz;
+	else
+		hz = PCA9685_INTOSC_LOW_Hz + (uint64_t)(PCA9685_INTOSC_HIGH_Hz - PCA9685_INTOSC_LOW_Hz) *
+				(prescale - PCA9685_INTOSC_LOW_PRESCALE) / (PCA9685_INTOSC_HIGH_PRESCALE - PCA9685_INTOSC_LOW_PRESCALE);
+
+	return hz * emu->osc_freq / PCA9685_DEFAULT_OSC;
+}
@@ -0,0 +1,107 @@
+/*
+ * pwm-pca9685-emu.h
+ *
+ *	Waveform-level PCA9685 emulator.
+ *
+ *	Wraps the simulated bus and turns the register write stream into per-channel output edges on a
+ *	virtual clock: the 4096-tick counter running at osc / (prescale + 1) (with the internal
+ *	oscillator's drift over the prescale range that the driver corrects for), ON/OFF compare
+ *	ticks, the full-on and full-off bits (full-off wins), SLEEP stopping the outputs and the 500us
+ *	oscillator start-up after wake. Every transfer advances the clock by its wire time at bus_clock, and
+ *	PCA9685_emuAdvance moves it between updates, so a test runs as fast as the CPU allows.
+ *
+ *	Writes latch on STOP. With PCA9685_EMU_APPLY_CYCLE (default, what the datasheet describes)
+ *	they take effect at the next counter wrap; with PCA9685_EMU_APPLY_IMMEDIATE the new compare
+ *	values are live at once, which is the worst case for mid-cycle updates.
+ *
+ *	Per channel it counts pulses and flags:
+ *		runts		high pulses shorter than runt_ns
+ *		glitches	pulses matching neither the old nor the new commanded width
+ *		dropped		values overwritten before they ran for a whole cycle
+ *
+ */
+#ifndef PWM_PCA9685_EMU_H_
+#define PWM_PCA9685_EMU_H_
+
+#include "pwm-pca9685-sim.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define PCA9685_EMU_APPLY_CYCLE		0
+#define PCA9685_EMU_APPLY_IMMEDIATE	1
+
+#define PCA9685_EMU_OSC_STARTUP_ns	500000
+
+typedef struct PCA9685_emuChannel{
+	//results
+	uint32_t pulses;
+	uint32_t runts;
+	uint32_t glitches;
+	uint32_t dropped;
+	uint64_t last_width_ns;
+
+	//state
+	uint8_t level;
+	uint8_t full_on;
+	uint8_t full_off;
+	uint16_t on;
+	uint16_t off;
+	uint64_t rise_ns;
+	uint64_t rise_expected_ns;
+	uint32_t writes;//writes since the start of the cycle
+	uint8_t has_pending;
+	uint8_t p_full_on;
+	uint8_t p_full_off;
+	uint16_t p_on;
+	uint16_t p_off;
+} PCA9685_emuChannel;
+
+typedef struct PCA9685_emuDevice{
+	uint8_t running;
+	uint64_t origin_ns;//start of cycle 0
+	uint64_t cycle_ns;
+	uint64_t cycle;//cycle index of processed_ns
+	uint64_t processed_ns;
+	uint8_t mode1;
+	uint8_t led[PCA9685_LED_REGS];
+	PCA9685_emuChannel ch[PCA9685_MAXCHAN];
+} PCA9685_emuDevice;
+
+typedef struct PCA9685_emu{
+	PCA9685_transport transport;
+	PCA9685_sim sim;
+	PCA9685_emuDevice devs[PCA9685_SIM_MAXDEV];
+	uint64_t now_ns;
+	uint32_t osc_freq;
+	uint32_t bus_clock;
+	uint32_t runt_ns;//0 disables runt detection
+	uint8_t apply_mode;
+	void (*on_edge)(void* ctx, int dev, int channel, uint64_t t_ns, int level);
+	void* edge_ctx;
+} PCA9685_emu;
+
+void PCA9685_emuInit(PCA9685_emu* emu,
+		uint32_t osc_freq_Hz,
+		uint32_t bus_clock_Hz);
+
+int PCA9685_emuAddDevice(PCA9685_emu* emu,
+		uint8_t dev_address);
+
+void PCA9685_emuAdvance(PCA9685_emu* emu,
+		uint64_t ns);
+
+PCA9685_emuChannel* PCA9685_emuChannelOf(PCA9685_emu* emu,
+		uint8_t dev_address,
+		uint8_t channel);
+
+int PCA9685_emuTransfer(void* emu,
+		PCA9685_msg* msgs,
+		int n_msgs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PWM_PCA9685_EMU_H_ */
@@ -0,0 +1,419 @@
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "pwm-pca9685-fleet.h"
+
+#define ARENA_ALIGN 64
+#define ALIGN_UP(x) (((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct fleet_bus_job{
+	PCA9685_fleet* fleet;
+	PCA9685_fleetBus* bus;
+	uint64_t settings_ns;
+	uint64_t channels_ns;
+	uint64_t wake_ns;
+	uint8_t on_caller;//no thread could be started: runs on the caller, without the rt profile
+	int err;
+} fleet_bus_job;
+
+static int __open_buses(PCA9685_fleet* fleet);
+static PCA9685_fleetBus* __bus_of(PCA9685_fleet* fleet, int i2cbus);
+static void* __init_bus(void* arg);
+static uint64_t __now_ns(void);
+
+/*
+ *
+ * Lays out one arena: ticks | dirty | dirty_boards | frames | slot | configs | config_ptrs, each
+ * section cache-line aligned.
+ * Boards are ordered by bus, keeping the descriptor order within a bus.
+ */
+int PCA9685_fleetCreate(PCA9685_fleet* fleet,
+		const PCA9685_boardDesc* boards,
+		int n_boards)
+{
+	size_t ticks_size, dirty_size, bitmap_size, frames_size, slot_size, configs_size, ptrs_size;
+	uint8_t* p;
+	int i, j, b;
+
+	if(!fleet || !boards || n_boards <= 0 || n_boards > 0xFFFF)
+		return PCA9685_ERR_BOUNDS;
+
+	memset(fleet, 0, sizeof(*fleet));
+
+	for(i=0;i<n_boards;++i){
+		for(j=0;j<fleet->n_buses;++j)
+			if(fleet->buses[j].i2cbus == boards[i].i2cbus)
+				break;
+
+		if(j == fleet->n_buses){
+			if(fleet->n_buses >= PCA9685_FLEET_MAXBUSES)
+				return PCA9685_ERR_BOUNDS;
+			fleet->buses[j].i2cbus = boards[i].i2cbus;
+			fleet->buses[j].i2cFile = -1;
+			fleet->n_buses++;
+		}
+		fleet->buses[j].n_boards++;
+	}
+
+	ticks_size = ALIGN_UP(n_boards * PCA9685_MAXCHAN * sizeof(PCA9685_WORD_t));
+	dirty_size = ALIGN_UP(n_boards * sizeof(PCA9685_WORD_t));
+	bitmap_size = ALIGN_UP((n_boards + 63) / 64 * sizeof(uint64_t));
+	frames_size = ALIGN_UP(n_boards * sizeof(PCA9685_tickFrame));
+	slot_size = ALIGN_UP(n_boards * sizeof(uint16_t));
+	configs_size = ALIGN_UP(n_boards * sizeof(PCA9685_config));
+	ptrs_size = ALIGN_UP(n_boards * sizeof(PCA9685_config*));
+
+	fleet->arena_size = ticks_size + dirty_size + bitmap_size + frames_size + slot_size + configs_size + ptrs_size;
+	if(posix_memalign(&fleet->arena, ARENA_ALIGN, fleet->arena_size))
+		return PCA9685_ERR_BOUNDS;
+	memset(fleet->arena, 0, fleet->arena_size);
+
+	p = (uint8_t*)fleet->arena;
+	fleet->ticks = (PCA9685_WORD_t*)p;
+	fleet->dirty = (PCA9685_WORD_t*)(p += ticks_size);
+	fleet->dirty_boards = (uint64_t*)(p += dirty_size);
+	fleet->frames = (PCA9685_tickFrame*)(p += bitmap_size);
+	fleet->slot = (uint16_t*)(p += frames_size);
+	fleet->configs = (PCA9685_config*)(p += slot_size);
+	fleet->config_ptrs = (PCA9685_config**)(p += configs_size);
+
+	for(b=0;b<n_boards;++b)
+		fleet->config_ptrs[b] = &fleet->configs[b];
+
+	for(b=0, j=0;j<fleet->n_buses;++j){
+		fleet->buses[j].first_board = b;
+		for(i=0;i<n_boards;++i)
+			if(boards[i].i2cbus == fleet->buses[j].i2cbus)
+				fleet->slot[i] = b++;
+	}
+
+	fleet->descs = boards;
+	fleet->n_boards = n_boards;
+
+	return PCA9685_ERR_NOERR;
+}
+
+int PCA9685_fleetSetBusTransport(PCA9685_fleet* fleet,
+		int i2cbus,
+		PCA9685_transport* transport)
+{
+	int j;
+	for(j=0;j<fleet->n_buses;++j){
+		if(fleet->buses[j].i2cbus == i2cbus){
+			fleet->buses[j].transport = transport;
+			return PCA9685_ERR_NOERR;
+		}
+	}
+
+	return PCA9685_ERR_BOUNDS;
+}
+
+/*
+ *
+ * Runs the fleet's threads under the profile and prefaults the arena with it. Locking the
+ * memory stays with the program, see PCA9685_rtLockMemory.
+ */
+int PCA9685_fleetSetRtProfile(PCA9685_fleet* fleet,
+		const PCA9685_rtProfile* profile)
+{
+	if(!fleet || !fleet->arena)
+		return PCA9685_ERR_NO_CONFIG;
+
+	fleet->rt = profile;
+
+	if(profile)
+		PCA9685_rtPrefault(fleet->arena, fleet->arena_size);
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Opens every bus once and configures its boards one by one.
+ */
+int PCA9685_fleetConfig(PCA9685_fleet* fleet)
+{
+	PCA9685_fleetBus* bus;
+	const PCA9685_boardDesc* d;
+	PCA9685_config* config;
+	int i, err;
+
+	if(err = __open_buses(fleet))
+		return err;
+
+	for(i=0;i<fleet->n_boards;++i){
+		d = &fleet->descs[i];
+		config = &fleet->configs[fleet->slot[i]];
+		bus = __bus_of(fleet, d->i2cbus);
+
+		config->i2c_bus = bus->i2cbus;
+		config->transport = bus->transport;
+
+		if(err = PCA9685_config_only(config, bus->i2cFile, d->dev_address, d->mode1_settings,
+				d->mode2_settings, d->pwm_period_us, d->osc_freq_Hz))
+			return err;
+	}
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Full bring-up: configure, write the channels (the current fleet ticks) and wake every board.
+ * Each bus runs on its own thread, its boards' settings and wake writes batched into a few
+ * transfers. The rt profile only ever applies to those threads, never to the caller. The oscillator start-up is waited for once, for the whole fleet, at the end;
+ * with PCA9685_fleetConfig followed by a PCA9685_wake per board it is paid once per board.
+ */
+int PCA9685_fleetInit(PCA9685_fleet* fleet,
+		PCA9685_fleetInitReport* report)
+{
+	fleet_bus_job jobs[PCA9685_FLEET_MAXBUSES];
+	pthread_t threads[PCA9685_FLEET_MAXBUSES];
+	PCA9685_fleetInitReport r;
+	PCA9685_fleetBus* bus;
+	const PCA9685_boardDesc* d;
+	PCA9685_config* config;
+	uint64_t t0, t;
+	int i, j, err, ret = PCA9685_ERR_NOERR;
+
+	if(!fleet || !fleet->arena)
+		return PCA9685_ERR_NO_CONFIG;
+
+	memset(&r, 0, sizeof(r));
+	t0 = __now_ns();
+
+	if(err = __open_buses(fleet))
+		return err;
+
+	for(i=0;i<fleet->n_boards;++i){
+		d = &fleet->descs[i];
+		config = &fleet->configs[fleet->slot[i]];
+		bus = __bus_of(fleet, d->i2cbus);
+
+		config->i2c_bus = bus->i2cbus;
+		config->transport = bus->transport;
+
+		if(err = PCA9685_config_prepare(config, bus->i2cFile, d->dev_address, d->mode1_settings,
+				d->mode2_settings, d->pwm_period_us, d->osc_freq_Hz))
+			return err;
+	}
+
+	r.open_ns = __now_ns() - t0;
+
+	for(j=0;j<fleet->n_buses;++j){
+		memset(&jobs[j], 0, sizeof(jobs[j]));
+		jobs[j].fleet = fleet;
+		jobs[j].bus = &fleet->buses[j];
+
+		if(pthread_create(&threads[j], NULL, __init_bus, &jobs[j])){
+			threads[j] = pthread_self();
+			jobs[j].on_caller = 1;
+			__init_bus(&jobs[j]);
+		}
+	}
+
+	for(j=0;j<fleet->n_buses;++j){
+		if(!pthread_equal(threads[j], pthread_self()))
+			pthread_join(threads[j], NULL);
+
+		if(jobs[j].err)
+			ret = jobs[j].err;
+
+		if(jobs[j].settings_ns > r.settings_ns)
+			r.settings_ns = jobs[j].settings_ns;
+		if(jobs[j].channels_ns > r.channels_ns)
+			r.channels_ns = jobs[j].channels_ns;
+		if(jobs[j].wake_ns > r.wake_ns)
+			r.wake_ns = jobs[j].wake_ns;
+	}
+
+	//the bus threads cleared the dirty words of what they wrote, the bitmap follows
+	for(i=0;i<fleet->n_boards;++i)
+		if(!fleet->dirty[i])
+			fleet->dirty_boards[i >> 6] &= ~(1ull << (i & 63));
+
+	if(ret == PCA9685_ERR_NOERR){
+		t = __now_ns();
+		usleep(PCA9685_OSC_STARTUP_us);
+		r.osc_wait_ns = __now_ns() - t;
+	}
+
+	r.total_ns = __now_ns() - t0;
+
+	if(report)
+		*report = r;
+
+	return ret;
+}
+
+/*
+ *
+ * One bus of PCA9685_fleetInit: batched settings, then every channel of the bus's boards in
+ * shared transfers, then batched wake.
+ */
+static void* __init_bus(void* arg)
+{
+	fleet_bus_job* job = (fleet_bus_job*)arg;
+	PCA9685_fleet* fleet = job->fleet;
+	PCA9685_fleetBus* bus = job->bus;
+	PCA9685_config** configs = &fleet->config_ptrs[bus->first_board];
+	PCA9685_tickFrame* frames = &fleet->frames[bus->first_board];
+	uint64_t t;
+	int b, err;
+
+	//a thread that does not get its profile still brings its bus up, just with more jitter
+	if(fleet->rt && !job->on_caller)
+		PCA9685_rtApply(fleet->rt);
+
+	t = __now_ns();
+	if(job->err = PCA9685_config_batch(configs, bus->n_boards))
+		return NULL;
+	job->settings_ns = __now_ns() - t;
+
+	//the bus's own slice of the frames scratch, the other bus threads use theirs
+	t = __now_ns();
+	for(b=0;b<bus->n_boards;++b){
+		frames[b].config = configs[b];
+		frames[b].channels = 0xFFFF;
+		frames[b].off_ticks = &fleet->ticks[(bus->first_board + b) * PCA9685_MAXCHAN];
+	}
+
+	err = PCA9685_updateChannelTicks_batch(frames, bus->n_boards);
+
+	for(b=0;b<bus->n_boards;++b)
+		if(!frames[b].channels)
+			fleet->dirty[bus->first_board + b] = 0;
+	job->channels_ns = __now_ns() - t;
+
+	if(job->err = err)
+		return NULL;
+
+	t = __now_ns();
+	job->err = PCA9685_wake_batch(configs, bus->n_boards, 0);
+	job->wake_ns = __now_ns() - t;
+
+	return NULL;
+}
+
+static int __open_buses(PCA9685_fleet* fleet)
+{
+	char i2cpath[16];
+	PCA9685_fleetBus* bus;
+	int j;
+
+	for(j=0;j<fleet->n_buses;++j){
+		bus = &fleet->buses[j];
+
+		if(!bus->transport && bus->i2cFile < 0){
+			snprintf(i2cpath, sizeof(i2cpath), "/dev/i2c-%d", bus->i2cbus);
+			bus->i2cFile = open(i2cpath, O_RDWR);
+			if(bus->i2cFile < 0){
+				perror("i2cOpen");
+				return PCA9685_ERR_I2CfOPEN;
+			}
+		}
+	}
+
+	return PCA9685_ERR_NOERR;
+}
+
+static PCA9685_fleetBus* __bus_of(PCA9685_fleet* fleet,
+		int i2cbus)
+{
+	int j;
+	for(j=0;fleet->buses[j].i2cbus != i2cbus;++j)
+		;
+
+	return &fleet->buses[j];
+}
+
+static uint64_t __now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ *
+ * Sends every dirty board's dirty channels. The dirty bitmap is walked in board order, so the
+ * frames come out grouped by bus and each bus gets as few transfers as its messages allow.
+ * A board that fails stays dirty.
+ */
+int PCA9685_fleetFlush(PCA9685_fleet* fleet)
+{
+	uint64_t bits;
+	int w, b, i, n = 0, err;
+
+	for(w=0;w<(fleet->n_boards + 63) / 64;++w){
+		for(bits=fleet->dirty_boards[w];bits;bits&=bits-1){
+			b = (w << 6) + __builtin_ctzll(bits);
+
+			fleet->frames[n].config = &fleet->configs[b];
+			fleet->frames[n].channels = fleet->dirty[b];
+			fleet->frames[n].off_ticks = &fleet->ticks[b * PCA9685_MAXCHAN];
+			++n;
+		}
+	}
+
+	if(n == 0)
+		return PCA9685_ERR_NOERR;
+
+	err = PCA9685_updateChannelTicks_batch(fleet->frames, n);
+
+	for(i=0;i<n;++i){
+		if(fleet->frames[i].channels)
+			continue;
+
+		b = (int)(fleet->frames[i].config - fleet->configs);
+		fleet->dirty[b] = 0;
+		fleet->dirty_boards[b >> 6] &= ~(1ull << (b & 63));
+	}
+
+	return err;
+}
+
+int PCA9685_fleetService(PCA9685_fleet* fleet)
+{
+	int b, err, ret = PCA9685_ERR_NOERR;
+
+	for(b=0;b<fleet->n_boards;++b)
+		if(err = PCA9685_service(&fleet->configs[b]))
+			ret = err;
+
+	return ret;
+}
+
+int PCA9685_fleetDestroy(PCA9685_fleet* fleet)
+{
+	int j;
+
+	if(!fleet)
+		return PCA9685_ERR_NO_CONFIG;
+
+	for(j=0;j<fleet->n_buses;++j)
+		if(fleet->buses[j].i2cFile >= 0)
+			close(fleet->buses[j].i2cFile);
+
+	free(fleet->arena);
+	memset(fleet, 0, sizeof(*fleet));
+
+	return PCA9685_ERR_NOERR;
+}
+
+PCA9685_config* PCA9685_fleetConfigOf(PCA9685_fleet* fleet,
+		int board)
+{
+	if(board < 0 || board >= fleet->n_boards)
+		return NULL;
+
+	return &fleet->configs[fleet->slot[board]];
+}
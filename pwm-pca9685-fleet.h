@@ -0,0 +1,125 @@
+/*
+ * pwm-pca9685-fleet.h
+ *
+ *	Fleet descriptor for large numbers of boards.
+ *
+ *	All boards live in one contiguous arena. The per-frame state (off ticks and a dirty word per
+ *	board) is kept in dense arrays at the front, apart from the configs, and boards are stored
+ *	grouped by bus, so a control tick over hundreds of boards walks a few linear arrays. A bitmap
+ *	of the dirty boards lets a flush skip untouched ones 64 at a time, and the boards of a bus
+ *	share combined transfers (PCA9685_updateChannelTicks_batch).
+ *	Each bus is opened once and shared by its boards.
+ *
+ */
+#ifndef PWM_PCA9685_FLEET_H_
+#define PWM_PCA9685_FLEET_H_
+
+#include <stddef.h>
+#include "pwm-pca9685-user.h"
+#include "pwm-pca9685-rt.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define PCA9685_FLEET_MAXBUSES		16
+
+typedef struct PCA9685_boardDesc{
+	int i2cbus;
+	uint8_t dev_address;
+	uint8_t mode1_settings;
+	uint8_t mode2_settings;
+	uint32_t pwm_period_us;
+	uint32_t osc_freq_Hz;
+} PCA9685_boardDesc;
+
+typedef struct PCA9685_fleetBus{
+	int i2cbus;
+	int i2cFile;
+	PCA9685_transport* transport;//NULL: /dev/i2c-N
+	int first_board;
+	int n_boards;
+} PCA9685_fleetBus;
+
+//PCA9685_fleetInit phase times, in ns. The bus phases are the slowest bus.
+typedef struct PCA9685_fleetInitReport{
+	uint64_t open_ns;
+	uint64_t settings_ns;
+	uint64_t channels_ns;
+	uint64_t wake_ns;
+	uint64_t osc_wait_ns;
+	uint64_t total_ns;
+} PCA9685_fleetInitReport;
+
+typedef struct PCA9685_fleet{
+	//hot: touched every frame
+	PCA9685_WORD_t* ticks;//[board][channel]
+	PCA9685_WORD_t* dirty;//[board]
+	uint64_t* dirty_boards;//[board / 64], bit set: dirty[board] != 0
+	PCA9685_tickFrame* frames;//[board], scratch of PCA9685_fleetFlush and the bring-up
+	uint16_t* slot;//descriptor index -> board index
+
+	//cold
+	PCA9685_config* configs;//[board], grouped by bus
+	PCA9685_config** config_ptrs;//[board], &configs[board], for the batch calls
+	PCA9685_fleetBus buses[PCA9685_FLEET_MAXBUSES];
+	const PCA9685_boardDesc* descs;
+	const PCA9685_rtProfile* rt;//applied to the bring-up threads, NULL: none
+	int n_boards;
+	int n_buses;
+	void* arena;
+	size_t arena_size;
+} PCA9685_fleet;
+
+int PCA9685_fleetCreate(PCA9685_fleet* fleet,
+		const PCA9685_boardDesc* boards,
+		int n_boards);
+
+int PCA9685_fleetSetBusTransport(PCA9685_fleet* fleet,
+		int i2cbus,
+		PCA9685_transport* transport);
+
+int PCA9685_fleetSetRtProfile(PCA9685_fleet* fleet,
+		const PCA9685_rtProfile* profile);
+
+int PCA9685_fleetConfig(PCA9685_fleet* fleet);
+
+int PCA9685_fleetInit(PCA9685_fleet* fleet,
+		PCA9685_fleetInitReport* report);//may be NULL
+
+int PCA9685_fleetFlush(PCA9685_fleet* fleet);
+
+int PCA9685_fleetService(PCA9685_fleet* fleet);
+
+int PCA9685_fleetDestroy(PCA9685_fleet* fleet);
+
+PCA9685_config* PCA9685_fleetConfigOf(PCA9685_fleet* fleet,
+		int board);
+
+//board is the board index (fleet order)
+static inline void PCA9685_fleetMarkTicks(PCA9685_fleet* fleet,
+		int board,
+		uint8_t channel,
+		PCA9685_WORD_t off_ticks)
+{
+	fleet->ticks[board * PCA9685_MAXCHAN + channel] = off_ticks;
+	fleet->dirty[board] |= (PCA9685_WORD_t)(1 << channel);
+	fleet->dirty_boards[board >> 6] |= 1ull << (board & 63);
+}
+
+//board is the index into the descriptor array passed to PCA9685_fleetCreate
+static inline void PCA9685_fleetSetTicks(PCA9685_fleet* fleet,
+		int board,
+		uint8_t channel,
+		PCA9685_WORD_t off_ticks)
+{
+	int b = fleet->slot[board];
+
+	PCA9685_fleetMarkTicks(fleet, b, channel, off_ticks);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PWM_PCA9685_FLEET_H_ */
@@ -0,0 +1,156 @@
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pwm-pca9685-map.h"
+
+static int __board_of(PCA9685_fleet* fleet, int i2cbus, uint8_t dev_address);
+
+/*
+ *
+ * Builds the id tables and sets the calibrations on the fleet's boards, so the fleet must be
+ * configured (PCA9685_fleetConfig or PCA9685_fleetInit) first: the calibrations are compiled for
+ * the board's period. A calibration shared by several actuators must be on boards with the same
+ * period. PCA9685_ERR_BOUNDS for an actuator whose board is not in the fleet or a duplicate id.
+ */
+int PCA9685_mapCreate(PCA9685_map* map,
+		PCA9685_fleet* fleet,
+		const PCA9685_actuatorDesc* actuators,
+		int n_actuators)
+{
+	const PCA9685_actuatorDesc* a;
+	uint32_t n_ids = 0;
+	int i, b, err;
+
+	if(!map || !fleet || !fleet->arena || !actuators || n_actuators <= 0)
+		return PCA9685_ERR_BOUNDS;
+
+	memset(map, 0, sizeof(*map));
+
+	for(i=0;i<n_actuators;++i)
+		if((uint32_t)actuators[i].id + 1 > n_ids)
+			n_ids = actuators[i].id + 1;
+
+	map->route = (uint32_t*)malloc(n_ids * sizeof(*map->route));
+	map->cal = (PCA9685_calibration**)calloc(n_ids, sizeof(*map->cal));
+	if(!map->route || !map->cal){
+		PCA9685_mapDestroy(map);
+		return PCA9685_ERR_BOUNDS;
+	}
+	memset(map->route, 0xFF, n_ids * sizeof(*map->route));
+
+	map->fleet = fleet;
+	map->n_ids = n_ids;
+
+	for(i=0;i<n_actuators;++i){
+		a = &actuators[i];
+
+		if(a->channel >= PCA9685_MAXCHAN || map->route[a->id] != PCA9685_MAP_NONE ||
+				(b = __board_of(fleet, a->i2cbus, a->dev_address)) < 0){
+			PCA9685_mapDestroy(map);
+			return PCA9685_ERR_BOUNDS;
+		}
+
+		if(a->cal && (err = PCA9685_setCalibration(a->channel, a->cal, &fleet->configs[b]))){
+			PCA9685_mapDestroy(map);
+			return err;
+		}
+
+		map->route[a->id] = (uint32_t)b << 4 | a->channel;
+		map->cal[a->id] = a->cal;
+	}
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Scatters the values into the fleet's tick and dirty arrays without sending anything; of two
+ * entries for the same id the later one wins. Entries with an unmapped id or raw ticks above
+ * PCA9685_MAX_TICK are skipped and counted in map->rejected (PCA9685_ERR_BOUNDS if any).
+ */
+int PCA9685_mapStage(PCA9685_map* map,
+		const PCA9685_actuatorValue* values,
+		int n_values)
+{
+	PCA9685_fleet* fleet;
+	PCA9685_WORD_t ticks;
+	uint32_t r, rejected = 0;
+	int i;
+
+	if(!map || !map->fleet)
+		return PCA9685_ERR_NO_CONFIG;
+
+	fleet = map->fleet;
+
+	for(i=0;i<n_values;++i){
+
+		if(values[i].id >= map->n_ids || (r = map->route[values[i].id]) == PCA9685_MAP_NONE){
+			rejected++;
+			continue;
+		}
+
+		if(map->cal[values[i].id])
+			ticks = PCA9685_calibrationTicks(map->cal[values[i].id], values[i].value);
+		else if(values[i].value <= PCA9685_MAX_TICK)
+			ticks = values[i].value;
+		else{
+			rejected++;
+			continue;
+		}
+
+		PCA9685_fleetMarkTicks(fleet, r >> 4, r & 0xF, ticks);
+	}
+
+	map->rejected = rejected;
+
+	return rejected ? PCA9685_ERR_BOUNDS : PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Stages the batch and flushes the fleet: the boards with a changed actuator share one transfer
+ * per bus (more only past the I2C_RDWR message limit), untouched boards are not visited. The
+ * valid entries are sent even if some were rejected.
+ */
+int PCA9685_mapSet(PCA9685_map* map,
+		const PCA9685_actuatorValue* values,
+		int n_values)
+{
+	int err, stage_err;
+
+	stage_err = PCA9685_mapStage(map, values, n_values);
+	if(stage_err == PCA9685_ERR_NO_CONFIG)
+		return stage_err;
+
+	if(err = PCA9685_fleetFlush(map->fleet))
+		return err;
+
+	return stage_err;
+}
+
+int PCA9685_mapDestroy(PCA9685_map* map)
+{
+	if(!map)
+		return PCA9685_ERR_NO_CONFIG;
+
+	free(map->route);
+	free(map->cal);
+	memset(map, 0, sizeof(*map));
+
+	return PCA9685_ERR_NOERR;
+}
+
+//board index (fleet order) of a bus/address pair, -1 if it is not in the fleet
+static int __board_of(PCA9685_fleet* fleet,
+		int i2cbus,
+		uint8_t dev_address)
+{
+	int i;
+	for(i=0;i<fleet->n_boards;++i)
+		if(fleet->descs[i].i2cbus == i2cbus && fleet->descs[i].dev_address == dev_address)
+			return fleet->slot[i];
+
+	return -1;
+}
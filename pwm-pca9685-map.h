@@ -0,0 +1,65 @@
+/*
+ * pwm-pca9685-map.h
+ *
+ *	Logical actuator map on top of a fleet.
+ *
+ *	Each actuator id is routed to (bus, board address, channel) and optionally a calibration, so
+ *	application code sets actuators by id and rewiring a harness only changes the descriptor table.
+ *	PCA9685_mapSet takes a batch of (id, value) pairs in any order: they are scattered into the
+ *	fleet's per-board tick arrays in one pass, and the flush then sends the touched boards of each
+ *	bus in one combined transfer (split only past the I2C_RDWR limit of 42 messages). Nothing is
+ *	allocated after PCA9685_mapCreate.
+ *
+ */
+#ifndef PWM_PCA9685_MAP_H_
+#define PWM_PCA9685_MAP_H_
+
+#include "pwm-pca9685-fleet.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define PCA9685_MAP_NONE	0xFFFFFFFFu
+
+typedef struct PCA9685_actuatorDesc{
+	uint16_t id;
+	int i2cbus;
+	uint8_t dev_address;
+	uint8_t channel;
+	PCA9685_calibration* cal;//NULL: values are raw off ticks
+} PCA9685_actuatorDesc;
+
+typedef struct PCA9685_actuatorValue{
+	uint16_t id;
+	uint16_t value;//command (0 - 65535) when calibrated, off ticks otherwise
+} PCA9685_actuatorValue;
+
+typedef struct PCA9685_map{
+	PCA9685_fleet* fleet;
+	uint32_t* route;//[id] board index << 4 | channel, PCA9685_MAP_NONE: unmapped
+	PCA9685_calibration** cal;//[id]
+	uint32_t n_ids;//highest id + 1
+	uint32_t rejected;//entries skipped by the last stage: unmapped id or ticks out of range
+} PCA9685_map;
+
+int PCA9685_mapCreate(PCA9685_map* map,
+		PCA9685_fleet* fleet,
+		const PCA9685_actuatorDesc* actuators,
+		int n_actuators);
+
+int PCA9685_mapStage(PCA9685_map* map,
+		const PCA9685_actuatorValue* values,
+		int n_values);
+
+int PCA9685_mapSet(PCA9685_map* map,
+		const PCA9685_actuatorValue* values,
+		int n_values);
+
+int PCA9685_mapDestroy(PCA9685_map* map);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PWM_PCA9685_MAP_H_ */
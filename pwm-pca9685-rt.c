@@ -0,0 +1,260 @@
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "pwm-pca9685-rt.h"
+#include "pwm-pca9685-sim.h"
+
+static void __prefault_stack(void);
+static int __memory_locked(void);
+static uint64_t __now_ns(void);
+
+/*
+ *
+ * Locks the whole process's memory, current and future mappings, so nothing the driver touches
+ * is paged out. Process-wide: call it once from the program's own startup, before
+ * PCA9685_rtApply so the stack it prefaults stays in. PCA9685_ERR_RT without CAP_IPC_LOCK or a
+ * large enough RLIMIT_MEMLOCK.
+ */
+int PCA9685_rtLockMemory(void)
+{
+	if(mlockall(MCL_CURRENT | MCL_FUTURE)){
+		perror("mlockall");
+		return PCA9685_ERR_RT;
+	}
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Applies the profile to the calling thread. Every step is attempted; PCA9685_ERR_RT if any of
+ * them failed (typically missing privileges), see PCA9685_rtCheck for which. Memory is left
+ * alone, that is PCA9685_rtLockMemory.
+ */
+int PCA9685_rtApply(const PCA9685_rtProfile* profile)
+{
+	struct sched_param param;
+	cpu_set_t cpus;
+	int ret = PCA9685_ERR_NOERR;
+
+	if(!profile)
+		return PCA9685_ERR_RT;
+
+	if(profile->cpu >= 0){
+		CPU_ZERO(&cpus);
+		CPU_SET(profile->cpu, &cpus);
+		if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)){
+			fprintf(stderr, "rt: couldnt pin to cpu %d\n", profile->cpu);
+			ret = PCA9685_ERR_RT;
+		}
+	}
+
+	if(profile->priority > 0){
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = profile->priority;
+		if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)){
+			fprintf(stderr, "rt: couldnt set SCHED_FIFO %d\n", profile->priority);
+			ret = PCA9685_ERR_RT;
+		}
+	}
+
+	if(profile->prefault_stack)
+		__prefault_stack();
+
+	return ret;
+}
+
+/*
+ *
+ * Self-test: reports which parts of the profile are in effect for the calling thread.
+ * The prefault is checked by touching the stack again and counting the minor faults it costs.
+ * PCA9685_ERR_RT if anything requested is not active.
+ */
+int PCA9685_rtCheck(const PCA9685_rtProfile* profile,
+		PCA9685_rtStatus* status)
+{
+	struct sched_param param;
+	struct rusage before, after;
+	cpu_set_t cpus;
+	int policy;
+
+	if(!profile || !status)
+		return PCA9685_ERR_RT;
+
+	memset(status, 0, sizeof(*status));
+
+	if(profile->priority > 0)
+		status->requested |= PCA9685_RT_FIFO;
+	if(profile->cpu >= 0)
+		status->requested |= PCA9685_RT_AFFINITY;
+	if(profile->lock_memory)
+		status->requested |= PCA9685_RT_MLOCK;
+	if(profile->prefault_stack)
+		status->requested |= PCA9685_RT_PREFAULT;
+
+	if(!pthread_getschedparam(pthread_self(), &policy, &param) && policy == SCHED_FIFO){
+		status->active |= PCA9685_RT_FIFO;
+		status->priority = param.sched_priority;
+	}
+
+	if(profile->cpu >= 0 && !pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus) &&
+			CPU_COUNT(&cpus) == 1 && CPU_ISSET(profile->cpu, &cpus))
+		status->active |= PCA9685_RT_AFFINITY;
+
+	if(__memory_locked())
+		status->active |= PCA9685_RT_MLOCK;
+
+	getrusage(RUSAGE_THREAD, &before);
+	__prefault_stack();
+	getrusage(RUSAGE_THREAD, &after);
+
+	status->minor_faults = after.ru_minflt - before.ru_minflt;
+	if(status->minor_faults == 0)
+		status->active |= PCA9685_RT_PREFAULT;
+
+	return (status->requested & ~status->active) ? PCA9685_ERR_RT : PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Touches every page of a buffer so its first use on the hot path does not fault.
+ * Writes back what it reads, the contents are unchanged.
+ */
+void PCA9685_rtPrefault(void* mem,
+		size_t size)
+{
+	volatile uint8_t* p = (volatile uint8_t*)mem;
+	long page = sysconf(_SC_PAGESIZE);
+	size_t i;
+
+	if(!mem || !size)
+		return;
+
+	for(i=0;i<size;i+=page)
+		p[i] = p[i];
+	p[size - 1] = p[size - 1];
+}
+
+/*
+ *
+ * Worst case latency on the calling thread: wakes up once per pwm period on an absolute
+ * CLOCK_MONOTONIC timer and sends a full 16 channel update to a simulated board. Reports the
+ * wakeup lateness and the update time (max and average) and the faults and involuntary context
+ * switches seen during the run. Apply the profile first to measure it.
+ */
+int PCA9685_rtLatency(uint32_t pwm_period_us,
+		uint32_t frames,
+		PCA9685_rtReport* report)
+{
+	PCA9685_sim sim;
+	PCA9685_config config;
+	PCA9685_WORD_t ticks[PCA9685_MAXCHAN];
+	struct rusage before, after;
+	struct timespec next;
+	uint64_t deadline, t0, t1, wakeup_sum = 0, frame_sum = 0;
+	uint32_t f;
+	int i, err;
+
+	if(!report || !frames)
+		return PCA9685_ERR_BOUNDS;
+
+	memset(report, 0, sizeof(*report));
+	memset(&config, 0, sizeof(config));
+
+	PCA9685_simInit(&sim);
+	PCA9685_simAddDevice(&sim, 0x80);
+	PCA9685_setTransport(&sim.transport, &config);
+
+	if((err = PCA9685_config_only(&config, 0, 0x80, PCA9685_SETTING_MODE1_DEFAULTS | PCA9685_SETTING_MODE1_AUTOINCR,
+			PCA9685_SETTING_MODE2_DEFAULTS, pwm_period_us, PCA9685_DEFAULT_OSC)) ||
+			(err = PCA9685_wake(&config)))
+		return err;
+
+	getrusage(RUSAGE_THREAD, &before);
+
+	deadline = __now_ns();
+	for(f=0;f<frames;++f){
+
+		deadline += (uint64_t)pwm_period_us * 1000;
+		next.tv_sec = deadline / 1000000000u;
+		next.tv_nsec = deadline % 1000000000u;
+		while((err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)) == EINTR)
+			;
+		if(err){
+			fprintf(stderr, "rt: couldnt sleep until the next frame: %s\n", strerror(err));
+			return PCA9685_ERR_RT;
+		}
+
+		t0 = __now_ns();
+		for(i=0;i<PCA9685_MAXCHAN;++i)
+			ticks[i] = (PCA9685_WORD_t)((f + i * 256) & PCA9685_MAX_TICK);
+
+		if(err = PCA9685_updateChannelTicks(0xFFFF, ticks, &config))
+			return err;
+		t1 = __now_ns();
+
+		if(t0 - deadline > report->wakeup_max_ns)
+			report->wakeup_max_ns = t0 - deadline;
+		if(t1 - t0 > report->frame_max_ns)
+			report->frame_max_ns = t1 - t0;
+		wakeup_sum += t0 - deadline;
+		frame_sum += t1 - t0;
+	}
+
+	getrusage(RUSAGE_THREAD, &after);
+
+	report->frames = frames;
+	report->wakeup_avg_ns = wakeup_sum / frames;
+	report->frame_avg_ns = frame_sum / frames;
+	report->minor_faults = after.ru_minflt - before.ru_minflt;
+	report->major_faults = after.ru_majflt - before.ru_majflt;
+	report->involuntary_switches = after.ru_nivcsw - before.ru_nivcsw;
+
+	return PCA9685_ERR_NOERR;
+}
+
+static void __attribute__((noinline)) __prefault_stack(void)
+{
+	volatile uint8_t stack[PCA9685_RT_STACK_PREFAULT];
+	size_t i;
+
+	for(i=0;i<sizeof(stack);i+=256)
+		stack[i] = 0;
+}
+
+static int __memory_locked(void)
+{
+	char line[128];
+	long kb = 0;
+	FILE* f = fopen("/proc/self/status", "r");
+
+	if(!f)
+		return 0;
+
+	while(fgets(line, sizeof(line), f))
+		if(sscanf(line, "VmLck: %ld", &kb) == 1)
+			break;
+
+	fclose(f);
+
+	return kb > 0;
+}
+
+static uint64_t __now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,78 @@
+/*
+ * pwm-pca9685-rt.h
+ *
+ *	Real-time profile for the threads that drive the boards (the daemon loop, fleet bus threads
+ *	or the application's own control thread).
+ *
+ *	PCA9685_rtApply puts the calling thread on SCHED_FIFO, pins it to a CPU and prefaults the
+ *	stack, so a frame does not stall on a page fault or behind other work. It only touches the
+ *	calling thread. Locking memory is process-wide (mlockall covers every thread and every later
+ *	mapping), so it is a separate call, PCA9685_rtLockMemory, made once by the program that owns
+ *	the process (e.g. from main, before the threads start), never by a library on its behalf.
+ *	The driver's transmit buffers live on the stack of the flushing thread; long-lived
+ *	buffers (fleet arena, shm, trace ring) are prefaulted with PCA9685_rtPrefault.
+ *	SCHED_FIFO and mlockall need CAP_SYS_NICE / CAP_IPC_LOCK (or matching rlimits);
+ *	PCA9685_rtCheck reports what actually took effect.
+ *
+ */
+#ifndef PWM_PCA9685_RT_H_
+#define PWM_PCA9685_RT_H_
+
+#include <stddef.h>
+#include "pwm-pca9685-user.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define PCA9685_RT_FIFO			(1 << 0)
+#define PCA9685_RT_AFFINITY		(1 << 1)
+#define PCA9685_RT_MLOCK		(1 << 2)
+#define PCA9685_RT_PREFAULT		(1 << 3)
+
+#define PCA9685_RT_STACK_PREFAULT	(64 * 1024)
+
+typedef struct PCA9685_rtProfile{
+	int priority;//SCHED_FIFO 1..99, 0: leave the policy alone
+	int cpu;//-1: no pinning
+	uint8_t lock_memory;//expect PCA9685_rtLockMemory to have run (checked, not applied)
+	uint8_t prefault_stack;//touch PCA9685_RT_STACK_PREFAULT bytes of stack
+} PCA9685_rtProfile;
+
+typedef struct PCA9685_rtStatus{
+	int requested;//PCA9685_RT_* asked for by the profile
+	int active;//PCA9685_RT_* in effect for the calling thread
+	int priority;
+	long minor_faults;//minor faults of the calling thread while rerunning the prefault
+} PCA9685_rtStatus;
+
+typedef struct PCA9685_rtReport{
+	uint32_t frames;
+	uint64_t wakeup_max_ns;//lateness of the periodic wakeup
+	uint64_t wakeup_avg_ns;
+	uint64_t frame_max_ns;//one full 16 channel update on the simulated bus
+	uint64_t frame_avg_ns;
+	long minor_faults;
+	long major_faults;
+	long involuntary_switches;
+} PCA9685_rtReport;
+
+int PCA9685_rtLockMemory(void);
+
+int PCA9685_rtApply(const PCA9685_rtProfile* profile);
+
+int PCA9685_rtCheck(const PCA9685_rtProfile* profile,
+		PCA9685_rtStatus* status);
+
+void PCA9685_rtPrefault(void* mem,
+		size_t size);
+
+int PCA9685_rtLatency(uint32_t pwm_period_us,
+		uint32_t frames,
+		PCA9685_rtReport* report);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PWM_PCA9685_RT_H_ */
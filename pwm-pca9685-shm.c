@@ -0,0 +1,419 @@
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "pwm-pca9685-shm.h"
+
+#define SHM_MAGIC 0x53414350 //"PCAS"
+#define SHM_VERSION 3
+#define SHM_SPIN_LIMIT 4096 //tries at a held slot, or reads of an odd seqlock, before giving up for now
+#define SHM_ALIVE_CHECK 64 //spins between checks that the holder of a slot is still alive
+
+_Static_assert(sizeof(PCA9685_shmBoard) == 128, "board slot should span two cache lines");
+
+static int __shm_map(PCA9685_shm** shm, const char* name, int oflags);
+static void __shm_ring(PCA9685_shm* shm);
+static int __shm_lock(PCA9685_shm* shm, PCA9685_shmBoard* b);
+static int __shm_reclaim(PCA9685_shm* shm, PCA9685_shmBoard* b, uint32_t holder);
+static void __shm_reap(PCA9685_shm* shm, PCA9685_shmBoard* b);
+static int __pid_alive(uint32_t pid);
+static int __shm_dirty(PCA9685_shm* shm);
+
+//this process, recorded as the slot holder; cached since getpid() is a syscall
+static uint32_t __shm_pid;
+
+int PCA9685_shmOpen(PCA9685_shm** shm,
+		const char* name)
+{
+	int err;
+
+	if(err = __shm_map(shm, name, O_RDWR))
+		return err;
+
+	if((*shm)->magic != SHM_MAGIC || (*shm)->version != SHM_VERSION){
+		PCA9685_shmClose(*shm);
+		return PCA9685_ERR_NO_FILE;
+	}
+
+	__shm_pid = getpid();
+
+	return PCA9685_ERR_NOERR;
+}
+
+int PCA9685_shmClose(PCA9685_shm* shm)
+{
+	if(!shm)
+		return PCA9685_ERR_NO_FILE;
+
+	munmap(shm, sizeof(*shm));
+
+	return PCA9685_ERR_NOERR;
+}
+
+int PCA9685_shmFindBoard(PCA9685_shm* shm,
+		int i2cbus,
+		uint8_t dev_address)
+{
+	uint32_t i;
+	for(i=0;i<shm->n_boards;++i)
+		if(shm->boards[i].bus == i2cbus && shm->boards[i].dev_address == dev_address)
+			return i;
+
+	return PCA9685_ERR_BOUNDS;
+}
+
+/*
+ *
+ * Publishes new duty times for a set of channels. Writers on the same board are serialised by
+ * the slot's lock word; the daemon never blocks them. PCA9685_ERR_BUS_LOCK if another live
+ * writer holds the slot for longer than the bounded spin.
+ */
+int PCA9685_shmSetChannels(PCA9685_shm* shm,
+		int board,
+		PCA9685_WORD_t channels,
+		const uint32_t* dutyTime_us)
+{
+	PCA9685_shmBoard* b;
+	uint32_t seq;
+	int i, err;
+
+	if(board < 0 || (uint32_t)board >= shm->n_boards)
+		return PCA9685_ERR_BOUNDS;
+
+	b = &shm->boards[board];
+
+	if(err = __shm_lock(shm, b))
+		return err;
+
+	//the seqlock, for the daemon's lock-free reads: even -> odd
+	seq = __atomic_load_n(&b->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&b->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for(i=0;i<PCA9685_MAXCHAN;++i)
+		if(channels & (1 << i))
+			__atomic_store_n(&b->dutyTime_us[i], dutyTime_us[i], __ATOMIC_RELAXED);
+
+	__atomic_fetch_or(&b->dirty, channels, __ATOMIC_RELAXED);
+	__atomic_store_n(&b->seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&b->lock, 0, __ATOMIC_RELEASE);
+
+	__shm_ring(shm);
+
+	return PCA9685_ERR_NOERR;
+}
+
+int PCA9685_shmSetChannel(PCA9685_shm* shm,
+		int board,
+		uint8_t channel,
+		uint32_t dutyTime_us)
+{
+	uint32_t duty[PCA9685_MAXCHAN];
+
+	if(channel >= PCA9685_MAXCHAN)
+		return PCA9685_ERR_BOUNDS;
+
+	duty[channel] = dutyTime_us;
+
+	return PCA9685_shmSetChannels(shm, board, 1 << channel, duty);
+}
+
+/*
+ *
+ * Creates the segment, or reattaches to the one a previous daemon left behind: clients may still
+ * have it mapped, so it is never truncated. The duty times they wrote are kept and the board list
+ * starts over. Fails while the daemon that created it is still alive. A segment of another
+ * version is unlinked (its clients keep the old, dead mapping) and created anew.
+ */
+int PCA9685_shmCreate(PCA9685_shm** shm,
+		const char* name)
+{
+	PCA9685_shm* s;
+	int err;
+
+	__shm_pid = getpid();
+
+	if(!(err = __shm_map(shm, name, O_RDWR | O_CREAT | O_EXCL))){
+		s = *shm;
+		s->version = SHM_VERSION;
+		s->daemon_pid = __shm_pid;
+		__atomic_store_n(&s->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+		return PCA9685_ERR_NOERR;
+	}
+	if(errno != EEXIST)
+		return err;
+
+	if(err = __shm_map(shm, name, O_RDWR)){
+		if(errno != EINVAL)
+			return err;
+	}
+	else{
+		s = *shm;
+		if(__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) == SHM_MAGIC && s->version == SHM_VERSION){
+			if(s->daemon_pid != __shm_pid && __pid_alive(s->daemon_pid)){
+				fprintf(stderr, "shmCreate: %s is in use by pid %u\n", name, s->daemon_pid);
+				PCA9685_shmClose(s);
+				return PCA9685_ERR_NO_FILE;
+			}
+
+			s->daemon_pid = __shm_pid;
+			s->n_boards = 0;
+			s->daemon_waiting = 0;
+			s->daemon_polling = 0;
+			return PCA9685_ERR_NOERR;
+		}
+		PCA9685_shmClose(s);
+	}
+
+	shm_unlink(name);
+
+	return PCA9685_shmCreate(shm, name);
+}
+
+int PCA9685_shmDestroy(PCA9685_shm* shm,
+		const char* name)
+{
+	PCA9685_shmClose(shm);
+	shm_unlink(name);
+
+	return PCA9685_ERR_NOERR;
+}
+
+int PCA9685_shmAddBoard(PCA9685_shm* shm,
+		int i2cbus,
+		uint8_t dev_address)
+{
+	if(shm->n_boards >= PCA9685_SHM_MAXBOARDS)
+		return PCA9685_ERR_BOUNDS;
+
+	shm->boards[shm->n_boards].bus = i2cbus;
+	shm->boards[shm->n_boards].dev_address = dev_address;
+
+	return shm->n_boards++;
+}
+
+/*
+ *
+ * Waits for client updates, at most timeout_us (pass the PWM period). While updates keep coming
+ * it just sleeps timeout_us and returns, without advertising itself: clients make no syscalls
+ * and their updates are picked up once per period, which is as often as the governor sends
+ * anyway. After a period without updates it sleeps on the doorbell; clients only make the futex
+ * syscall while daemon_waiting is set (the first one clears it), so the flag is raised before
+ * the last check for dirty boards.
+ */
+int PCA9685_shmWait(PCA9685_shm* shm,
+		uint32_t timeout_us)
+{
+	struct timespec ts;
+	uint32_t bell, i;
+
+	//slots held by dead clients, dirty or not: nothing else would ever free them
+	for(i=0;i<shm->n_boards;++i)
+		__shm_reap(shm, &shm->boards[i]);
+
+	if(__shm_dirty(shm))
+		return PCA9685_ERR_NOERR;
+
+	ts.tv_sec = timeout_us / 1000000;
+	ts.tv_nsec = (timeout_us % 1000000) * 1000;
+
+	if(shm->daemon_polling){
+		nanosleep(&ts, NULL);
+		shm->daemon_polling = __shm_dirty(shm);
+		return PCA9685_ERR_NOERR;
+	}
+
+	bell = __atomic_load_n(&shm->doorbell, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&shm->daemon_waiting, 1, __ATOMIC_SEQ_CST);
+
+	if(!__shm_dirty(shm))
+		syscall(SYS_futex, &shm->doorbell, FUTEX_WAIT, bell, &ts, NULL, 0);
+
+	__atomic_store_n(&shm->daemon_waiting, 0, __ATOMIC_RELAXED);
+	shm->daemon_polling = __shm_dirty(shm);
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Copies the board's dirty channels into config->channels and returns which ones changed.
+ * A slot held by a dead writer is taken back first. A seqlock that stays odd for SHM_SPIN_LIMIT
+ * reads belongs to a live but stalled writer: the board is skipped and collected on the next call.
+ */
+PCA9685_WORD_t PCA9685_shmCollect(PCA9685_shm* shm,
+		int board,
+		PCA9685_config* config)
+{
+	PCA9685_shmBoard* b = &shm->boards[board];
+	PCA9685_WORD_t dirty;
+	uint32_t seq;
+	int i, spins;
+
+	__shm_reap(shm, b);
+
+	dirty = __atomic_exchange_n(&b->dirty, 0, __ATOMIC_ACQUIRE);
+	if(!dirty)
+		return 0;
+
+	do{
+		for(spins=0;(seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE)) & 1;++spins){
+			if(spins < SHM_SPIN_LIMIT)
+				continue;
+
+			__atomic_fetch_or(&b->dirty, dirty, __ATOMIC_RELAXED);
+			return 0;
+		}
+
+		for(i=0;i<PCA9685_MAXCHAN;++i)
+			if(dirty & (1 << i))
+				config->channels[i].dutyTime_us = __atomic_load_n(&b->dutyTime_us[i], __ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}while(__atomic_load_n(&b->seq, __ATOMIC_RELAXED) != seq);
+
+	return dirty;
+}
+
+//a segment that exists but is too small (another version) fails with errno EINVAL
+static int __shm_map(PCA9685_shm** shm,
+		const char* name,
+		int oflags)
+{
+	struct stat st;
+	void* p;
+	int fd;
+
+	if(!shm || !name)
+		return PCA9685_ERR_NO_FILE;
+
+	fd = shm_open(name, oflags, 0660);
+	if(fd < 0){
+		if(errno != EEXIST)
+			perror("shmOpen");
+		return PCA9685_ERR_NO_FILE;
+	}
+
+	//a new segment is sized and zero filled here, an existing one must already be complete
+	if((oflags & O_CREAT) ? ftruncate(fd, sizeof(PCA9685_shm)) : fstat(fd, &st)){
+		perror("shmSize");
+		close(fd);
+		return PCA9685_ERR_NO_FILE;
+	}
+	if(!(oflags & O_CREAT) && (size_t)st.st_size < sizeof(PCA9685_shm)){
+		close(fd);
+		errno = EINVAL;
+		return PCA9685_ERR_NO_FILE;
+	}
+
+	p = mmap(NULL, sizeof(PCA9685_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(p == MAP_FAILED){
+		perror("shmMap");
+		return PCA9685_ERR_NO_FILE;
+	}
+
+	*shm = (PCA9685_shm*)p;
+
+	return PCA9685_ERR_NOERR;
+}
+
+//only the first client to see the daemon asleep rings, the rest find daemon_waiting cleared
+static void __shm_ring(PCA9685_shm* shm)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if(!__atomic_load_n(&shm->daemon_waiting, __ATOMIC_SEQ_CST) ||
+			!__atomic_exchange_n(&shm->daemon_waiting, 0, __ATOMIC_SEQ_CST))
+		return;
+
+	__atomic_fetch_add(&shm->doorbell, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &shm->doorbell, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+ *
+ * Takes the slot's lock word, 0 -> this pid, within SHM_SPIN_LIMIT tries; yields between them so
+ * a preempted holder on the same CPU can finish. A dead holder's slot is taken over.
+ */
+static int __shm_lock(PCA9685_shm* shm,
+		PCA9685_shmBoard* b)
+{
+	uint32_t holder;
+	int spins;
+
+	for(spins=1;spins<=SHM_SPIN_LIMIT;++spins){
+		holder = 0;
+		if(__atomic_compare_exchange_n(&b->lock, &holder, __shm_pid, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return PCA9685_ERR_NOERR;
+
+		if(spins % SHM_ALIVE_CHECK == 0 && __shm_reclaim(shm, b, holder))
+			return PCA9685_ERR_NOERR;
+
+		sched_yield();
+	}
+
+	return PCA9685_ERR_BUS_LOCK;
+}
+
+/*
+ *
+ * Takes over a slot whose holder is dead, wherever in its update it died: the lock word moves
+ * from the dead pid to this one and an odd seqlock is closed. Every duty time is a single
+ * store, so the slot holds a mix of old and new values, each of them valid. Returns 1 with the
+ * slot held by the caller, 0 if the holder is alive (or the slot changed hands meanwhile).
+ */
+static int __shm_reclaim(PCA9685_shm* shm,
+		PCA9685_shmBoard* b,
+		uint32_t holder)
+{
+	uint32_t seq;
+
+	if(!holder || __pid_alive(holder))
+		return 0;
+
+	if(!__atomic_compare_exchange_n(&b->lock, &holder, __shm_pid, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
+
+	seq = __atomic_load_n(&b->seq, __ATOMIC_RELAXED);
+	if(seq & 1)
+		__atomic_store_n(&b->seq, seq + 1, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&shm->reclaimed, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+//daemon side: frees the slot if its holder is dead
+static void __shm_reap(PCA9685_shm* shm,
+		PCA9685_shmBoard* b)
+{
+	if(__shm_reclaim(shm, b, __atomic_load_n(&b->lock, __ATOMIC_RELAXED)))
+		__atomic_store_n(&b->lock, 0, __ATOMIC_RELEASE);
+}
+
+static int __pid_alive(uint32_t pid)
+{
+	return pid && (kill((pid_t)pid, 0) == 0 || errno == EPERM);
+}
+
+static int __shm_dirty(PCA9685_shm* shm)
+{
+	uint32_t i;
+	for(i=0;i<shm->n_boards;++i)
+		if(__atomic_load_n(&shm->boards[i].dirty, __ATOMIC_SEQ_CST))
+			return 1;
+
+	return 0;
+}
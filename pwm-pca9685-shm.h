@@ -0,0 +1,99 @@
+/*
+ * pwm-pca9685-shm.h
+ *
+ *	Shared-memory interface to pca9685d, the daemon that owns the i2c buses.
+ *
+ *	Clients write per-channel duty times straight into a POSIX shared-memory segment. Each board
+ *	slot is guarded by a seqlock (writers take it with a CAS, the daemon reads it lock-free).
+ *	While updates keep coming the daemon polls once per PWM period; only after a quiet period does
+ *	it go to sleep on a futex, and only the first update after that makes the wake syscall, so a
+ *	client update is normally a few stores and no syscalls. The daemon collects dirty channels and
+ *	sends them as coalesced frames through the regular driver.
+ *
+ *	Writers take a slot by CASing their pid into its lock word, so the lock always names its holder.
+ *	A slot held by a client that died, at any point of its update, is taken back by the daemon on
+ *	its next wait or collect, or by the next writer. A live holder is never broken: a writer that
+ *	cannot get the slot within a bounded spin fails with PCA9685_ERR_BUS_LOCK. A restarted
+ *	daemon reattaches to the existing segment, so clients keep their mapping; they should look
+ *	their boards up again in case the board list changed.
+ *
+ */
+#ifndef PWM_PCA9685_SHM_H_
+#define PWM_PCA9685_SHM_H_
+
+#include "pwm-pca9685-user.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define PCA9685_SHM_DEFAULT_NAME	"/pca9685d"
+#define PCA9685_SHM_MAXBOARDS		64
+
+typedef struct PCA9685_shmBoard{
+	uint32_t seq;//seqlock, odd while a client is writing
+	uint16_t dirty;//channels written since the daemon last collected
+	uint8_t bus;
+	uint8_t dev_address;
+	uint32_t dutyTime_us[PCA9685_MAXCHAN];
+	uint32_t lock;//pid of the writer holding the slot, 0: free. Taken before seq turns odd, dropped after it is even again
+	uint8_t pad[52];//one slot per pair of cache lines
+} PCA9685_shmBoard;
+
+typedef struct PCA9685_shm{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_boards;
+	uint32_t doorbell;//futex word
+	uint32_t daemon_waiting;//set while the daemon sleeps on the doorbell, cleared by the client that rings
+	uint32_t daemon_pid;
+	uint64_t frames;//coalesced frames sent by the daemon
+	uint32_t daemon_polling;//daemon side: the last wait found work, poll instead of sleeping
+	uint32_t reclaimed;//slots taken back from clients that died holding them
+	uint8_t pad[24];
+	PCA9685_shmBoard boards[PCA9685_SHM_MAXBOARDS];
+} PCA9685_shm;
+
+//client side
+int PCA9685_shmOpen(PCA9685_shm** shm,
+		const char* name);
+
+int PCA9685_shmClose(PCA9685_shm* shm);
+
+int PCA9685_shmFindBoard(PCA9685_shm* shm,
+		int i2cbus,
+		uint8_t dev_address);
+
+int PCA9685_shmSetChannels(PCA9685_shm* shm,
+		int board,
+		PCA9685_WORD_t channels,
+		const uint32_t* dutyTime_us);
+
+int PCA9685_shmSetChannel(PCA9685_shm* shm,
+		int board,
+		uint8_t channel,
+		uint32_t dutyTime_us);
+
+//daemon side
+int PCA9685_shmCreate(PCA9685_shm** shm,
+		const char* name);
+
+int PCA9685_shmDestroy(PCA9685_shm* shm,
+		const char* name);
+
+int PCA9685_shmAddBoard(PCA9685_shm* shm,
+		int i2cbus,
+		uint8_t dev_address);
+
+int PCA9685_shmWait(PCA9685_shm* shm,
+		uint32_t timeout_us);
+
+PCA9685_WORD_t PCA9685_shmCollect(PCA9685_shm* shm,
+		int board,
+		PCA9685_config* config);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PWM_PCA9685_SHM_H_ */
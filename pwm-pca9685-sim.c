@@ -0,0 +1,169 @@
+
+
+#include <string.h>
+
+#include "pwm-pca9685-sim.h"
+
+#define MODE1_SLEEP (1<<4)
+#define LED_FULL (1<<4)
+#define ALLCALL_ADDRESS 0x70 //7-bit, power-on value of ALLCALLADR
+#define LAST_LED_REG (PCA9685_REG_LEDX_ON_L + PCA9685_LED_REGS - 1)
+
+static void __sim_write(PCA9685_simDevice* dev, uint8_t val);
+static uint8_t __sim_read(PCA9685_simDevice* dev);
+static void __sim_advance(PCA9685_simDevice* dev);
+
+void PCA9685_simInit(PCA9685_sim* sim)
+{
+	memset(sim, 0, sizeof(*sim));
+
+	sim->transport.transfer = PCA9685_simTransfer;
+	sim->transport.ctx = sim;
+}
+
+PCA9685_simDevice* PCA9685_simAddDevice(PCA9685_sim* sim,
+		uint8_t dev_address)
+{
+	PCA9685_simDevice* dev;
+
+	if(sim->n_devs >= PCA9685_SIM_MAXDEV || PCA9685_simFindDevice(sim, dev_address))
+		return NULL;
+
+	dev = &sim->devs[sim->n_devs++];
+	dev->addr = dev_address >> 1;
+	PCA9685_simReset(dev);
+
+	return dev;
+}
+
+PCA9685_simDevice* PCA9685_simFindDevice(PCA9685_sim* sim,
+		uint8_t dev_address)
+{
+	int i;
+	for(i=0;i<sim->n_devs;++i)
+		if(sim->devs[i].addr == dev_address >> 1)
+			return &sim->devs[i];
+
+	return NULL;
+}
+
+/*
+ *
+ * Power-on register contents, see table 4 of the datasheet
+ */
+void PCA9685_simReset(PCA9685_simDevice* dev)
+{
+	int i;
+
+	memset(dev->regs, 0, sizeof(dev->regs));
+	dev->ptr = 0;
+
+	dev->regs[PCA9685_REG_MODE1] = PCA9685_SETTING_MODE1_DEFAULTS;
+	dev->regs[PCA9685_REG_MODE2] = PCA9685_SETTING_MODE2_DEFAULTS;
+	dev->regs[PCA9685_REG_SUBADDR1] = 0xE2;
+	dev->regs[PCA9685_REG_SUBADDR2] = 0xE4;
+	dev->regs[PCA9685_REG_SUBADDR3] = 0xE8;
+	dev->regs[PCA9685_REG_ALLCALLADDR] = ALLCALL_ADDRESS << 1;
+	dev->regs[PCA9685_REG_PRESCALE] = 0x1E;
+
+	for(i=0;i<PCA9685_MAXCHAN;++i)
+		dev->regs[PCA9685_REG_LEDX_OFF_H + 4*i] = LED_FULL;
+}
+
+int PCA9685_simTransfer(void* ctx,
+		PCA9685_msg* msgs,
+		int n_msgs)
+{
+	PCA9685_sim* sim = (PCA9685_sim*)ctx;
+	int i, j, k, matched;
+
+	sim->n_transfers++;
+
+	for(i=0;i<n_msgs;++i){
+		matched = 0;
+		sim->n_msgs++;
+		sim->n_bytes += msgs[i].len;
+
+		for(j=0;j<sim->n_devs;++j){
+			PCA9685_simDevice* dev = &sim->devs[j];
+
+			if(dev->addr != msgs[i].addr){
+				//only writes are broadcast to the ALLCALL address
+				if(msgs[i].addr != ALLCALL_ADDRESS || (msgs[i].flags & PCA9685_MSG_RD) ||
+						!(dev->regs[PCA9685_REG_MODE1] & PCA9685_SETTING_MODE1_ALLCALL))
+					continue;
+			}
+			matched = 1;
+
+			if(msgs[i].flags & PCA9685_MSG_RD){
+				for(k=0;k<msgs[i].len;++k)
+					msgs[i].buf[k] = __sim_read(dev);
+			}
+			else if(msgs[i].len){
+				dev->ptr = msgs[i].buf[0];
+				for(k=1;k<msgs[i].len;++k)
+					__sim_write(dev, msgs[i].buf[k]);
+			}
+		}
+
+		if(!matched)
+			return (msgs[i].flags & PCA9685_MSG_RD) ? PCA9685_ERR_I2C_READ : PCA9685_ERR_I2C_WRITE;
+	}
+
+	return PCA9685_ERR_NOERR;
+}
+
+static void __sim_write(PCA9685_simDevice* dev,
+		uint8_t val)
+{
+	uint8_t reg = dev->ptr;
+	int i;
+
+	switch(reg){
+	case PCA9685_REG_MODE1:
+		//RESTART is cleared by writing a 1 to it
+		if(val & PCA9685_SETTING_MODE1_RESTART)
+			val &= ~PCA9685_SETTING_MODE1_RESTART;
+		dev->regs[reg] = val;
+		break;
+	case PCA9685_REG_PRESCALE:
+		if(dev->regs[PCA9685_REG_MODE1] & MODE1_SLEEP)
+			dev->regs[reg] = val;
+		break;
+	case PCA9685_REG_ALL_LED_ON_L:
+	case PCA9685_REG_ALL_LED_ON_H:
+	case PCA9685_REG_ALL_LED_OFF_L:
+	case PCA9685_REG_ALL_LED_OFF_H:
+		for(i=0;i<PCA9685_MAXCHAN;++i)
+			dev->regs[PCA9685_REG_LEDX_ON_L + (reg - PCA9685_REG_ALL_LED_ON_L) + 4*i] = val;
+		break;
+	default:
+		if(reg <= LAST_LED_REG)
+			dev->regs[reg] = val;
+		break;
+	}
+
+	__sim_advance(dev);
+}
+
+static uint8_t __sim_read(PCA9685_simDevice* dev)
+{
+	//ALL_LED registers always read back as zero
+	uint8_t val = (dev->ptr >= PCA9685_REG_ALL_LED_ON_L && dev->ptr <= PCA9685_REG_ALL_LED_OFF_H) ? 0 : dev->regs[dev->ptr];
+
+	__sim_advance(dev);
+
+	return val;
+}
+
+static void __sim_advance(PCA9685_simDevice* dev)
+{
+	if(!(dev->regs[PCA9685_REG_MODE1] & PCA9685_SETTING_MODE1_AUTOINCR))
+		return;
+
+	//the pointer rolls over from the last LED register back to MODE1 (and from 0xFF to 0x00)
+	if(dev->ptr == LAST_LED_REG)
+		dev->ptr = PCA9685_REG_MODE1;
+	else
+		dev->ptr++;
+}
@@ -0,0 +1,61 @@
+/*
+ * pwm-pca9685-sim.h
+ *
+ *	Simulated I2C bus carrying PCA9685 register files, for running the driver without hardware.
+ *
+ *	Attach it to a config with PCA9685_setTransport(&sim.transport, &config) before calling
+ *	PCA9685_config_only (pass any i2cfile, it is not used).
+ *
+ *	Modelled: power-on register values, auto increment, ALL_LED_* broadcast to every channel,
+ *	PRESCALE only writable in SLEEP, RESTART clear-on-write, and the ALLCALL address.
+ *	Messages to an address with no device are NACKed.
+ *
+ */
+#ifndef PWM_PCA9685_SIM_H_
+#define PWM_PCA9685_SIM_H_
+
+#include "pwm-pca9685-user.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define PCA9685_SIM_MAXDEV			16
+#define PCA9685_SIM_NUMREGS			256
+
+typedef struct PCA9685_simDevice{
+	uint8_t addr;//7-bit
+	uint8_t ptr;//register pointer
+	uint8_t regs[PCA9685_SIM_NUMREGS];
+} PCA9685_simDevice;
+
+typedef struct PCA9685_sim{
+	PCA9685_transport transport;
+	PCA9685_simDevice devs[PCA9685_SIM_MAXDEV];
+	int n_devs;
+
+	//traffic counters
+	uint32_t n_transfers;
+	uint32_t n_msgs;
+	uint32_t n_bytes;
+} PCA9685_sim;
+
+void PCA9685_simInit(PCA9685_sim* sim);
+
+PCA9685_simDevice* PCA9685_simAddDevice(PCA9685_sim* sim,
+		uint8_t dev_address);
+
+PCA9685_simDevice* PCA9685_simFindDevice(PCA9685_sim* sim,
+		uint8_t dev_address);
+
+void PCA9685_simReset(PCA9685_simDevice* dev);
+
+int PCA9685_simTransfer(void* sim,
+		PCA9685_msg* msgs,
+		int n_msgs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PWM_PCA9685_SIM_H_ */
@@ -0,0 +1,192 @@
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pwm-pca9685-state.h"
+
+#define STATE_MAGIC 0x5335383639414350ull //"PCA9685S"
+#define STATE_VERSION 1
+
+typedef struct state_header{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t capacity;
+	uint8_t pad[44];
+} state_header;
+
+struct PCA9685_state{
+	int fd;
+	size_t map_size;
+	state_header* hdr;
+	PCA9685_boardState* records;
+};
+
+static PCA9685_boardState* __find(PCA9685_state* state, int i2c_bus, uint8_t dev_address);
+
+int PCA9685_stateOpen(PCA9685_state** state,
+		const char* path,
+		uint32_t n_boards)
+{
+	PCA9685_state* s;
+	state_header hdr;
+	struct stat st;
+	uint32_t cap = n_boards;
+	int fresh;
+
+	if(!state || !path || !n_boards)
+		return PCA9685_ERR_STATE;
+
+	s = (PCA9685_state*)calloc(1, sizeof(*s));
+	if(!s)
+		return PCA9685_ERR_STATE;
+
+	s->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(s->fd < 0 || fstat(s->fd, &st)){
+		perror("stateOpen");
+		goto fail;
+	}
+
+	fresh = st.st_size == 0;
+	if(!fresh){
+		if(pread(s->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != STATE_MAGIC ||
+				hdr.version != STATE_VERSION || hdr.record_size != sizeof(PCA9685_boardState)){
+			fprintf(stderr, "stateOpen: %s is not a state file of this version\n", path);
+			goto fail;
+		}
+		if(hdr.capacity > cap)
+			cap = hdr.capacity;
+	}
+
+	//growing zero-fills, and a zero generation is an empty record
+	s->map_size = sizeof(state_header) + (size_t)cap * sizeof(PCA9685_boardState);
+	if((size_t)st.st_size < s->map_size && ftruncate(s->fd, s->map_size)){
+		perror("stateOpen");
+		goto fail;
+	}
+
+	s->hdr = (state_header*)mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+	if(s->hdr == MAP_FAILED){
+		perror("stateMap");
+		goto fail;
+	}
+
+	s->hdr->capacity = cap;
+	if(fresh){
+		s->hdr->version = STATE_VERSION;
+		s->hdr->record_size = sizeof(PCA9685_boardState);
+		__atomic_store_n(&s->hdr->magic, STATE_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	s->records = (PCA9685_boardState*)(s->hdr + 1);
+	*state = s;
+
+	return PCA9685_ERR_NOERR;
+
+fail:
+	if(s->fd >= 0)
+		close(s->fd);
+	free(s);
+	return PCA9685_ERR_STATE;
+}
+
+int PCA9685_stateClose(PCA9685_state* state)
+{
+	if(!state)
+		return PCA9685_ERR_STATE;
+
+	munmap(state->hdr, state->map_size);
+	close(state->fd);
+	free(state);
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Restores the board from its record (i2c_bus, address), claiming a free one for a board the
+ * file has not seen yet. The bus is passed in since a config set up from an open descriptor
+ * (PCA9685_config_prepare) does not know it; it is stored in config->i2c_bus.
+ * PCA9685_ERR_BOUNDS when the file is full.
+ */
+int PCA9685_stateRestore(PCA9685_state* state,
+		int i2c_bus,
+		uint8_t* outcome,
+		PCA9685_config* config)
+{
+	PCA9685_boardState* rec;
+
+	if(!config)
+		return PCA9685_ERR_NO_CONFIG;
+	if(!state)
+		return PCA9685_ERR_STATE;
+
+	config->i2c_bus = i2c_bus;
+	if(!(rec = __find(state, i2c_bus, config->dev_i2c_address)) && !(rec = __find(state, 0, 0)))
+		return PCA9685_ERR_BOUNDS;
+
+	return PCA9685_restoreState(rec, outcome, config);
+}
+
+int PCA9685_stateDetach(PCA9685_config* config)
+{
+	if(!config)
+		return PCA9685_ERR_NO_CONFIG;
+
+	if(!config->state)
+		return PCA9685_ERR_TRIVIAL_ACTION;
+
+	config->state = NULL;
+
+	return PCA9685_ERR_NOERR;
+}
+
+int PCA9685_stateForget(PCA9685_state* state,
+		int i2c_bus,
+		uint8_t dev_address)
+{
+	PCA9685_boardState* rec;
+
+	if(!state)
+		return PCA9685_ERR_STATE;
+
+	if(!dev_address || !(rec = __find(state, i2c_bus, dev_address)))
+		return PCA9685_ERR_TRIVIAL_ACTION;
+
+	memset(rec, 0, sizeof(*rec));
+
+	return PCA9685_ERR_NOERR;
+}
+
+int PCA9685_stateSync(PCA9685_state* state)
+{
+	if(!state)
+		return PCA9685_ERR_STATE;
+
+	if(msync(state->hdr, state->map_size, MS_SYNC)){
+		perror("stateSync");
+		return PCA9685_ERR_STATE;
+	}
+
+	return PCA9685_ERR_NOERR;
+}
+
+//record of a board, dev_address 0 finds a free one
+static PCA9685_boardState* __find(PCA9685_state* state,
+		int i2c_bus,
+		uint8_t dev_address)
+{
+	uint32_t i;
+	for(i=0;i<state->hdr->capacity;++i)
+		if(state->records[i].dev_address == dev_address && (!dev_address || state->records[i].i2c_bus == i2c_bus))
+			return &state->records[i];
+
+	return NULL;
+}
@@ -0,0 +1,58 @@
+/*
+ * pwm-pca9685-state.h
+ *
+ *	Crash-safe output state, so a restarted controller picks up where it left off instead of
+ *	zeroing every board.
+ *
+ *	The state file holds one PCA9685_boardState per board (bus, address), mapped shared: every flush
+ *	copies the board's committed LED registers, modes, prescale and duty times into its record,
+ *	bracketed by a generation counter, and the copy survives the process since it lives in the page
+ *	cache. On restart, PCA9685_stateRestore finds the board's record and hands it to
+ *	PCA9685_restoreState, which checks it against the device in one bulk read and resumes.
+ *
+ *		PCA9685_stateOpen(&state, "/run/pca9685.state", 4);
+ *		PCA9685_config_prepare(&cfg, fd, 0x80, ...);
+ *		PCA9685_stateRestore(state, 1, &outcome, &cfg);	//instead of config_only + setAllChannelsToZero + wake
+ *
+ *	A process crash loses nothing; surviving a power loss of the host as well needs PCA9685_stateSync.
+ *
+ */
+#ifndef PWM_PCA9685_STATE_H_
+#define PWM_PCA9685_STATE_H_
+
+#include "pwm-pca9685-user.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+typedef struct PCA9685_state PCA9685_state;
+
+//opens the file, or creates it with room for n_boards; an existing file is grown to n_boards if smaller
+int PCA9685_stateOpen(PCA9685_state** state,
+		const char* path,
+		uint32_t n_boards);
+
+//detach (PCA9685_stateDetach) every config restored from the file first
+int PCA9685_stateClose(PCA9685_state* state);
+
+int PCA9685_stateRestore(PCA9685_state* state,
+		int i2c_bus,//the N of /dev/i2c-N, part of the record's key
+		uint8_t* outcome,//PCA9685_RESTORE_*, may be NULL
+		PCA9685_config* config);
+
+int PCA9685_stateDetach(PCA9685_config* config);
+
+//forgets a board's record, e.g. when it was taken out of the harness
+int PCA9685_stateForget(PCA9685_state* state,
+		int i2c_bus,
+		uint8_t dev_address);
+
+//msync, blocking: the records reach the disk
+int PCA9685_stateSync(PCA9685_state* state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PWM_PCA9685_STATE_H_ */
@@ -0,0 +1,354 @@
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pwm-pca9685-trace.h"
+
+#define TRACE_MAGIC 0x5435383639414350ull //"PCA9685T"
+#define TRACE_VERSION 2
+#define MAX_XFER_MSGS 42
+
+typedef struct trace_header{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t capacity;
+	uint64_t head;//next record index, advanced atomically
+	uint8_t pad[32];
+} trace_header;
+
+typedef struct trace_tap{
+	PCA9685_transport transport;//must stay first
+	PCA9685_transport* inner;//NULL: i2c-dev on i2cfile
+	int i2cfile;
+	PCA9685_trace* trace;
+} trace_tap;
+
+struct PCA9685_trace{
+	int fd;
+	size_t map_size;
+	trace_header* hdr;
+	PCA9685_traceRecord* records;
+	uint64_t mask;
+	trace_tap taps[PCA9685_TRACE_MAXTAPS];
+	int n_taps;
+};
+
+static int __trace_transfer(void* ctx, PCA9685_msg* msgs, int n_msgs);
+static int __trace_urgent(void* ctx, PCA9685_msg* msgs, int n_msgs);
+static void __trace_append(PCA9685_trace* trace, uint64_t t_ns, PCA9685_msg* msgs, int n_msgs, int err);
+static uint64_t __now_ns(void);
+
+int PCA9685_traceOpen(PCA9685_trace** trace,
+		const char* path,
+		uint32_t capacity)
+{
+	PCA9685_trace* t;
+	trace_header hdr;
+	struct stat st;
+	uint64_t cap = 1;
+
+	if(!trace || !path)
+		return PCA9685_ERR_TRACE;
+
+	t = (PCA9685_trace*)calloc(1, sizeof(*t));
+	if(!t)
+		return PCA9685_ERR_TRACE;
+
+	if(capacity){
+		while(cap < capacity)
+			cap <<= 1;
+
+		t->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if(t->fd < 0 || ftruncate(t->fd, sizeof(trace_header) + cap * sizeof(PCA9685_traceRecord))){
+			perror("traceOpen");
+			goto fail;
+		}
+	}
+	else{
+		t->fd = open(path, O_RDWR);
+		if(t->fd < 0 || fstat(t->fd, &st) || pread(t->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)){
+			perror("traceOpen");
+			goto fail;
+		}
+
+		//the capacity sizes the mapping and the index mask: a corrupt or truncated file must not pass
+		if(hdr.magic != TRACE_MAGIC || hdr.version != TRACE_VERSION || hdr.record_size != sizeof(PCA9685_traceRecord) ||
+				!hdr.capacity || (hdr.capacity & (hdr.capacity - 1)) ||
+				hdr.capacity > ((uint64_t)st.st_size - sizeof(trace_header)) / sizeof(PCA9685_traceRecord)){
+			fprintf(stderr, "traceOpen: %s is not a complete trace of this version\n", path);
+			goto fail;
+		}
+		cap = hdr.capacity;
+	}
+
+	t->map_size = sizeof(trace_header) + cap * sizeof(PCA9685_traceRecord);
+	t->hdr = (trace_header*)mmap(NULL, t->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+	if(t->hdr == MAP_FAILED){
+		perror("traceMap");
+		goto fail;
+	}
+
+	if(capacity){
+		t->hdr->version = TRACE_VERSION;
+		t->hdr->record_size = sizeof(PCA9685_traceRecord);
+		t->hdr->capacity = cap;
+		t->hdr->head = 0;
+		__atomic_store_n(&t->hdr->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	t->records = (PCA9685_traceRecord*)(t->hdr + 1);
+	t->mask = cap - 1;
+	*trace = t;
+
+	return PCA9685_ERR_NOERR;
+
+fail:
+	if(t->fd >= 0)
+		close(t->fd);
+	free(t);
+	return PCA9685_ERR_TRACE;
+}
+
+int PCA9685_traceClose(PCA9685_trace* trace)
+{
+	if(!trace)
+		return PCA9685_ERR_TRACE;
+
+	munmap(trace->hdr, trace->map_size);
+	close(trace->fd);
+	free(trace);
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Puts the recorder in front of the config's current transport. Configs sharing a transport (or an
+ * i2c-dev descriptor) share one tap. Detach every config before closing the trace.
+ */
+int PCA9685_traceAttach(PCA9685_trace* trace,
+		PCA9685_config* config)
+{
+	trace_tap* tap = NULL;
+	int i;
+
+	if(!config)
+		return PCA9685_ERR_NO_CONFIG;
+	if(!trace)
+		return PCA9685_ERR_TRACE;
+
+	if(config->transport && config->transport->transfer == __trace_transfer)
+		return PCA9685_ERR_TRIVIAL_ACTION;
+
+	for(i=0;i<trace->n_taps;++i)
+		if(trace->taps[i].inner == config->transport &&
+				(config->transport || trace->taps[i].i2cfile == config->i2cFile))
+			tap = &trace->taps[i];
+
+	if(!tap){
+		if(trace->n_taps >= PCA9685_TRACE_MAXTAPS)
+			return PCA9685_ERR_BOUNDS;
+
+		tap = &trace->taps[trace->n_taps++];
+		tap->transport.transfer = __trace_transfer;
+		tap->transport.ctx = tap;
+		tap->transport.urgent = __trace_urgent;
+		tap->inner = config->transport;
+		tap->i2cfile = config->i2cFile;
+		tap->trace = trace;
+	}
+
+	config->transport = &tap->transport;
+
+	return PCA9685_ERR_NOERR;
+}
+
+int PCA9685_traceDetach(PCA9685_config* config)
+{
+	if(!config)
+		return PCA9685_ERR_NO_CONFIG;
+
+	if(!config->transport || config->transport->transfer != __trace_transfer)
+		return PCA9685_ERR_TRIVIAL_ACTION;
+
+	config->transport = ((trace_tap*)config->transport->ctx)->inner;
+
+	return PCA9685_ERR_NOERR;
+}
+
+uint64_t PCA9685_traceFirst(PCA9685_trace* trace)
+{
+	uint64_t head = __atomic_load_n(&trace->hdr->head, __ATOMIC_ACQUIRE);
+
+	return head > trace->mask ? head - trace->mask - 1 : 0;
+}
+
+uint64_t PCA9685_traceEnd(PCA9685_trace* trace)
+{
+	return __atomic_load_n(&trace->hdr->head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ *
+ * Copies one record out. Fails if it has not been completed yet or has already been overwritten.
+ */
+int PCA9685_traceGet(PCA9685_trace* trace,
+		uint64_t index,
+		PCA9685_traceRecord* record)
+{
+	PCA9685_traceRecord* rec = &trace->records[index & trace->mask];
+
+	if(__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != index + 1)
+		return PCA9685_ERR_BOUNDS;
+
+	memcpy(record, rec, sizeof(*record));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	if(__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != index + 1)
+		return PCA9685_ERR_BOUNDS;
+
+	return PCA9685_ERR_NOERR;
+}
+
+int PCA9685_traceReplay(PCA9685_trace* trace,
+		PCA9685_transport* transport,
+		uint32_t speedup)
+{
+	PCA9685_traceRecord recs[MAX_XFER_MSGS];
+	PCA9685_msg msgs[MAX_XFER_MSGS];
+	uint8_t scratch[MAX_XFER_MSGS][PCA9685_TRACE_PAYLOAD];
+	uint64_t idx, end, due, t0 = 0, base = 0;
+	struct timespec ts;
+	int n, failed, i, err;
+
+	if(!trace || !transport)
+		return PCA9685_ERR_TRACE;
+
+	end = PCA9685_traceEnd(trace);
+
+	for(idx=PCA9685_traceFirst(trace);idx<end;){
+
+		//a transfer starts at msg_index 0 and ends with PCA9685_TRACE_LAST. One with records lost to
+		//the writer or cut by the ring, or with a payload longer than a record keeps, is skipped whole
+		if(PCA9685_traceGet(trace, idx++, &recs[0]) || recs[0].msg_index != 0)
+			continue;
+
+		for(n=1;!(recs[n - 1].flags & PCA9685_TRACE_LAST) && n<MAX_XFER_MSGS && idx<end;++n, ++idx)
+			if(PCA9685_traceGet(trace, idx, &recs[n]) || recs[n].msg_index != n)
+				break;
+
+		if(!(recs[n - 1].flags & PCA9685_TRACE_LAST))
+			continue;
+
+		for(i=0, failed=0;i<n;++i)
+			failed |= (recs[i].flags & PCA9685_TRACE_FAILED) ||
+					(!(recs[i].flags & PCA9685_MSG_RD) && recs[i].len > PCA9685_TRACE_PAYLOAD);
+
+		if(failed)
+			continue;
+
+		if(!base){
+			t0 = recs[0].t_ns;
+			base = __now_ns();
+		}
+		else if(speedup){
+			due = base + (recs[0].t_ns - t0) / speedup;
+			ts.tv_sec = due / 1000000000u;
+			ts.tv_nsec = due % 1000000000u;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+
+		for(i=0;i<n;++i){
+			msgs[i].addr = recs[i].addr;
+			msgs[i].flags = recs[i].flags & PCA9685_MSG_RD;
+			msgs[i].len = recs[i].len < PCA9685_TRACE_PAYLOAD ? recs[i].len : PCA9685_TRACE_PAYLOAD;
+			msgs[i].buf = (msgs[i].flags & PCA9685_MSG_RD) ? scratch[i] : recs[i].payload;
+		}
+
+		if(err = transport->transfer(transport->ctx, msgs, n))
+			return err;
+	}
+
+	return PCA9685_ERR_NOERR;
+}
+
+static int __trace_transfer(void* ctx,
+		PCA9685_msg* msgs,
+		int n_msgs)
+{
+	trace_tap* tap = (trace_tap*)ctx;
+	uint64_t t = __now_ns();
+	int err;
+
+	if(tap->inner)
+		err = tap->inner->transfer(tap->inner->ctx, msgs, n_msgs);
+	else
+		err = PCA9685_i2cdevTransfer((void*)(intptr_t)tap->i2cfile, msgs, n_msgs);
+
+	__trace_append(tap->trace, t, msgs, n_msgs, err);
+
+	return err;
+}
+
+static int __trace_urgent(void* ctx,
+		PCA9685_msg* msgs,
+		int n_msgs)
+{
+	trace_tap* tap = (trace_tap*)ctx;
+	uint64_t t = __now_ns();
+	int err;
+
+	if(!tap->inner || !tap->inner->urgent)
+		return __trace_transfer(ctx, msgs, n_msgs);
+
+	err = tap->inner->urgent(tap->inner->ctx, msgs, n_msgs);
+
+	__trace_append(tap->trace, t, msgs, n_msgs, err);
+
+	return err;
+}
+
+static void __trace_append(PCA9685_trace* trace,
+		uint64_t t_ns,
+		PCA9685_msg* msgs,
+		int n_msgs,
+		int err)
+{
+	uint64_t idx = __atomic_fetch_add(&trace->hdr->head, (uint64_t)n_msgs, __ATOMIC_RELAXED);
+	int i;
+
+	for(i=0;i<n_msgs;++i, ++idx){
+		PCA9685_traceRecord* rec = &trace->records[idx & trace->mask];
+
+		__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+
+		rec->t_ns = t_ns;
+		rec->addr = msgs[i].addr;
+		rec->flags = (msgs[i].flags & PCA9685_MSG_RD) | (err ? PCA9685_TRACE_FAILED : 0) |
+				(i == n_msgs - 1 ? PCA9685_TRACE_LAST : 0);
+		rec->len = msgs[i].len;
+		rec->msg_index = i;
+		memcpy(rec->payload, msgs[i].buf, msgs[i].len < PCA9685_TRACE_PAYLOAD ? msgs[i].len : PCA9685_TRACE_PAYLOAD);
+
+		__atomic_store_n(&rec->seq, idx + 1, __ATOMIC_RELEASE);
+	}
+}
+
+static uint64_t __now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
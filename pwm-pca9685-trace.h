@@ -0,0 +1,71 @@
+/*
+ * pwm-pca9685-trace.h
+ *
+ *	Binary bus-transaction recorder and replayer.
+ *
+ *	The recorder is a transport that sits in front of a config's real transport and appends every
+ *	message it carries (timestamp, address, register, payload) to a ring of fixed-size records in an
+ *	mmap'd file. Writers reserve records with one atomic add and publish each one with a release
+ *	store of its sequence number, so any number of threads or processes can record into the same
+ *	file, and a reader can copy it out while it is live. Nothing is in the path until attached.
+ *
+ *	The replayer walks a trace in order and sends each recorded transfer to any transport:
+ *	a PCA9685_sim, or a real bus via PCA9685_i2cdevTransfer, at original or accelerated timing.
+ *
+ */
+#ifndef PWM_PCA9685_TRACE_H_
+#define PWM_PCA9685_TRACE_H_
+
+#include "pwm-pca9685-user.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define PCA9685_TRACE_PAYLOAD		72 //fits a full 16 channel burst plus its register byte
+#define PCA9685_TRACE_MAXTAPS		16
+#define PCA9685_TRACE_FAILED		0x8000 //record flag: the transfer returned an error
+#define PCA9685_TRACE_LAST		0x4000 //record flag: last message of its transfer
+
+typedef struct PCA9685_traceRecord{
+	uint64_t seq;//index + 1 once the record is complete
+	uint64_t t_ns;//CLOCK_MONOTONIC at the start of the transfer
+	uint16_t addr;//7-bit
+	uint16_t flags;//PCA9685_MSG_RD, PCA9685_TRACE_FAILED, PCA9685_TRACE_LAST
+	uint16_t len;//message length, payload keeps the first PCA9685_TRACE_PAYLOAD bytes
+	uint16_t msg_index;//position in its transfer, 0 starts a new transfer
+	uint8_t payload[PCA9685_TRACE_PAYLOAD];//writes: register pointer then data. reads: data read
+} PCA9685_traceRecord;
+
+typedef struct PCA9685_trace PCA9685_trace;
+
+//capacity 0 opens an existing trace file as is, otherwise the file is created (rounded up to a power of 2)
+int PCA9685_traceOpen(PCA9685_trace** trace,
+		const char* path,
+		uint32_t capacity);
+
+int PCA9685_traceClose(PCA9685_trace* trace);
+
+int PCA9685_traceAttach(PCA9685_trace* trace,
+		PCA9685_config* config);
+
+int PCA9685_traceDetach(PCA9685_config* config);
+
+uint64_t PCA9685_traceFirst(PCA9685_trace* trace);
+
+uint64_t PCA9685_traceEnd(PCA9685_trace* trace);
+
+int PCA9685_traceGet(PCA9685_trace* trace,
+		uint64_t index,
+		PCA9685_traceRecord* record);
+
+//speedup 0 replays back to back, 1 at the recorded timing, N at N times the recorded rate
+int PCA9685_traceReplay(PCA9685_trace* trace,
+		PCA9685_transport* transport,
+		uint32_t speedup);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PWM_PCA9685_TRACE_H_ */
@@ -9,6 +9,9 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 
 #include "pwm-pca9685-user.h"
 
@@ -21,7 +24,17 @@
 #define PCA9685_READ_BIT 1
 #define PCA9685_PWM_PERIOD_BITS_PRECISION 12
 #define MODE1_SLEEP (1<<4)
+#define LED_FULL (1<<4) //bit 4 of LEDn_ON_H / LEDn_OFF_H
+#define ALLCALL_ADDRESS 0x70 //7-bit, power-on value of ALLCALLADR
+#define BATCH_MSGS_PER_BOARD 3 //PRESCALE, MODE2, MODE1
 #define EXTOSC_ENABLED (1<<0)
+#define COMMIT_DITHER 2 //__commit force value for dither flips: past the deadband, still governed
+#define RESTORE_TRIES 8 //snapshots PCA9685_restoreState takes of a record that keeps changing
+
+//planner cost model, in SCL bit-times
+#define PCA9685_BYTE_BITS 9 //8 data bits + ACK
+#define PCA9685_MSG_OVERHEAD_BITS (1 + 2*PCA9685_BYTE_BITS) //(repeated) START + address + register pointer
+#define PCA9685_STOP_BITS 1
 
 #define VERIFY(x) if(!x){ \
 						return PCA9685_ERR_NO_CONFIG; \
@@ -32,10 +45,127 @@
 #define LED_N_OFF_H(N)  (PCA9685_REG_LEDX_OFF_H + (4 * (N)))
 #define LED_N_OFF_L(N)  (PCA9685_REG_LEDX_OFF_L + (4 * (N)))
 
+_Static_assert(sizeof(PCA9685_msg) == sizeof(struct i2c_msg), "PCA9685_msg must match struct i2c_msg");
+
+/*
+ *
+ * USDT probes, provider pca9685, for perf / bpftrace. Each is a single nop until a tracer
+ * attaches; without <sys/sdt.h> (or with -DPCA9685_NO_USDT) they compile to nothing.
+ *
+ *	api__entry(const char* fn, uint8_t addr, uint16_t channels)
+ *	api__return(const char* fn, uint8_t addr, int err)
+ *	xfer__start(uint16_t addr7, uint8_t reg, int n_msgs, int n_bytes)	one per I2C_RDWR / transport call
+ *	xfer__done(uint16_t addr7, int n_msgs, int err)
+ *	error(const char* fn, uint8_t addr, int err)
+ *
+ * addr is the 8-bit board address, addr7 the 7-bit address of the first message (0x70 for ALLCALL),
+ * reg the register pointer of the first message.
+ */
+#if !defined(PCA9685_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PCA9685_USDT
+#endif
+#endif
+
+#ifdef PCA9685_USDT
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(pca9685, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(pca9685, name, a, b, c, d)
+#else
+//the arguments are referenced but never evaluated
+#define PROBE3(name, a, b, c) do{ if(0){ (void)(a); (void)(b); (void)(c); } }while(0)
+#define PROBE4(name, a, b, c, d) do{ if(0){ (void)(a); (void)(b); (void)(c); (void)(d); } }while(0)
+#endif
+
+#define PROBE_ENTRY(config, channels) PROBE3(api__entry, __func__, (config)->dev_i2c_address, channels)
+#define PROBE_RETURN(config, err) __probe_return(__func__, config, err)
+
+//a board's share of a combined PCA9685_updateChannelTicks_batch transfer
+typedef struct batch_frame{
+	PCA9685_tickFrame* frame;
+	PCA9685_WORD_t channels;
+	int first_msg;
+	int n_msgs;
+	int bits;
+} batch_frame;
+
 static int __read_reg(uint8_t reg, char* buf, PCA9685_config* config);
 static int __write_reg(uint8_t reg, uint8_t val, PCA9685_config* config);
 static int __execute_settings(PCA9685_config* config);
 static int __calc_prescale(uint32_t period, uint32_t osc, PCA9685_config* config);
+static uint64_t __intosc_Hz(uint32_t prescale, uint32_t osc);
+static int __retune(uint32_t period_us, uint32_t osc, PCA9685_config* config);
+static int __stage_channel(uint8_t channel, PCA9685_config* config);
+static int __stage_off_ticks(PCA9685_WORD_t channels, const PCA9685_WORD_t* off_ticks, PCA9685_config* config);
+static int __flush(PCA9685_WORD_t channels, PCA9685_config* config);
+static int __led_msgs(PCA9685_WORD_t channels, PCA9685_msg* msgs, uint8_t* bufs, int* bits, PCA9685_config* config);
+static void __flushed(PCA9685_WORD_t channels, PCA9685_msg* msgs, int n_msgs, int bits, PCA9685_config* config);
+static void __stage_ticks(uint8_t channel, PCA9685_WORD_t off_ticks, PCA9685_config* config);
+static void __stage_full(uint8_t channel, PCA9685_config* config);
+static void __manual_phase(uint8_t channel, PCA9685_config* config);
+static uint32_t __command_q4(const PCA9685_calibration* cal, uint16_t command);
+static PCA9685_WORD_t __dither_step(PCA9685_config* config);
+static void __stage_q8(uint8_t channel, uint32_t ticks_q8, PCA9685_config* config);
+static void __set_period(uint32_t period_us, PCA9685_config* config);
+static void __compile_calibration(PCA9685_calibration* cal, PCA9685_config* config);
+static int __xfer_urgent(PCA9685_msg* msgs, int n_msgs, PCA9685_config* config);
+static int __same_bus(PCA9685_config* a, PCA9685_config* b);
+static int __batch_xfer(PCA9685_config** configs, int n_configs, int (*build)(PCA9685_config*, PCA9685_msg*, uint8_t*));
+static int __frames_xfer(PCA9685_msg* msgs, int n_msgs, batch_frame* sent, int n_sent);
+static int __settings_msgs(PCA9685_config* config, PCA9685_msg* msgs, uint8_t* buf);
+static int __wake_msgs(PCA9685_config* config, PCA9685_msg* msgs, uint8_t* buf);
+static void __reg_msg(uint8_t reg, uint8_t val, PCA9685_msg* msg, uint8_t* buf, PCA9685_config* config);
+static int __update(PCA9685_WORD_t channels, int force, PCA9685_config* config);
+static int __commit(PCA9685_WORD_t channels, int force, PCA9685_config* config);
+static int __governed(PCA9685_WORD_t channels, int force, PCA9685_config* config);
+static PCA9685_WORD_t __frame_channels(PCA9685_WORD_t channels, int force, PCA9685_config* config);
+static PCA9685_WORD_t __deadband(PCA9685_WORD_t channels, PCA9685_config* config);
+static int __idle_flush(PCA9685_WORD_t channels, PCA9685_config* config);
+static int __finish_wake(PCA9685_config* config);
+static int __outputs_off(PCA9685_config* config);
+static void __persist(PCA9685_config* config);
+static int __read_state(uint8_t* regs, uint8_t* prescale, PCA9685_config* config);
+static uint64_t __now_ns(void);
+static int __xfer(PCA9685_msg* msgs, int n_msgs, PCA9685_config* config);
+
+static inline int __probe_return(const char* fn,
+		PCA9685_config* config,
+		int err)
+{
+	PROBE3(api__return, fn, config->dev_i2c_address, err);
+	if(err < 0)
+		PROBE3(error, fn, config->dev_i2c_address, err);
+
+	return err;
+}
+
+static inline int __msg_bytes(PCA9685_msg* msgs,
+		int n_msgs)
+{
+	int i, n = 0;
+	for(i=0;i<n_msgs;++i)
+		n += msgs[i].len;
+
+	return n;
+}
+
+/*
+ *
+ * us * 4096 / pwm_period, floored, with frac_bits more bits. tick_scale is rounded up, so the
+ * product lands on the quotient or one above it (above for some duty times of periods past
+ * ~100 ms); one multiply and compare takes that back, still without a division.
+ */
+static inline uint32_t __us_ticks(uint32_t us,
+		int frac_bits,
+		PCA9685_config* config)
+{
+	uint32_t t = (uint32_t)(((uint64_t)us * config->tick_scale) >> (32 - frac_bits));
+
+	if((uint64_t)t * config->pwm_period > ((uint64_t)us << (PCA9685_PWM_PERIOD_BITS_PRECISION + frac_bits)))
+		t--;
+
+	return t;
+}
 
 ///////////////////////////////////////////////
 
@@ -54,24 +184,43 @@ static int __calc_prescale(uint32_t period, uint32_t osc, PCA9685_config* config
 
 /*
  *
- * Calculates the prescale based on Equation 1 in the literature.
+ * Calculates the prescale based on Equation 1 in the literature, rounded to the nearest value.
  * The prescaler does not seem to be very precise, or at least the formula for calculating
  * it is over simplified. For example, when prescale equals 3, at a given update rate, the internal osc
  * is calculated to be 21 MHz (instead of 25 MHz). For prescale values above 80 or so, the internal osc
  * is calculated to be about 28 MHz.
  *
- * TODO: improve prescale calculation when internal oscillator is used.
+ * With the internal oscillator (EXTCLK not set) the effective frequency is therefore taken to move
+ * linearly from PCA9685_INTOSC_LOW_Hz to PCA9685_INTOSC_HIGH_Hz over that prescale range (scaled
+ * by osc / 25 MHz), and the prescale whose corrected period is closest to the request is picked.
+ * An external clock is taken at its nominal frequency.
  *
  */
 static int __calc_prescale(uint32_t period_us, uint32_t osc, PCA9685_config* config ){
 
-	uint32_t prescale;
-	prescale = ((osc / 1000000)*period_us) >> 12; //dividing by 4096
-	prescale--;
-	if(prescale >> 8)
+	uint64_t target = (uint64_t)period_us * 1000, best_err = UINT64_MAX, err, actual;
+	uint32_t prescale, best = 0;
+
+	if(config->mode1_settings & PCA9685_SETTING_MODE1_EXTCLK){
+		best = (uint32_t)(((uint64_t)osc * period_us + 2048000000ull) / 4096000000ull);
+		best = best ? best - 1 : 0;
+	}
+	else{
+		//one past the register's range, so a period too long for it still shows up as overflow
+		for(prescale=0;prescale<=0x100;++prescale){
+			actual = (4096000000000ull * (prescale + 1)) / __intosc_Hz(prescale, osc);
+			err = actual > target ? actual - target : target - actual;
+			if(err < best_err){
+				best_err = err;
+				best = prescale;
+			}
+		}
+	}
+
+	if(best >> 8)
 		return PCA9685_ERR_PRESCALE_OVERFLOW;
 
-	uint8_t prescaleC = (uint8_t)prescale;
+	uint8_t prescaleC = (uint8_t)best;
 
 	if(prescaleC < PCA9685_MIN_PRESCALE)
 		return PCA9685_ERR_PRESCALE_TOOLOW;
@@ -81,6 +230,22 @@ static int __calc_prescale(uint32_t period_us, uint32_t osc, PCA9685_config* con
 	return PCA9685_ERR_NOERR;
 }
 
+static uint64_t __intosc_Hz(uint32_t prescale,
+		uint32_t osc)
+{
+	uint64_t hz;
+
+	if(prescale <= PCA9685_INTOSC_LOW_PRESCALE)
+		hz = PCA9685_INTOSC_LOW_Hz;
+	else if(prescale >= PCA9685_INTOSC_HIGH_PRESCALE)
+		hz = PCA9685_INTOSC_HIGH_Hz;
+	else
+		hz = PCA9685_INTOSC_LOW_Hz + (uint64_t)(PCA9685_INTOSC_HIGH_Hz - PCA9685_INTOSC_LOW_Hz) *
+				(prescale - PCA9685_INTOSC_LOW_PRESCALE) / (PCA9685_INTOSC_HIGH_PRESCALE - PCA9685_INTOSC_LOW_PRESCALE);
+
+	return hz * osc / PCA9685_DEFAULT_OSC;
+}
+
 int PCA9685_config_only(PCA9685_config* config,
 		int i2cfile,
 		uint8_t dev_address,
@@ -96,11 +261,35 @@ int PCA9685_config_only(PCA9685_config* config,
 
 	//TODO: see if defaulting the dev_address messes with the auto increment protocol
 
-	if (ioctl(config->i2cFile, I2C_SLAVE, dev_address>>1) < 0) {
+	if (!config->transport && ioctl(i2cfile, I2C_SLAVE, dev_address>>1) < 0) {
 		perror("i2cSetAddress");
 		return PCA9685_ERR_I2CfOPEN;
 	}
 
+	if(err = PCA9685_config_prepare(config, i2cfile, dev_address, mode1_settings, mode2_settings,
+			default_pwm_period_us, osc_freq_Hz))
+		return err;
+
+	return __execute_settings(config);
+}
+
+/*
+ *
+ * Fills in the config like PCA9685_config_only, but does not touch the bus. Send the settings
+ * later with PCA9685_config_batch, which combines many boards into a few transfers.
+ */
+int PCA9685_config_prepare(PCA9685_config* config,
+		int i2cfile,
+		uint8_t dev_address,
+		uint8_t mode1_settings,
+		uint8_t mode2_settings,
+		uint32_t default_pwm_period_us,
+		uint32_t osc_freq_Hz)
+{
+	int err;
+
+	if(!config)
+		return PCA9685_ERR_NO_CONFIG;
 
 	config->i2cFile = i2cfile;
 	config->dev_i2c_address = dev_address;
@@ -110,10 +299,14 @@ int PCA9685_config_only(PCA9685_config* config,
 	if(err = __calc_prescale(default_pwm_period_us, osc_freq_Hz, config))
 			return err;
 
-	config->pwm_period = default_pwm_period_us;
+	__set_period(default_pwm_period_us, config);
 	config->osc_freq = osc_freq_Hz;
+	config->pending = 0;
+	config->shadow_valid = 0;
+	if(!config->bus_clock)
+		config->bus_clock = PCA9685_DEFAULT_BUS_CLOCK;
 
-	return __execute_settings(config);
+	return PCA9685_ERR_NOERR;
 }
 
 int PCA9685_config_and_open_i2c(PCA9685_config* config,
@@ -155,8 +348,12 @@ int PCA9685_config_and_open_i2c(PCA9685_config* config,
 	if(err = __calc_prescale(default_pwm_period_us, osc_freq_Hz, config))
 		return err;
 
-	config->pwm_period = default_pwm_period_us;
+	__set_period(default_pwm_period_us, config);
 	config->osc_freq = osc_freq_Hz;
+	config->pending = 0;
+	config->shadow_valid = 0;
+	if(!config->bus_clock)
+		config->bus_clock = PCA9685_DEFAULT_BUS_CLOCK;
 
 	return __execute_settings(config);
 }
@@ -189,10 +386,124 @@ static int __execute_settings(PCA9685_config* config){
 			return PCA9685_ERR_I2C_WRITE;
 		}
 
+	__persist(config);
+
+	return PCA9685_ERR_NOERR;
+
+}
+
+
+/*
+ *
+ * __execute_settings for many boards: the PRESCALE / MODE2 / MODE1 writes of every board on a bus
+ * go out together, in as few transfers as I2C_RDWR allows.
+ */
+int PCA9685_config_batch(PCA9685_config** configs,
+		int n_configs)
+{
+	int i, err;
+
+	if(err = __batch_xfer(configs, n_configs, __settings_msgs))
+		return err;
+
+	for(i=0;i<n_configs;++i)
+		__persist(configs[i]);
+
 	return PCA9685_ERR_NOERR;
+}
+
+static int __settings_msgs(PCA9685_config* config,
+		PCA9685_msg* msgs,
+		uint8_t* buf)
+{
+	int n = 0;
+
+	config->mode1_settings |= MODE1_SLEEP;
+
+	//same order and defaults as __execute_settings
+	if(config->prescale != PCA9685_PRESCALE_DEFAULT){
+		__reg_msg(PCA9685_REG_PRESCALE, config->prescale, &msgs[n], &buf[2*n], config);
+		++n;
+	}
 
+	if(config->mode2_settings != PCA9685_SETTING_MODE2_DEFAULTS){
+		__reg_msg(PCA9685_REG_MODE2, config->mode2_settings, &msgs[n], &buf[2*n], config);
+		++n;
+	}
+
+	if(config->mode1_settings != PCA9685_SETTING_MODE1_DEFAULTS){
+		__reg_msg(PCA9685_REG_MODE1, config->mode1_settings, &msgs[n], &buf[2*n], config);
+		++n;
+	}
+
+	return n;
+}
+
+static int __wake_msgs(PCA9685_config* config,
+		PCA9685_msg* msgs,
+		uint8_t* buf)
+{
+	__reg_msg(PCA9685_REG_MODE1, config->mode1_settings & ~MODE1_SLEEP, msgs, buf, config);
+
+	return 1;
 }
 
+static void __reg_msg(uint8_t reg,
+		uint8_t val,
+		PCA9685_msg* msg,
+		uint8_t* buf,
+		PCA9685_config* config)
+{
+	buf[0] = reg;
+	buf[1] = val;
+
+	msg->addr = config->dev_i2c_address >> 1;
+	msg->flags = 0;
+	msg->len = 2;
+	msg->buf = buf;
+}
+
+/*
+ *
+ * Collects up to BATCH_MSGS_PER_BOARD register writes per board from build() and sends them,
+ * bus by bus, in transfers of at most I2C_RDWR_IOCTL_MAX_MSGS messages.
+ */
+static int __batch_xfer(PCA9685_config** configs,
+		int n_configs,
+		int (*build)(PCA9685_config*, PCA9685_msg*, uint8_t*))
+{
+	PCA9685_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+	uint8_t bufs[I2C_RDWR_IOCTL_MAX_MSGS * 2];
+	int i, j, k, n, err, ret = PCA9685_ERR_NOERR;
+
+	if(!configs || n_configs <= 0)
+		return PCA9685_ERR_NO_CONFIG;
+
+	for(i=0;i<n_configs;++i){
+
+		for(k=0;k<i && !__same_bus(configs[k], configs[i]);++k)
+			;
+		if(k < i)
+			continue;
+
+		for(j=i, n=0;j<=n_configs;++j){
+
+			if(j < n_configs && !__same_bus(configs[j], configs[i]))
+				continue;
+
+			if(n && (j == n_configs || n + BATCH_MSGS_PER_BOARD > I2C_RDWR_IOCTL_MAX_MSGS)){
+				if(err = __xfer(msgs, n, configs[i]))
+					ret = err;
+				n = 0;
+			}
+
+			if(j < n_configs)
+				n += build(configs[j], &msgs[n], &bufs[2*n]);
+		}
+	}
+
+	return ret;
+}
 
 int PCA9685_close_i2c(PCA9685_config* config){
 	VERIFY(config);
@@ -208,6 +519,7 @@ int PCA9685_close_i2c(PCA9685_config* config){
 int PCA9685_setAllChannelsToZero(PCA9685_config* config){
 
 	VERIFY(config);
+	PROBE_ENTRY(config, 0xFFFF);
 
 
 	int i;
@@ -215,219 +527,1365 @@ int PCA9685_setAllChannelsToZero(PCA9685_config* config){
 		config->channels[i].dutyTime_us = 0;
 	}
 
-	return PCA9685_updateChannelRange(0, PCA9685_MAXCHAN - 1, config);
+	return PROBE_RETURN(config, __update(0xFFFF, 1, config));
 }
 
 int PCA9685_updateChannels(PCA9685_WORD_t channels,
 				PCA9685_config* config)
 {
 	VERIFY(config);
+	PROBE_ENTRY(config, channels);
 
-	if (ioctl(config->i2cFile, I2C_SLAVE, (char)(config->dev_i2c_address>>1)) < 0) {
-		perror("i2cSetAddress");
-		return PCA9685_ERR_SET_SLAVEADDR;
-	}
+	return PROBE_RETURN(config, __update(channels, 0, config));
 
-	char data[5];
-	PCA9685_reg offtime;
-	int i;
-	for(i=0;i<PCA9685_MAXCHAN;++i){
+}
 
-		if((channels & (1<<i)) == 0)
-			continue;
+/*
+ *
+ * Same as PCA9685_updateChannels, but takes the off ticks (0 - 4095) directly, for callers that
+ * keep their own tick-domain state. off_ticks is indexed by channel.
+ */
+int PCA9685_updateChannelTicks(PCA9685_WORD_t channels,
+		const PCA9685_WORD_t* off_ticks,
+		PCA9685_config* config)
+{
+	VERIFY(config);
+	PROBE_ENTRY(config, channels);
 
-		if(config->pwm_period < config->channels[i].dutyTime_us)
-			return PCA9685_ERR_DUTY_OVERFLOW;
+	int err;
+	if(err = __stage_off_ticks(channels, off_ticks, config))
+		return PROBE_RETURN(config, err);
 
-		offtime.val = (config->channels[i].dutyTime_us << 12) / config->pwm_period;
+	return PROBE_RETURN(config, __commit(channels, 0, config));
 
-		if(config->mode1_settings & PCA9685_SETTING_MODE1_AUTOINCR){
+}
 
-			data[0] = LED_N_ON_L(i);
-			data[1] = GET_LOW(0);//on time
-			data[2] = GET_HIGH(0);
-			data[3] = GET_LOW(offtime.val);
-			data[4] = GET_HIGH(offtime.val);
-			if (write(config->i2cFile, data, 5) != 5) {
-				perror("error updating channels");
-				return PCA9685_ERR_I2C_WRITE;
-			}
+/*
+ *
+ * PCA9685_updateChannelTicks for many boards. The frames of consecutive boards on one bus share
+ * I2C_RDWR transfers of at most I2C_RDWR_IOCTL_MAX_MSGS messages, a board's messages never split
+ * across two of them, so pass the frames grouped by bus. A frame's channels come back 0 once its
+ * board is done (sent, or held as pending by the governor); a failed board keeps them for a
+ * retry. Boards with an idle timeout, or needing more messages than one transfer takes, go out
+ * on their own. Returns the first error.
+ */
+int PCA9685_updateChannelTicks_batch(PCA9685_tickFrame* frames,
+		int n_frames)
+{
+	PCA9685_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+	uint8_t bufs[I2C_RDWR_IOCTL_MAX_MSGS][PCA9685_LED_REGS * 2];//one per board in the transfer
+	batch_frame sent[I2C_RDWR_IOCTL_MAX_MSGS];
+	PCA9685_msg board_msgs[PCA9685_LED_REGS];
+	PCA9685_tickFrame* f;
+	PCA9685_config* config;
+	PCA9685_WORD_t channels;
+	int i, k, n = 0, n_sent = 0, n_board, bits, err, ret = PCA9685_ERR_NOERR;
+
+	if(!frames || n_frames <= 0)
+		return PCA9685_ERR_NO_CONFIG;
+
+	PROBE_ENTRY(frames[0].config, 0xFFFF);
+
+	for(i=0;i<=n_frames;++i){
+		f = i < n_frames ? &frames[i] : NULL;
+
+		//the bus changes: what is collected goes out
+		if(n_sent && (!f || !__same_bus(f->config, sent[0].frame->config))){
+			if((err = __frames_xfer(msgs, n, sent, n_sent)) && !ret)
+				ret = err;
+			n = n_sent = 0;
 		}
-		else{
-			if (__write_reg(LED_N_ON_L(i), GET_LOW(0), config))
-				return PCA9685_ERR_I2C_WRITE;
+		if(!f)
+			break;
 
-			if (__write_reg(LED_N_ON_H(i), GET_HIGH(0), config))
-				return PCA9685_ERR_I2C_WRITE;
+		config = f->config;
+		if(err = __stage_off_ticks(f->channels, f->off_ticks, config)){
+			if(!ret)
+				ret = err;
+			continue;
+		}
 
-			if (__write_reg(LED_N_OFF_L(i), GET_LOW(offtime.val), config))
-				return PCA9685_ERR_I2C_WRITE;
+		if(__governed(f->channels, 0, config)){
+			f->channels = 0;
+			continue;
+		}
+		channels = __frame_channels(f->channels, 0, config);
+
+		if(config->idle_timeout_ms){
+			if(err = __idle_flush(channels, config)){
+				if(!ret)
+					ret = err;
+			}else
+				f->channels = 0;
+			continue;
+		}
 
-			if (__write_reg(LED_N_OFF_H(i), GET_HIGH(offtime.val), config))
-				return PCA9685_ERR_I2C_WRITE;
+		n_board = __led_msgs(channels, board_msgs, bufs[n_sent], &bits, config);
+		if(n_board == 0){
+			config->last_flush_wire_ns = 0;
+			f->channels = 0;
+			continue;
 		}
-	}
 
-	return PCA9685_ERR_NOERR;
+		if(n_board > I2C_RDWR_IOCTL_MAX_MSGS){
+			if(err = __flush(channels, config)){
+				if(!ret)
+					ret = err;
+			}else
+				f->channels = 0;
+			continue;
+		}
 
-}
+		if(n + n_board > I2C_RDWR_IOCTL_MAX_MSGS){
+			if((err = __frames_xfer(msgs, n, sent, n_sent)) && !ret)
+				ret = err;
 
-int PCA9685_updateChannelRange(uint8_t channel_start,
-		uint8_t channel_end,
-		PCA9685_config* config)
-{
-	VERIFY(config);
+			//the board opens the next transfer, its bytes move to the first buffer
+			memcpy(bufs[0], bufs[n_sent], sizeof(bufs[0]));
+			for(k=0;k<n_board;++k)
+				board_msgs[k].buf = bufs[0] + (board_msgs[k].buf - bufs[n_sent]);
+			n = n_sent = 0;
+		}
 
-	if (ioctl(config->i2cFile, I2C_SLAVE, (char)(config->dev_i2c_address>>1)) < 0) {
-		perror("i2cSetAddress");
-		return PCA9685_ERR_SET_SLAVEADDR;
+		memcpy(&msgs[n], board_msgs, n_board * sizeof(*board_msgs));
+		sent[n_sent].frame = f;
+		sent[n_sent].channels = channels;
+		sent[n_sent].first_msg = n;
+		sent[n_sent].n_msgs = n_board;
+		sent[n_sent].bits = bits;
+		n += n_board;
+		n_sent++;
+
+		if(n == I2C_RDWR_IOCTL_MAX_MSGS){
+			if((err = __frames_xfer(msgs, n, sent, n_sent)) && !ret)
+				ret = err;
+			n = n_sent = 0;
+		}
 	}
 
-	uint8_t data[PCA9685_MAXCHAN*4 + 1]; //dynamically allocating on the stack is bad/impossible, so we dont do that
-	int n_bytes = ((channel_end - channel_start + 1) << 2) + 1;
-	PCA9685_reg offtime;
-	int i;
+	return PROBE_RETURN(frames[0].config, ret);
+}
 
-	if(channel_start > channel_end || channel_end >= PCA9685_MAXCHAN)
-		return PCA9685_ERR_BOUNDS;
+/*
+ *
+ * One combined transfer of PCA9685_updateChannelTicks_batch and the bookkeeping of its boards,
+ * the last of which pays the STOP.
+ */
+static int __frames_xfer(PCA9685_msg* msgs,
+		int n_msgs,
+		batch_frame* sent,
+		int n_sent)
+{
+	int i, err;
 
-	if(config->mode1_settings & PCA9685_SETTING_MODE1_AUTOINCR){
-		data[0] = LED_N_ON_L(channel_start);
+	if(err = __xfer(msgs, n_msgs, sent[0].frame->config))
+		return err;
 
-		for(i=channel_start;i<=channel_end;++i){
+	sent[n_sent - 1].bits += PCA9685_STOP_BITS;
+	for(i=0;i<n_sent;++i){
+		__flushed(sent[i].channels, &msgs[sent[i].first_msg], sent[i].n_msgs, sent[i].bits, sent[i].frame->config);
+		sent[i].frame->channels = 0;
+	}
 
-			if(config->pwm_period < config->channels[i].dutyTime_us)
-				return PCA9685_ERR_DUTY_OVERFLOW;
+	return PCA9685_ERR_NOERR;
+}
 
-			offtime.val = (config->channels[i].dutyTime_us << 12) / config->pwm_period;
+/*
+ *
+ * Stages off ticks (0 - 4095) for channels, into the dither accumulator for dithered ones.
+ * Nothing is staged if any of them is out of range.
+ */
+static int __stage_off_ticks(PCA9685_WORD_t channels,
+		const PCA9685_WORD_t* off_ticks,
+		PCA9685_config* config)
+{
+	int i;
+	for(i=0;i<PCA9685_MAXCHAN;++i)
+		if((channels & (1<<i)) && off_ticks[i] > PCA9685_MAX_TICK)
+			return PCA9685_ERR_DUTY_OVERFLOW;
 
-			data[(i<<2) + 1] = 0;
-			data[(i<<2) + 2] = 0;
-			data[(i<<2) + 3] = GET_LOW(offtime.val);
-			data[(i<<2) + 4] = GET_HIGH(offtime.val);
-		}
-		if(write(config->i2cFile, data, n_bytes) != n_bytes)
-			return PCA9685_ERR_I2C_WRITE;
+	for(i=0;i<PCA9685_MAXCHAN;++i){
+		if(!(channels & (1<<i)))
+			continue;
 
+		if(config->dither_channels & (1 << i))
+			__stage_q8(i, (uint32_t)off_ticks[i] << 8, config);
+		else
+			__stage_ticks(i, off_ticks[i], config);
 	}
+	config->tick_domain |= channels;
 
-	else{
-		for(i=channel_start;i<=channel_end;++i){
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Fills a two point calibration, min_pulse_us at command 0 and max_pulse_us at 65535.
+ */
+int PCA9685_calibrationLinear(PCA9685_calibration* cal,
+		uint32_t min_pulse_us,
+		uint32_t max_pulse_us)
+{
+	if(!cal)
+		return PCA9685_ERR_NO_CALIBRATION;
 
-			if(config->pwm_period < config->channels[i].dutyTime_us)
-				return PCA9685_ERR_DUTY_OVERFLOW;
+	memset(cal, 0, sizeof(*cal));
+	cal->n_points = 2;
+	cal->command[0] = 0;
+	cal->pulse_us[0] = min_pulse_us;
+	cal->command[1] = 0xFFFF;
+	cal->pulse_us[1] = max_pulse_us;
 
-			offtime.val = (config->channels[i].dutyTime_us << 12) / config->pwm_period;
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Assigns a calibration to a channel (NULL removes it) and compiles it into a tick table for the
+ * current period. Tables are recompiled whenever the period changes, so channels sharing a
+ * calibration should share a period too.
+ */
+int PCA9685_setCalibration(uint8_t channel,
+		PCA9685_calibration* cal,
+		PCA9685_config* config)
+{
+	VERIFY(config);
 
-			if (__write_reg(LED_N_ON_L(i), GET_LOW(0), config))
-				return PCA9685_ERR_I2C_WRITE;
+	if(channel >= PCA9685_MAXCHAN)
+		return PCA9685_ERR_BOUNDS;
 
-			if (__write_reg(LED_N_ON_H(i), GET_HIGH(0), config))
-				return PCA9685_ERR_I2C_WRITE;
+	if(cal && (cal->n_points < 1 || cal->n_points > PCA9685_CAL_MAXPOINTS))
+		return PCA9685_ERR_NO_CALIBRATION;
 
-			if (__write_reg(LED_N_OFF_L(i), GET_LOW(offtime.val), config))
-				return PCA9685_ERR_I2C_WRITE;
+	config->cal[channel] = cal;
 
-			if (__write_reg(LED_N_OFF_H(i), GET_HIGH(offtime.val), config))
-				return PCA9685_ERR_I2C_WRITE;
-		}
-	}
+	if(cal)
+		__compile_calibration(cal, config);
 
 	return PCA9685_ERR_NOERR;
-
 }
 
-int PCA9685_updateChannel(uint8_t channel,
+/*
+ *
+ * Updates channels from normalized commands (0 - 65535) through their calibration tables:
+ * one table lookup and an integer interpolation per channel.
+ */
+int PCA9685_updateChannelCommands(PCA9685_WORD_t channels,
+		const uint16_t* commands,
 		PCA9685_config* config)
 {
 	VERIFY(config);
+	PROBE_ENTRY(config, channels);
 
-	if (ioctl(config->i2cFile, I2C_SLAVE, (char)(config->dev_i2c_address>>1)) < 0) {
-		perror("i2cSetAddress");
-		return PCA9685_ERR_SET_SLAVEADDR;
-	}
+	uint32_t q4;
+	int i;
 
+	for(i=0;i<PCA9685_MAXCHAN;++i)
+		if((channels & (1<<i)) && !config->cal[i])
+			return PROBE_RETURN(config, PCA9685_ERR_NO_CALIBRATION);
 
-	PCA9685_reg offtime;
-	uint8_t data[5];
+	for(i=0;i<PCA9685_MAXCHAN;++i){
 
-	if(channel >= PCA9685_MAXCHAN)
-		return PCA9685_ERR_BOUNDS;
+		if((channels & (1<<i)) == 0)
+			continue;
 
-	if(config->pwm_period < config->channels[channel].dutyTime_us)
-		return PCA9685_ERR_DUTY_OVERFLOW;
+		q4 = __command_q4(config->cal[i], commands[i]);
 
-	offtime.val = (config->channels[channel].dutyTime_us << 12) / config->pwm_period;
+		if(config->dither_channels & (1 << i))
+			__stage_q8(i, q4 << 4, config);
+		else
+			__stage_ticks(i, (PCA9685_WORD_t)((q4 + 8) >> 4), config);
+	}
+	config->tick_domain |= channels;
 
-	if(config->mode1_settings & PCA9685_SETTING_MODE1_AUTOINCR){
+	return PROBE_RETURN(config, __commit(channels, 0, config));
+}
 
-		data[0] = LED_N_ON_L(channel);
-		data[1] = 0;
-		data[2] = 0;
-		data[3] = GET_LOW(offtime.val);
-		data[4] = GET_HIGH(offtime.val);
+/*
+ *
+ * A command's ticks from a compiled calibration, rounded, for callers that stage ticks
+ * themselves (e.g. into a fleet). The calibration must have been set on a board with
+ * PCA9685_setCalibration, which compiles it for that board's period.
+ */
+PCA9685_WORD_t PCA9685_calibrationTicks(const PCA9685_calibration* cal,
+		uint16_t command)
+{
+	return (PCA9685_WORD_t)((__command_q4(cal, command) + 8) >> 4);
+}
 
-		if(write(config->i2cFile, data, 5) != 5)
-			return PCA9685_ERR_I2C_WRITE;
-	}
-	else{
+static uint32_t __command_q4(const PCA9685_calibration* cal,
+		uint16_t command)
+{
+	const PCA9685_WORD_t* t = &cal->ticks_q4[command >> (16 - PCA9685_CAL_SEGMENTS_LOG2)];
+	int32_t frac = command & ((1 << (16 - PCA9685_CAL_SEGMENTS_LOG2)) - 1);
+	int32_t a = t[0], b = t[1];
 
-		if (__write_reg(LED_N_ON_L(channel), GET_LOW(0), config))
-			return PCA9685_ERR_I2C_WRITE;
+	return (uint32_t)(a + (((b - a) * frac) >> (16 - PCA9685_CAL_SEGMENTS_LOG2)));
+}
 
-		if (__write_reg(LED_N_ON_H(channel), GET_HIGH(0), config))
-			return PCA9685_ERR_I2C_WRITE;
+static void __set_period(uint32_t period_us,
+		PCA9685_config* config)
+{
+	int i;
 
-		if (__write_reg(LED_N_OFF_L(channel), GET_LOW(offtime.val), config))
-			return PCA9685_ERR_I2C_WRITE;
+	config->pwm_period = period_us;
+	config->tick_scale = (((uint64_t)1 << (32 + PCA9685_PWM_PERIOD_BITS_PRECISION)) + period_us - 1) / period_us;
 
-		if (__write_reg(LED_N_OFF_H(channel), GET_HIGH(offtime.val), config))
-			return PCA9685_ERR_I2C_WRITE;
+	for(i=0;i<PCA9685_MAXCHAN;++i)
+		if(config->cal[i] && config->cal[i]->compiled_period != period_us)
+			__compile_calibration(config->cal[i], config);
+}
 
+static void __compile_calibration(PCA9685_calibration* cal,
+		PCA9685_config* config)
+{
+	uint32_t cmd;
+	int64_t pulse, ticks_q4;
+	int k, p;
+
+	for(k=0;k<=PCA9685_CAL_SEGMENTS;++k){
+		cmd = k << (16 - PCA9685_CAL_SEGMENTS_LOG2);
+
+		for(p=0;p<cal->n_points - 1 && cal->command[p + 1] < cmd;++p)
+			;
+
+		//a pulse difference times a command difference needs more than 32 bits
+		if(cmd <= cal->command[0] || cal->n_points == 1)
+			pulse = cal->pulse_us[0];
+		else if(p == cal->n_points - 1)
+			pulse = cal->pulse_us[p];
+		else
+			pulse = cal->pulse_us[p] + ((int64_t)cal->pulse_us[p + 1] - cal->pulse_us[p]) *
+					(int64_t)(cmd - cal->command[p]) / (int64_t)(cal->command[p + 1] - cal->command[p]);
+
+		ticks_q4 = (pulse << (PCA9685_PWM_PERIOD_BITS_PRECISION + 4)) / config->pwm_period;
+		if(ticks_q4 < 0)
+			ticks_q4 = 0;
+		else if(ticks_q4 > (PCA9685_MAX_TICK << 4))
+			ticks_q4 = PCA9685_MAX_TICK << 4;
+		cal->ticks_q4[k] = (PCA9685_WORD_t)ticks_q4;
 	}
 
-	return PCA9685_ERR_NOERR;
-
+	cal->compiled_period = config->pwm_period;
 }
 
-int PCA9685_writeReg(uint8_t reg,
-		uint8_t val,
-		PCA9685_config* config,
-		uint8_t mask)
+int PCA9685_updateChannelsForce(PCA9685_WORD_t channels,
+		PCA9685_config* config)
 {
 	VERIFY(config);
+	PROBE_ENTRY(config, channels);
 
-	if (ioctl(config->i2cFile, I2C_SLAVE, (char)(config->dev_i2c_address>>1)) < 0) {
-		perror("i2cSetAddress");
-		return PCA9685_ERR_SET_SLAVEADDR;
-	}
+	return PROBE_RETURN(config, __update(channels, 1, config));
 
+}
 
-	char temp;
-	int err;
+int PCA9685_updateChannelRange(uint8_t channel_start,
+		uint8_t channel_end,
+		PCA9685_config* config)
+{
+	VERIFY(config);
+
+	if(channel_start > channel_end || channel_end >= PCA9685_MAXCHAN)
+		return PCA9685_ERR_BOUNDS;
+
+	PCA9685_WORD_t channels = (PCA9685_WORD_t)(((1u << (channel_end + 1)) - 1) & ~((1u << channel_start) - 1));
+
+	return PCA9685_updateChannels(channels, config);
+
+}
+
+int PCA9685_updateChannel(uint8_t channel,
+		PCA9685_config* config)
+{
+	VERIFY(config);
+
+	if(channel >= PCA9685_MAXCHAN)
+		return PCA9685_ERR_BOUNDS;
+
+	return PCA9685_updateChannels((PCA9685_WORD_t)(1 << channel), config);
+
+}
+
+int PCA9685_writeReg(uint8_t reg,
+		uint8_t val,
+		PCA9685_config* config,
+		uint8_t mask)
+{
+	VERIFY(config);
+	PROBE_ENTRY(config, reg);
+
+	char temp = 0;//a transport that returns without filling the read leaves it defined
+	int err;
+
+	if(mask == 0)
+		return PROBE_RETURN(config, PCA9685_ERR_TRIVIAL_ACTION);
+
+	if(mask != 0xff){
+		if(err = __read_reg(reg, &temp, config)){
+			perror("error reading from device");
+			return PROBE_RETURN(config, err);
+		}
+		val = (temp & (~mask)) | val;
+	}
+
+	return PROBE_RETURN(config, __write_reg(reg, val, config));
+}
+
+int PCA9685_readReg(uint8_t reg,
+		char* buf,
+		PCA9685_config* config)
+{
+	VERIFY(config);
+	PROBE_ENTRY(config, reg);
+
+	return PROBE_RETURN(config, __read_reg(reg, buf, config));
+
+}
+
+/*
+ *
+ * Holds channels fully on or off (PCA9685_CHANNEL_FULL_ON / _FULL_OFF) regardless of their
+ * duty time, or returns them to PWM (PCA9685_CHANNEL_PWM). Only the ON_H / OFF_H registers
+ * that change are sent, immediately.
+ */
+int PCA9685_setChannelsFull(PCA9685_WORD_t channels,
+		uint8_t mode,
+		PCA9685_config* config)
+{
+	VERIFY(config);
+	PROBE_ENTRY(config, channels);
+
+	int i;
+
+	switch(mode){
+	case PCA9685_CHANNEL_PWM:
+		config->full_on &= ~channels;
+		config->full_off &= ~channels;
+		break;
+	case PCA9685_CHANNEL_FULL_ON:
+		config->full_on |= channels;
+		config->full_off &= ~channels;
+		break;
+	case PCA9685_CHANNEL_FULL_OFF:
+		config->full_off |= channels;
+		break;
+	default:
+		return PROBE_RETURN(config, PCA9685_ERR_BOUNDS);
+	}
+
+	for(i=0;i<PCA9685_MAXCHAN;++i)
+		if(channels & (1<<i))
+			__stage_full(i, config);
+
+	return PROBE_RETURN(config, __commit(channels, 1, config));
+}
+
+/*
+ *
+ * Turns every channel of every given board off as fast as the bus allows: one 2-byte write of
+ * the full-off bit to ALL_LED_OFF_H per board, all boards on a bus in a single transfer. It goes
+ * through the transport's urgent path, ahead of any queued traffic, and drops whatever the
+ * governor was holding back. Boards stay off, whatever is written to them, until
+ * PCA9685_clearEmergencyStop.
+ *
+ * With whole_bus set the caller guarantees that the list holds every board on each of its buses,
+ * this process's or not; a bus whose boards all answer to ALLCALL then gets a single message to
+ * the ALLCALL address, which assumes ALLCALLADR still holds its power-on value (0xE0). Without
+ * it every board is addressed on its own, since a broadcast would also stop boards whose
+ * configs never learn about it.
+ */
+int PCA9685_emergencyStop(PCA9685_config** configs,
+		int n_configs,
+		uint8_t whole_bus)
+{
+	PCA9685_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+	uint8_t data[2] = {PCA9685_REG_ALL_LED_OFF_H, LED_FULL};
+	uint64_t t0 = __now_ns();
+	int i, j, k, n, first, allcall, err, ret = PCA9685_ERR_NOERR;
+
+	if(!configs || n_configs <= 0)
+		return PCA9685_ERR_NO_CONFIG;
+
+	//one entry / return pair for the whole stop, carrying the first board
+	PROBE_ENTRY(configs[0], 0xFFFF);
+
+	for(i=0;i<n_configs;++i){
+
+		//each bus is handled once, by the first of its boards in the list
+		for(k=0;k<i && !__same_bus(configs[k], configs[i]);++k)
+			;
+		if(k < i)
+			continue;
+
+		allcall = !!whole_bus;
+		for(j=i;j<n_configs;++j)
+			if(__same_bus(configs[j], configs[i]))
+				allcall &= !!(configs[j]->mode1_settings & PCA9685_SETTING_MODE1_ALLCALL);
+
+		for(j=i, n=0, first=i;j<=n_configs;++j){
+
+			if(j < n_configs){
+				if(!__same_bus(configs[j], configs[i]))
+					continue;
+
+				configs[j]->estop = 1;
+				configs[j]->pending = 0;
+
+				if(!allcall || n == 0){
+					msgs[n].addr = allcall ? ALLCALL_ADDRESS : configs[j]->dev_i2c_address >> 1;
+					msgs[n].flags = 0;
+					msgs[n].len = 2;
+					msgs[n].buf = data;
+					++n;
+				}
+			}
+
+			if(n && (n == I2C_RDWR_IOCTL_MAX_MSGS || j == n_configs)){
+				if(err = __xfer_urgent(msgs, n, configs[i])){
+					if(!ret)
+						ret = err;
+
+					//every board of the failed batch (all of the bus with ALLCALL) is in an unknown state
+					for(k=first;k<=j && k<n_configs;++k)
+						if(__same_bus(configs[k], configs[i]))
+							configs[k]->shadow_valid = 0;
+				}
+				n = 0;
+				first = j + 1;
+			}
+		}
+
+		for(j=i;j<n_configs;++j){
+			if(!__same_bus(configs[j], configs[i]))
+				continue;
+
+			//ALL_LED_OFF_H lands in every LEDn_OFF_H
+			for(k=0;k<PCA9685_MAXCHAN;++k){
+				configs[j]->led_shadow[(k << 2) + 3] = LED_FULL;
+				configs[j]->led_image[(k << 2) + 3] |= LED_FULL;
+			}
+			__persist(configs[j]);
+		}
+	}
+
+	t0 = __now_ns() - t0;
+
+	for(i=0;i<n_configs;++i){
+		configs[i]->stats.estops++;
+		configs[i]->stats.estop_latency_ns = (uint32_t)t0;
+	}
+
+	return PROBE_RETURN(configs[0], ret);
+}
+
+/*
+ *
+ * Boards reached through the same transport (or the same i2c-dev descriptor) share a bus.
+ */
+static int __same_bus(PCA9685_config* a,
+		PCA9685_config* b)
+{
+	return a->transport == b->transport && (a->transport || a->i2cFile == b->i2cFile);
+}
+
+/*
+ *
+ * Releases the emergency stop and restores every channel's staged output.
+ */
+int PCA9685_clearEmergencyStop(PCA9685_config* config)
+{
+	VERIFY(config);
+
+	int i;
+
+	if(!config->estop)
+		return PCA9685_ERR_TRIVIAL_ACTION;
+
+	PROBE_ENTRY(config, 0xFFFF);
+
+	config->estop = 0;
+
+	for(i=0;i<PCA9685_MAXCHAN;++i)
+		__stage_full(i, config);
+
+	return PROBE_RETURN(config, __commit(0xFFFF, 1, config));
+}
+
+/*
+ *
+ * The device only picks up new register values once per PWM cycle, so with the governor on,
+ * updates arriving within pwm_period of the last frame are staged and held back. They are
+ * merged (latest value wins) into one frame sent by the next update or PCA9685_service call
+ * after the period has passed. PCA9685_updateChannelsForce always goes out immediately,
+ * taking anything pending with it.
+ */
+int PCA9685_setGovernor(uint8_t enable,
+		PCA9685_config* config)
+{
+	VERIFY(config);
+
+	config->governor = enable;
+	config->last_frame_ns = 0;
+
+	if(!enable && config->pending)
+		return __update(0, 1, config);
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Sends the frame held back by the governor once its period has passed. Call it at least once per
+ * pwm_period (e.g. from the control loop) so the last update of a burst is not left pending.
+ * It also steps the dither and runs the idle policy (auto-sleep, RESTART after an auto-wake).
+ */
+int PCA9685_service(PCA9685_config* config)
+{
+	VERIFY(config);
+
+	PCA9685_WORD_t flips = 0;
+	uint64_t now;
+	int err;
+
+	if(config->idle_timeout_ms){
+		if(err = __finish_wake(config))
+			return err;
+
+		if(!config->auto_asleep && !config->pending && config->idle_since_ns &&
+				__now_ns() - config->idle_since_ns >= (uint64_t)config->idle_timeout_ms * 1000000){
+			if(err = PCA9685_sleep(config))
+				return err;
+			config->auto_asleep = 1;
+			config->stats.auto_sleeps++;
+		}
+	}
+
+	if(config->dither_channels){
+		now = __now_ns();
+		if(now - config->last_dither_ns >= (uint64_t)config->pwm_period * 1000){
+			config->last_dither_ns = now;
+			flips = __dither_step(config);
+		}
+	}
+
+	if(!config->pending && !flips)
+		return PCA9685_ERR_NOERR;
+
+	PROBE_ENTRY(config, config->pending | flips);
+
+	return PROBE_RETURN(config, __commit(flips, flips ? COMMIT_DITHER : 0, config));
+}
+
+/*
+ *
+ * Dithering: a dithered channel keeps its target in 1/256 ticks, and every PWM period (from
+ * PCA9685_service) a first order sigma-delta picks the tick below or above it, so the pulse
+ * averages to the fraction over a few periods. E.g. at 14 ms a tick is 3.4 us and a target of
+ * 100.25 ticks goes out as 100, 100, 100, 101, ... Only channels whose tick flips are sent.
+ * Duty times are converted to 1/256 ticks for dithered channels, commands to 1/16. With the
+ * governor on, a flip stepped within pwm_period of the last frame waits for the next one.
+ */
+int PCA9685_setDither(PCA9685_WORD_t channels,
+		PCA9685_config* config)
+{
+	VERIFY(config);
+
+	int i;
+	for(i=0;i<PCA9685_MAXCHAN;++i){
+		if((channels & ~config->dither_channels) & (1 << i)){
+			config->dither_acc[i] = 0;
+			config->dither_q8[i] = config->dither_out[i] << 8;
+		}
+	}
+	config->dither_channels = channels;
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * One sigma-delta step over all 16 channels, as straight line array code the compiler can
+ * vectorize; channels not dithered are masked out of the result. Stages and returns the
+ * channels whose tick changed.
+ */
+static PCA9685_WORD_t __dither_step(PCA9685_config* config)
+{
+	uint32_t next[PCA9685_MAXCHAN];
+	uint32_t sum;
+	PCA9685_WORD_t flips = 0;
+	int i;
+
+	for(i=0;i<PCA9685_MAXCHAN;++i){
+		sum = config->dither_acc[i] + (config->dither_q8[i] & 0xFF);
+		config->dither_acc[i] = sum & 0xFF;
+		next[i] = (config->dither_q8[i] >> 8) + (sum >> 8);
+	}
+
+	for(i=0;i<PCA9685_MAXCHAN;++i)
+		flips |= (PCA9685_WORD_t)((next[i] != config->dither_out[i]) << i);
+	flips &= config->dither_channels;
+
+	for(i=0;i<PCA9685_MAXCHAN;++i){
+		if(flips & (1 << i)){
+			config->dither_out[i] = next[i];
+			__stage_ticks(i, (PCA9685_WORD_t)next[i], config);
+		}
+	}
+
+	config->stats.dither_steps++;
+	config->stats.dither_flips += __builtin_popcount(flips);
+
+	return flips;
+}
+
+/*
+ *
+ * Sets a dithered channel's target, in 1/256 ticks, and stages the tick below it; the
+ * sigma-delta takes over from the next step.
+ */
+static void __stage_q8(uint8_t channel,
+		uint32_t ticks_q8,
+		PCA9685_config* config)
+{
+	if(ticks_q8 > ((PCA9685_MAX_TICK + 1) << 8))
+		ticks_q8 = (PCA9685_MAX_TICK + 1) << 8;
+
+	config->dither_q8[channel] = ticks_q8;
+	config->dither_out[channel] = ticks_q8 >> 8;
+	__stage_ticks(channel, (PCA9685_WORD_t)(ticks_q8 >> 8), config);
+}
+
+int PCA9685_getStats(PCA9685_stats* stats,
+		PCA9685_config* config)
+{
+	VERIFY(config);
+
+	if(!stats)
+		return PCA9685_ERR_TRIVIAL_ACTION;
+
+	*stats = config->stats;
+
+	return PCA9685_ERR_NOERR;
+}
+
+int PCA9685_clearStats(PCA9685_config* config)
+{
+	VERIFY(config);
+
+	memset(&config->stats, 0, sizeof(config->stats));
+
+	return PCA9685_ERR_NOERR;
+}
+
+static int __update(PCA9685_WORD_t channels,
+		int force,
+		PCA9685_config* config)
+{
+	int err;
+	int i;
+	for(i=0;i<PCA9685_MAXCHAN;++i){
+
+		if((channels & (1<<i)) == 0)
+			continue;
+
+		if(err = __stage_channel(i, config))
+			return err;
+	}
+
+	return __commit(channels, force, config);
+}
+
+/*
+ *
+ * Sends the staged channels, or holds them back if the governor says it is too early.
+ * Dither flips (COMMIT_DITHER) are +-1 tick by design, so they skip the deadband, even when
+ * held back and sent with a later frame; the governor holds them like any other update, or a
+ * flip stepped just after an update would be a second frame in the period.
+ */
+static int __commit(PCA9685_WORD_t channels,
+		int force,
+		PCA9685_config* config)
+{
+	if(__governed(channels, force, config))
+		return PCA9685_ERR_NOERR;
+
+	channels = __frame_channels(channels, force, config);
+
+	if(!config->idle_timeout_ms)
+		return __flush(channels, config);
+
+	return __idle_flush(channels, config);
+}
+
+//1 if the governor holds the channels back as pending
+static int __governed(PCA9685_WORD_t channels,
+		int force,
+		PCA9685_config* config)
+{
+	if(!config->governor)
+		return 0;
+
+	if(force == 1){
+		config->stats.updates_forced++;
+		return 0;
+	}
+
+	if(__now_ns() - config->last_frame_ns >= (uint64_t)config->pwm_period * 1000)
+		return 0;
+
+	if(force == COMMIT_DITHER)
+		config->pending_flips |= channels;
+	else{
+		//a later update of the channel is no longer a flip
+		config->pending_flips &= ~channels;
+		if(channels)
+			config->stats.updates_deferred++;
+	}
+	config->pending |= channels;
+
+	return 1;
+}
+
+//the channels of the frame going out now: the pending ones joined, the deadband applied
+static PCA9685_WORD_t __frame_channels(PCA9685_WORD_t channels,
+		int force,
+		PCA9685_config* config)
+{
+	PCA9685_WORD_t flips = config->pending_flips & config->pending;
+
+	if(force == COMMIT_DITHER)
+		flips |= channels;
+
+	channels |= config->pending;
+	if(force != 1)
+		channels = flips | __deadband(channels & ~flips, config);
+	config->pending = 0;
+	config->pending_flips = 0;
+
+	return channels;
+}
+
+/*
+ *
+ * __flush for boards with an idle timeout: wakes an auto-slept board when the frame turns an
+ * output on, and tracks since when every output has been off. The wake only clears SLEEP; RESTART
+ * follows once the oscillator has settled (__finish_wake), so the frame goes out right away
+ * and the 500 us are spent on whatever the caller does next, e.g. other boards and buses.
+ */
+static int __idle_flush(PCA9685_WORD_t channels,
+		PCA9685_config* config)
+{
+	int err, off = __outputs_off(config);
+	uint64_t now = __now_ns();
+
+	if(config->auto_asleep && !off){
+		if(err = __write_reg(PCA9685_REG_MODE1, config->mode1_settings & ~MODE1_SLEEP, config))
+			return err;
+
+		config->auto_asleep = 0;
+		config->restart_pending = 1;
+		config->wake_started_ns = now;
+		config->stats.auto_wakes++;
+	}
+
+	if(err = __flush(channels, config))
+		return err;
+
+	if(!off)
+		config->idle_since_ns = 0;
+	else if(!config->idle_since_ns)
+		config->idle_since_ns = now;
+
+	return __finish_wake(config);
+}
+
+/*
+ *
+ * Sets RESTART on a board woken by __idle_flush once its oscillator has had
+ * PCA9685_OSC_STARTUP_us; the outputs resume from the registers they had.
+ */
+static int __finish_wake(PCA9685_config* config)
+{
+	uint64_t latency;
+	int err;
+
+	if(!config->restart_pending)
+		return PCA9685_ERR_NOERR;
+
+	if(!(config->mode1_settings & PCA9685_SETTING_MODE1_EXTCLK) &&
+			__now_ns() - config->wake_started_ns < PCA9685_OSC_STARTUP_us * 1000)
+		return PCA9685_ERR_NOERR;
+
+	if(err = __write_reg(PCA9685_REG_MODE1, (config->mode1_settings & ~MODE1_SLEEP) | PCA9685_SETTING_MODE1_RESTART, config))
+		return err;
+
+	latency = __now_ns() - config->wake_started_ns;
+	config->restart_pending = 0;
+	config->stats.wake_latency_ns = (uint32_t)latency;
+	if(latency > config->stats.wake_latency_max_ns)
+		config->stats.wake_latency_max_ns = (uint32_t)latency;
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * An output is off when its full-off bit is set, or its pulse has no length and it is not full on.
+ */
+static int __outputs_off(PCA9685_config* config)
+{
+	uint8_t* img;
+	int i;
+
+	for(i=0;i<PCA9685_MAXCHAN;++i){
+		img = &config->led_image[i << 2];
+
+		if(img[3] & LED_FULL)
+			continue;
+		if((img[1] & LED_FULL) || img[0] != img[2] || (img[1] & 0x0F) != (img[3] & 0x0F))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ *
+ * Puts the board to sleep (from PCA9685_service) once every output has been off for timeout_ms,
+ * and wakes it on the first update that turns one on. 0 turns the policy off.
+ */
+int PCA9685_setIdleSleep(uint32_t timeout_ms,
+		PCA9685_config* config)
+{
+	VERIFY(config);
+
+	config->idle_timeout_ms = timeout_ms;
+	config->idle_since_ns = __outputs_off(config) ? __now_ns() : 0;
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Drops the channels whose off ticks moved by no more than their deadband since the last write,
+ * with everything else (on ticks, full bits) unchanged. The comparison is against the device
+ * shadow, not the previous request, so slow drift still gets through once it adds up.
+ */
+static PCA9685_WORD_t __deadband(PCA9685_WORD_t channels,
+		PCA9685_config* config)
+{
+	uint8_t* img;
+	uint8_t* shadow;
+	int i, diff;
+
+	for(i=0;i<PCA9685_MAXCHAN;++i){
+
+		if(!(channels & config->shadow_valid & (1 << i)) || !config->deadband[i])
+			continue;
+
+		img = &config->led_image[i << 2];
+		shadow = &config->led_shadow[i << 2];
+
+		if(img[0] != shadow[0] || img[1] != shadow[1] || (img[3] & ~0x0F) != (shadow[3] & ~0x0F))
+			continue;
+
+		diff = ((img[3] & 0x0F) << 8 | img[2]) - ((shadow[3] & 0x0F) << 8 | shadow[2]);
+		if(diff < 0)
+			diff = -diff;
+
+		if(diff == 0 || diff > config->deadband[i] ||
+				(config->deadband_refresh && config->suppressed_run[i] >= config->deadband_refresh)){
+			config->suppressed_run[i] = 0;
+			continue;
+		}
+
+		channels &= ~(1 << i);
+		config->suppressed_run[i]++;
+		config->stats.updates_suppressed++;
+		config->stats.suppressed[i]++;
+	}
+
+	return channels;
+}
+
+/*
+ *
+ * Off tick changes of at most ticks are not sent for the given channels (0 turns the deadband off).
+ * With refresh != 0, a channel is sent anyway after refresh suppressed updates in a row.
+ * Forced updates (PCA9685_updateChannelsForce, wake) always go through.
+ */
+int PCA9685_setDeadband(PCA9685_WORD_t channels,
+		PCA9685_WORD_t ticks,
+		uint16_t refresh,
+		PCA9685_config* config)
+{
+	VERIFY(config);
+
+	int i;
+	for(i=0;i<PCA9685_MAXCHAN;++i){
+		if(channels & (1 << i)){
+			config->deadband[i] = ticks;
+			config->suppressed_run[i] = 0;
+		}
+	}
+	config->deadband_refresh = refresh;
+
+	return PCA9685_ERR_NOERR;
+}
+
+int PCA9685_setBusClock(uint32_t bus_clock_Hz,
+		PCA9685_config* config)
+{
+	VERIFY(config);
+
+	if(bus_clock_Hz == 0)
+		return PCA9685_ERR_BOUNDS;
+
+	config->bus_clock = bus_clock_Hz;
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Converts the channel's duty time to ticks and stages it in the LED register image.
+ * Nothing is sent until __flush.
+ */
+static int __stage_channel(uint8_t channel,
+		PCA9685_config* config)
+{
+	PCA9685_reg offtime;
+
+	if(config->pwm_period < config->channels[channel].dutyTime_us)
+		return PCA9685_ERR_DUTY_OVERFLOW;
+
+	offtime.val = (PCA9685_WORD_t)__us_ticks(config->channels[channel].dutyTime_us, 0, config);
+
+	if(config->phase_mode == PCA9685_PHASE_MANUAL)
+		__manual_phase(channel, config);
+
+	if(config->dither_channels & (1 << channel))
+		__stage_q8(channel, __us_ticks(config->channels[channel].dutyTime_us, 8, config), config);
+	else
+		__stage_ticks(channel, offtime.val, config);
+	config->tick_domain &= ~(1 << channel);
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Stages a pulse of off_ticks ticks starting at the channel's phase. The off edge wraps past
+ * tick 4095 into the next cycle when it has to. The phase is cached in phase_ticks, so as long
+ * as it does not change, the ON registers do not change and the planner never resends them.
+ */
+static void __stage_ticks(uint8_t channel,
+		PCA9685_WORD_t off_ticks,
+		PCA9685_config* config)
+{
+	uint8_t* img = &config->led_image[channel << 2];
+	PCA9685_WORD_t on = config->phase_ticks[channel];
+
+	//a duty time equal to the period is a full-on output, not a 4096 tick overflow into the full-off bit
+	if(off_ticks > PCA9685_MAX_TICK){
+		config->duty_full_on |= 1 << channel;
+		off_ticks = 0;
+	}
+	else
+		config->duty_full_on &= ~(1 << channel);
 
-	if(mask == 0)
-		return PCA9685_ERR_TRIVIAL_ACTION;
+	off_ticks = (on + off_ticks) & PCA9685_MAX_TICK;
 
-	if(mask != 0xff){
-		if(err = __read_reg(reg, &temp, config)){
-			perror("error reading from device");
+	img[0] = GET_LOW(on);//on time
+	img[1] = GET_HIGH(on);
+	img[2] = GET_LOW(off_ticks);
+	img[3] = GET_HIGH(off_ticks);
+
+	__stage_full(channel, config);
+}
+
+static void __manual_phase(uint8_t channel,
+		PCA9685_config* config)
+{
+	uint32_t phase_us = config->channels[channel].dutyPhase_us % config->pwm_period;
+
+	config->phase_ticks[channel] = (PCA9685_WORD_t)__us_ticks(phase_us, 0, config) & PCA9685_MAX_TICK;
+}
+
+/*
+ *
+ * Where each channel's pulse starts:
+ * PCA9685_PHASE_NONE, every channel at tick 0 (the power-on behaviour);
+ * PCA9685_PHASE_MANUAL, at the channel's dutyPhase_us, converted when the duty time is;
+ * PCA9685_PHASE_AUTO, channel n at offset_ticks + n * 4096 / 16, so at most one on edge per
+ * 256 ticks per board. See PCA9685_allocatePhases to interleave several boards.
+ * Channels are restaged at their new phase on their next update.
+ */
+int PCA9685_setPhaseMode(uint8_t mode,
+		PCA9685_WORD_t offset_ticks,
+		PCA9685_config* config)
+{
+	VERIFY(config);
+
+	int i;
+
+	if(mode > PCA9685_PHASE_AUTO || offset_ticks > PCA9685_MAX_TICK)
+		return PCA9685_ERR_BOUNDS;
+
+	config->phase_mode = mode;
+
+	for(i=0;i<PCA9685_MAXCHAN;++i){
+		if(mode == PCA9685_PHASE_AUTO)
+			config->phase_ticks[i] = (offset_ticks + i * ((PCA9685_MAX_TICK + 1) / PCA9685_MAXCHAN)) & PCA9685_MAX_TICK;
+		else if(mode == PCA9685_PHASE_MANUAL)
+			__manual_phase(i, config);
+		else
+			config->phase_ticks[i] = 0;
+	}
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Automatic phases for a group of boards (typically those sharing a supply rail): each board's
+ * channels are spread over the cycle, and the boards are offset from one another inside the
+ * 256 tick slot between two channels, so no two on edges of the group coincide while there are
+ * fewer than 256 boards.
+ */
+int PCA9685_allocatePhases(PCA9685_config** configs,
+		int n_configs)
+{
+	int b, err;
+
+	if(!configs || n_configs <= 0)
+		return PCA9685_ERR_NO_CONFIG;
+
+	for(b=0;b<n_configs;++b)
+		if(err = PCA9685_setPhaseMode(PCA9685_PHASE_AUTO,
+				(PCA9685_WORD_t)(b * ((PCA9685_MAX_TICK + 1) / PCA9685_MAXCHAN) / n_configs), configs[b]))
+			return err;
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Applies the full-on / full-off bits on top of the staged ticks.
+ */
+static void __stage_full(uint8_t channel,
+		PCA9685_config* config)
+{
+	uint8_t* img = &config->led_image[channel << 2];
+
+	if((config->full_on | config->duty_full_on) & (1 << channel))
+		img[1] |= LED_FULL;
+	else
+		img[1] &= ~LED_FULL;
+
+	if(config->estop || (config->full_off & (1 << channel)))
+		img[3] |= LED_FULL;
+	else
+		img[3] &= ~LED_FULL;
+}
+
+/*
+ *
+ * Transaction planner.
+ *
+ * Compares the staged LED registers of the given channels against what was last written to the
+ * device and sends only what changed. Wire time is modelled in SCL bit-times: every message pays
+ * a (repeated) START, the address byte and the register pointer byte, each byte costing 9 bits with
+ * its ACK; the transaction pays one STOP. With auto increment, a gap of clean registers between two
+ * dirty runs is rewritten whenever that is cheaper than opening another message, so a sparse update
+ * becomes several short messages (e.g. 2-byte OFF-only writes) and a dense one becomes one burst.
+ * Without auto increment each dirty register is its own 2-byte message. All messages of a flush go
+ * out in one I2C_RDWR transaction, so the outputs change together on the final STOP.
+ */
+static int __flush(PCA9685_WORD_t channels,
+		PCA9685_config* config)
+{
+	PCA9685_msg msgs[PCA9685_LED_REGS];
+	uint8_t bufs[PCA9685_LED_REGS * 2];
+	int n_msgs, bits, i, err;
+
+	n_msgs = __led_msgs(channels, msgs, bufs, &bits, config);
+
+	if(n_msgs == 0){
+		config->last_flush_wire_ns = 0;
+		return PCA9685_ERR_NOERR;
+	}
+
+	//I2C_RDWR caps the number of messages per transaction
+	for(i=0;i<n_msgs;i+=I2C_RDWR_IOCTL_MAX_MSGS){
+		bits += PCA9685_STOP_BITS;
+		if(err = __xfer(&msgs[i], n_msgs - i < I2C_RDWR_IOCTL_MAX_MSGS ? n_msgs - i : I2C_RDWR_IOCTL_MAX_MSGS, config))
 			return err;
+	}
+
+	__flushed(channels, msgs, n_msgs, bits, config);
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * The planner's messages for the dirty LED registers of channels, bufs holding at least
+ * PCA9685_LED_REGS * 2 bytes. Returns the number of messages, their wire time (without the
+ * STOP) in bits.
+ */
+static int __led_msgs(PCA9685_WORD_t channels,
+		PCA9685_msg* msgs,
+		uint8_t* bufs,
+		int* bits,
+		PCA9685_config* config)
+{
+	uint8_t dirty[PCA9685_LED_REGS];
+	int autoincr = config->mode1_settings & PCA9685_SETTING_MODE1_AUTOINCR;
+	int n_msgs = 0, n_bytes = 0;
+	int i, start, end, next;
+
+	*bits = 0;
+
+	for(i=0;i<PCA9685_LED_REGS;++i)
+		dirty[i] = (channels & (1 << (i >> 2))) &&
+				(!(config->shadow_valid & (1 << (i >> 2))) || config->led_image[i] != config->led_shadow[i]);
+
+	for(start=0;start<PCA9685_LED_REGS;start=next){
+
+		if(!dirty[start]){
+			next = start + 1;
+			continue;
 		}
-		val = (temp & (~mask)) | val;
+
+		end = start;
+		if(autoincr){
+			//extend the run while the next dirty register is closer than the price of a new message
+			for(next=end+1;next<PCA9685_LED_REGS;++next){
+				if(!dirty[next])
+					continue;
+				if((next - end - 1) * PCA9685_BYTE_BITS >= PCA9685_MSG_OVERHEAD_BITS)
+					break;
+				end = next;
+			}
+		}
+		next = end + 1;
+
+		msgs[n_msgs].addr = config->dev_i2c_address >> 1;
+		msgs[n_msgs].flags = 0;
+		msgs[n_msgs].len = end - start + 2;
+		msgs[n_msgs].buf = &bufs[n_bytes];
+		bufs[n_bytes++] = PCA9685_REG_LEDX_ON_L + start;
+		for(i=start;i<=end;++i)
+			bufs[n_bytes++] = config->led_image[i];
+
+		*bits += PCA9685_MSG_OVERHEAD_BITS + (end - start + 1) * PCA9685_BYTE_BITS;
+		++n_msgs;
 	}
 
-	return __write_reg(reg, val, config);
+	return n_msgs;
 }
 
-int PCA9685_readReg(uint8_t reg,
-		char* buf,
+/*
+ *
+ * Bookkeeping once a frame's messages are on the bus: stats, governor clock and the shadow.
+ */
+static void __flushed(PCA9685_WORD_t channels,
+		PCA9685_msg* msgs,
+		int n_msgs,
+		int bits,
+		PCA9685_config* config)
+{
+	uint32_t bus_clock = config->bus_clock ? config->bus_clock : PCA9685_DEFAULT_BUS_CLOCK;//0: config not prepared
+	int i;
+
+	config->last_flush_wire_ns = (uint32_t)(((uint64_t)bits * 1000000000u) / bus_clock);
+	if(config->governor)
+		config->last_frame_ns = __now_ns();
+
+	config->stats.frames++;
+	config->stats.msgs += n_msgs;
+	config->stats.bytes += __msg_bytes(msgs, n_msgs);
+	config->stats.wire_ns += config->last_flush_wire_ns;
+
+	for(i=0;i<PCA9685_LED_REGS;++i)
+		if(channels & (1 << (i >> 2)))
+			config->led_shadow[i] = config->led_image[i];
+	config->shadow_valid |= channels;
+
+	__persist(config);
+}
+
+int PCA9685_setTransport(PCA9685_transport* transport,
 		PCA9685_config* config)
 {
 	VERIFY(config);
 
-	return __read_reg(reg, buf, config);
+	config->transport = transport;
+	config->shadow_valid = 0;
+
+	return PCA9685_ERR_NOERR;
+}
+
+/*
+ *
+ * Default transport: the kernel i2c-dev interface. ctx is the open /dev/i2c-N descriptor.
+ */
+int PCA9685_i2cdevTransfer(void* i2cfile,
+		PCA9685_msg* msgs,
+		int n_msgs)
+{
+	struct i2c_rdwr_ioctl_data rdwr;
+
+	rdwr.msgs = (struct i2c_msg*)msgs;
+	rdwr.nmsgs = n_msgs;
+
+	if (ioctl((int)(intptr_t)i2cfile, I2C_RDWR, &rdwr) != n_msgs) {
+		perror("i2cTransfer");
+		return (msgs[n_msgs - 1].flags & PCA9685_MSG_RD) ? PCA9685_ERR_I2C_READ : PCA9685_ERR_I2C_WRITE;
+	}
+
+	return PCA9685_ERR_NOERR;
+}
+
+static int __xfer(PCA9685_msg* msgs,
+		int n_msgs,
+		PCA9685_config* config)
+{
+	int err;
+
+	PROBE4(xfer__start, msgs[0].addr, msgs[0].buf[0], n_msgs, __msg_bytes(msgs, n_msgs));
+
+	if(config->transport)
+		err = config->transport->transfer(config->transport->ctx, msgs, n_msgs);
+	else
+		err = PCA9685_i2cdevTransfer((void*)(intptr_t)config->i2cFile, msgs, n_msgs);
+
+	PROBE3(xfer__done, msgs[0].addr, n_msgs, err);
+	if(err)
+		PROBE3(error, __func__, config->dev_i2c_address, err);
+
+	return err;
+}
+
+static int __xfer_urgent(PCA9685_msg* msgs,
+		int n_msgs,
+		PCA9685_config* config)
+{
+	int err;
+
+	if(!config->transport || !config->transport->urgent)
+		return __xfer(msgs, n_msgs, config);
+
+	PROBE4(xfer__start, msgs[0].addr, msgs[0].buf[0], n_msgs, __msg_bytes(msgs, n_msgs));
+
+	err = config->transport->urgent(config->transport->ctx, msgs, n_msgs);
+
+	PROBE3(xfer__done, msgs[0].addr, n_msgs, err);
+	if(err)
+		PROBE3(error, __func__, config->dev_i2c_address, err);
 
+	return err;
 }
 
 static int __write_reg(uint8_t reg,
@@ -435,22 +1893,18 @@ static int __write_reg(uint8_t reg,
 		PCA9685_config* config)
 {
 	uint8_t data[2];
-
-	if (ioctl(config->i2cFile, I2C_SLAVE, (char)(config->dev_i2c_address>>1)) < 0) {
-		perror("i2cSetAddress");
-		return PCA9685_ERR_SET_SLAVEADDR;
-	}
+	PCA9685_msg msg;
 
 	//data[0] = config->dev_i2c_address | PCA9685_WRITE_BIT;
 	data[0] = reg;
 	data[1] = val;
 
-	if (write(config->i2cFile, data, 2) != 2) {
-		perror("pca9555SetRegister");
-		return PCA9685_ERR_I2C_WRITE;
-	}
+	msg.addr = config->dev_i2c_address >> 1;
+	msg.flags = 0;
+	msg.len = 2;
+	msg.buf = data;
 
-	return PCA9685_ERR_NOERR;
+	return __xfer(&msg, 1, config);
 }
 
 static int __read_reg(uint8_t reg,
@@ -458,49 +1912,91 @@ static int __read_reg(uint8_t reg,
 		PCA9685_config* config)
 {
 
-	char data[2];
+	uint8_t data[1];
+	PCA9685_msg msgs[2];
 	//data[0] = config->dev_i2c_address;
 	data[0] = reg;
 
-	if (ioctl(config->i2cFile, I2C_SLAVE, (char)(config->dev_i2c_address>>1)) < 0) {
-		perror("i2cSetAddress");
-		return PCA9685_ERR_SET_SLAVEADDR;
-	}
-
-	if(write(config->i2cFile, data, 1) != 1 ){
-		perror("pca9555SetRegisterPair");
-		return PCA9685_ERR_I2C_WRITE;
-	}
-
-	if(read(config->i2cFile, buf, 1) != 1 ){
-		perror("pca9555SetRegisterPair");
-		return PCA9685_ERR_I2C_READ;
-	}
-
-	return PCA9685_ERR_NOERR;
+	//register pointer write and data read joined by a repeated START
+	msgs[0].addr = config->dev_i2c_address >> 1;
+	msgs[0].flags = 0;
+	msgs[0].len = 1;
+	msgs[0].buf = data;
+	msgs[1].addr = config->dev_i2c_address >> 1;
+	msgs[1].flags = PCA9685_MSG_RD;
+	msgs[1].len = 1;
+	msgs[1].buf = (uint8_t*)buf;
+
+	return __xfer(msgs, 2, config);
 }
 
 int PCA9685_wake(PCA9685_config* config)
 {
 	VERIFY(config);
+	PROBE_ENTRY(config, 0xFFFF);
+
+	int err;
+
+	//a full wake: the idle policy's own wake and RESTART are not needed after it
+	config->auto_asleep = 0;
+	config->restart_pending = 0;
 
-	PCA9685_updateChannelRange(0, PCA9685_MAXCHAN-1, config);
+	if(err = __update(0xFFFF, 1, config))
+		return PROBE_RETURN(config, err);
 
 	if(PCA9685_writeReg(PCA9685_REG_MODE1,config->mode1_settings & ~MODE1_SLEEP, config, 0xff))
-		return PCA9685_ERR_I2C_WRITE;
+		return PROBE_RETURN(config, PCA9685_ERR_I2C_WRITE);
 
 	if(config->int_settings ^ EXTOSC_ENABLED)
-		usleep(500);
+		usleep(PCA9685_OSC_STARTUP_us);
+
+	return PROBE_RETURN(config, PCA9685_ERR_NOERR);
+}
+
+/*
+ *
+ * PCA9685_wake for many boards: the MODE1 wake writes of a bus go out together, and the oscillator
+ * start-up is waited for once instead of once per board. Unlike PCA9685_wake the channels are not
+ * flushed here, write them first. Pass wait = 0 to overlap the start-up with other work; the
+ * outputs are not valid until PCA9685_OSC_STARTUP_us later.
+ */
+int PCA9685_wake_batch(PCA9685_config** configs,
+		int n_configs,
+		uint8_t wait)
+{
+	int i, err, need_wait = 0;
+
+	if(!configs || n_configs <= 0)
+		return PCA9685_ERR_NO_CONFIG;
+
+	for(i=0;i<n_configs;++i)
+		need_wait |= configs[i]->int_settings ^ EXTOSC_ENABLED;
+
+	if(err = __batch_xfer(configs, n_configs, __wake_msgs))
+		return err;
+
+	if(wait && need_wait)
+		usleep(PCA9685_OSC_STARTUP_us);
 
 	return PCA9685_ERR_NOERR;
 }
 
+static uint64_t __now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
 int PCA9685_sleep(PCA9685_config* config)
 
 {
 	VERIFY(config);
+	PROBE_ENTRY(config, 0);
 
-	return PCA9685_writeReg(PCA9685_REG_MODE1,config->mode1_settings | MODE1_SLEEP,config, 0xff);
+	return PROBE_RETURN(config, PCA9685_writeReg(PCA9685_REG_MODE1,config->mode1_settings | MODE1_SLEEP,config, 0xff));
 }
 /*
 
@@ -527,26 +2023,345 @@ int PCA9685_disableAutoIncrement(PCA9685_config* config)
 	return PCA9685_writeReg(PCA9685_REG_MODE1,0,0,config);
 }
 
-//TODO
-int PCA9685_changePWMPeriod(int newPeriod_us, PCA9685_config* config)
+*/
+
+/*
+ *
+ * Retunes a running board to a new PWM period. Every pulse keeps its length in us: channels
+ * driven by duty time are restaged from it (clamped to full on if longer than the new period),
+ * channels driven by ticks or commands are rescaled. One transfer puts the board to sleep,
+ * writes the new prescale and all 16 channels and wakes it; after the oscillator start-up a
+ * second one-byte write sets RESTART. The board is left running.
+ */
+int PCA9685_changePWMPeriod(uint32_t newPeriod_us,
+		PCA9685_config* config)
 {
 	VERIFY(config);
+	PROBE_ENTRY(config, 0xFFFF);
+
+	return PROBE_RETURN(config, __retune(newPeriod_us, config->osc_freq, config));
+}
 
-	config->pwm_period = newPeriod_us;
+/*
+ *
+ * Call after the external oscillator has been changed in hardware: same sequence as
+ * PCA9685_changePWMPeriod, keeping the period.
+ */
+int PCA9685_changeExtOSC(uint32_t new_osc_freq_hz,
+		PCA9685_config* config)
+{
+	VERIFY(config);
+	PROBE_ENTRY(config, 0xFFFF);
 
-	return PCA9685_ERR_NOERR;
+	return PROBE_RETURN(config, __retune(config->pwm_period, new_osc_freq_hz, config));
 }
 
-//TODO
+static int __retune(uint32_t period_us,
+		uint32_t osc,
+		PCA9685_config* config)
+{
+	PCA9685_msg msgs[4];
+	uint8_t sleep_buf[2], prescale_buf[2], wake_buf[2], leds[PCA9685_LED_REGS + 1];
+	uint8_t old_prescale = config->prescale, old_image[PCA9685_LED_REGS];
+	uint32_t old_period = config->pwm_period, ticks;
+	PCA9685_WORD_t old_phase[PCA9685_MAXCHAN], old_tick_domain, old_full_on;
+	uint8_t* img;
+	int i, err;
+
+	if(period_us == 0 || osc == 0)
+		return PCA9685_ERR_BOUNDS;
+
+	//what the rescale below changes, put back if the transfer fails
+	memcpy(old_image, config->led_image, PCA9685_LED_REGS);
+	memcpy(old_phase, config->phase_ticks, sizeof(old_phase));
+	old_tick_domain = config->tick_domain;
+	old_full_on = config->duty_full_on;
+
+	if(err = __calc_prescale(period_us, osc, config))
+		return err;
+
+	__set_period(period_us, config);
 
- //This function should be called after the external osc has been changed in hardware
+	for(i=0;i<PCA9685_MAXCHAN;++i){
+		img = &config->led_image[i << 2];
+
+		if(config->phase_mode == PCA9685_PHASE_MANUAL)
+			__manual_phase(i, config);
+
+		if(config->tick_domain & (1 << i)){
+			ticks = config->duty_full_on & (1 << i) ? PCA9685_MAX_TICK + 1 :
+					((((img[3] & 0x0F) << 8) | img[2]) - (((img[1] & 0x0F) << 8) | img[0])) & PCA9685_MAX_TICK;
+			ticks = (uint32_t)(((uint64_t)ticks * old_period + period_us / 2) / period_us);
+			__stage_ticks(i, (PCA9685_WORD_t)(ticks > PCA9685_MAX_TICK ? PCA9685_MAX_TICK + 1 : ticks), config);
+		}
+		else if(config->channels[i].dutyTime_us > period_us)
+			__stage_ticks(i, PCA9685_MAX_TICK + 1, config);
+		else
+			__stage_channel(i, config);
+	}
+
+	//auto increment on for the burst, whatever the user's setting; the wake write restores it
+	sleep_buf[0] = PCA9685_REG_MODE1;
+	sleep_buf[1] = (config->mode1_settings | MODE1_SLEEP | PCA9685_SETTING_MODE1_AUTOINCR) & ~PCA9685_SETTING_MODE1_RESTART;
+	prescale_buf[0] = PCA9685_REG_PRESCALE;
+	prescale_buf[1] = config->prescale;
+	leds[0] = PCA9685_REG_LEDX_ON_L;
+	memcpy(&leds[1], config->led_image, PCA9685_LED_REGS);
+	wake_buf[0] = PCA9685_REG_MODE1;
+	wake_buf[1] = config->mode1_settings & ~(MODE1_SLEEP | PCA9685_SETTING_MODE1_RESTART);
+
+	for(i=0;i<4;++i){
+		msgs[i].addr = config->dev_i2c_address >> 1;
+		msgs[i].flags = 0;
+		msgs[i].len = 2;
+	}
+	msgs[0].buf = sleep_buf;
+	msgs[1].buf = prescale_buf;
+	msgs[2].buf = leds;
+	msgs[2].len = sizeof(leds);
+	msgs[3].buf = wake_buf;
+
+	if(err = __xfer(msgs, 4, config)){
+		//the board state is unknown, keep the old timing and outputs so a retry starts from them
+		config->prescale = old_prescale;
+		__set_period(old_period, config);
+		memcpy(config->led_image, old_image, PCA9685_LED_REGS);
+		memcpy(config->phase_ticks, old_phase, sizeof(old_phase));
+		config->tick_domain = old_tick_domain;
+		config->duty_full_on = old_full_on;
+		config->shadow_valid = 0;
+		return err;
+	}
+
+	memcpy(config->led_shadow, config->led_image, PCA9685_LED_REGS);
+	config->shadow_valid = 0xFFFF;
+	config->pending = 0;
+	config->osc_freq = osc;
+	//the retune's own wake and RESTART replace any the idle policy had coming
+	config->auto_asleep = 0;
+	config->restart_pending = 0;
+	__persist(config);
+	config->stats.frames++;
+	config->stats.msgs += 4;
+	config->stats.bytes += 6 + sizeof(leds);
+	if(config->governor)
+		config->last_frame_ns = __now_ns();
+
+	if(!(config->mode1_settings & PCA9685_SETTING_MODE1_EXTCLK))
+		usleep(PCA9685_OSC_STARTUP_us);
+
+	wake_buf[1] |= PCA9685_SETTING_MODE1_RESTART;
+
+	return __xfer(&msgs[3], 1, config);
+}
+
+
+/*
+ *
+ * Copies what the board was last sent into config->state. The generation is odd while the copy
+ * is in progress, so a process that dies halfway leaves a record PCA9685_restoreState will not trust.
+ */
+static void __persist(PCA9685_config* config)
+{
+	PCA9685_boardState* st = config->state;
+	uint32_t gen;
+	int i;
+
+	if(!st)
+		return;
+
+	gen = st->generation | 1;
+	__atomic_store_n(&st->generation, gen, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	st->mode1 = config->mode1_settings & ~(MODE1_SLEEP | PCA9685_SETTING_MODE1_RESTART);
+	st->mode2 = config->mode2_settings;
+	st->prescale = config->prescale;
+	st->pwm_period = config->pwm_period;
+	st->osc_freq = config->osc_freq;
+	st->valid = config->shadow_valid;
+	st->tick_domain = config->tick_domain;
+	st->full_on = config->full_on;
+	st->full_off = config->full_off;
+	st->estop = config->estop;
+	for(i=0;i<PCA9685_MAXCHAN;++i)
+		st->duty_us[i] = config->channels[i].dutyTime_us;
+	memcpy(st->leds, config->led_shadow, PCA9685_LED_REGS);
+
+	__atomic_store_n(&st->generation, gen + 1, __ATOMIC_RELEASE);
+}
 
-int PCA9685_changeExtOSC(int new_osc_freq_hz, PCA9685_config* config)
+/*
+ *
+ * Resumes a board after a process restart instead of reinitializing it. Call it on a prepared
+ * config (PCA9685_config_prepare) in place of PCA9685_config_only + PCA9685_wake.
+ *
+ * MODE1..LED15 and PRESCALE are read in one transfer and compared with the record: with a record
+ * for the same address and timing, the config picks up the duty times, ticks and full on / off
+ * state it had, and only registers that differ from it are written, so a board that kept running
+ * gets no writes at all and a power cycled one is put back where it was. Without a usable record
+ * (new, torn by a crash mid-update, or for other settings) the device's outputs are adopted as
+ * they are. Either way the board is awake afterwards and every later flush updates the record.
+ * Reading the LEDs in one go needs auto increment; a device without it costs one more transfer.
+ * A record whose generation moves while it is copied is read again, with the device, up to
+ * RESTORE_TRIES times; PCA9685_ERR_STATE if it never holds still.
+ */
+int PCA9685_restoreState(PCA9685_boardState* state,
+		uint8_t* outcome,
+		PCA9685_config* config)
 {
 	VERIFY(config);
+	PROBE_ENTRY(config, 0xFFFF);
 
-	config->osc_freq = new_osc_freq_hz;
+	PCA9685_boardState rec;
+	PCA9685_msg msgs[3];
+	uint8_t regs[PCA9685_REG_LEDX_ON_L + PCA9685_LED_REGS], bufs[6], prescale;
+	uint8_t mode_mask = (uint8_t)~(MODE1_SLEEP | PCA9685_SETTING_MODE1_RESTART);
+	uint32_t gen, frames;
+	int i, usable, timing, asleep, wrote = 0, err;
 
-	return PCA9685_ERR_NOERR;
+	if(!state)
+		return PROBE_RETURN(config, PCA9685_ERR_NO_CONFIG);
+
+	//the device and the record as one snapshot, taken again while another process rewrites the record
+	for(i=0;;++i){
+		if(i == RESTORE_TRIES)
+			return PROBE_RETURN(config, PCA9685_ERR_STATE);
+
+		gen = __atomic_load_n(&state->generation, __ATOMIC_ACQUIRE);
+
+		if(err = __read_state(regs, &prescale, config))
+			return PROBE_RETURN(config, err);
+
+		memcpy(&rec, state, sizeof(rec));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&state->generation, __ATOMIC_RELAXED) == gen)
+			break;
+	}
+
+	usable = gen && !(gen & 1) && rec.dev_address == config->dev_i2c_address &&
+			rec.prescale == config->prescale && rec.pwm_period == config->pwm_period &&
+			rec.mode1 == (config->mode1_settings & mode_mask) && rec.mode2 == (uint8_t)config->mode2_settings;
+
+	timing = prescale == config->prescale && regs[PCA9685_REG_MODE2] == (uint8_t)config->mode2_settings &&
+			(regs[PCA9685_REG_MODE1] & mode_mask) == (config->mode1_settings & mode_mask);
+
+	memcpy(config->led_shadow, &regs[PCA9685_REG_LEDX_ON_L], PCA9685_LED_REGS);
+	memcpy(config->led_image, config->led_shadow, PCA9685_LED_REGS);
+	config->shadow_valid = 0xFFFF;
+	config->pending = 0;
+
+	if(usable){
+		for(i=0;i<PCA9685_MAXCHAN;++i){
+			config->channels[i].dutyTime_us = rec.duty_us[i];
+			if(rec.valid & (1 << i))
+				memcpy(&config->led_image[i << 2], &rec.leds[i << 2], 4);
+		}
+		config->tick_domain = rec.tick_domain;
+		config->full_on = rec.full_on;
+		config->full_off = rec.full_off;
+		config->estop = rec.estop;
+	}
+	else
+		config->tick_domain = 0xFFFF;//only the ticks are known
+
+	//keep the on edges where they are, so later updates only move the off edges
+	config->duty_full_on = 0;
+	for(i=0;i<PCA9685_MAXCHAN;++i){
+		config->phase_ticks[i] = ((config->led_image[(i << 2) + 1] & 0x0F) << 8) | config->led_image[i << 2];
+		if((config->led_image[(i << 2) + 1] & LED_FULL) && !(config->full_on & (1 << i)))
+			config->duty_full_on |= 1 << i;
+	}
+
+	//settings only take while asleep: the prescale needs SLEEP, the wake below clears it
+	if(!timing){
+		__reg_msg(PCA9685_REG_MODE1, (config->mode1_settings | MODE1_SLEEP) & ~PCA9685_SETTING_MODE1_RESTART, &msgs[0], &bufs[0], config);
+		__reg_msg(PCA9685_REG_PRESCALE, config->prescale, &msgs[1], &bufs[2], config);
+		__reg_msg(PCA9685_REG_MODE2, config->mode2_settings, &msgs[2], &bufs[4], config);
+
+		if(err = __xfer(msgs, 3, config))
+			return PROBE_RETURN(config, err);
+		wrote = 1;
+	}
+	asleep = !timing || (regs[PCA9685_REG_MODE1] & MODE1_SLEEP);
+
+	frames = config->stats.frames;
+	if(err = __flush(0xFFFF, config))
+		return PROBE_RETURN(config, err);
+	wrote |= config->stats.frames != frames;
+
+	if(asleep){
+		if(err = __write_reg(PCA9685_REG_MODE1, config->mode1_settings & ~(MODE1_SLEEP | PCA9685_SETTING_MODE1_RESTART), config))
+			return PROBE_RETURN(config, err);
+
+		if(!(config->mode1_settings & PCA9685_SETTING_MODE1_EXTCLK))
+			usleep(PCA9685_OSC_STARTUP_us);
+
+		//RESTART reads 1 when the board was put to sleep while running: resume the old cycle
+		if(timing && (regs[PCA9685_REG_MODE1] & PCA9685_SETTING_MODE1_RESTART) &&
+				(err = __write_reg(PCA9685_REG_MODE1, (config->mode1_settings & ~MODE1_SLEEP) | PCA9685_SETTING_MODE1_RESTART, config)))
+			return PROBE_RETURN(config, err);
+		wrote = 1;
+	}
+	config->mode1_settings &= ~MODE1_SLEEP;
+
+	state->i2c_bus = config->i2c_bus;
+	state->dev_address = config->dev_i2c_address;
+	config->state = state;
+	__persist(config);
+
+	if(outcome)
+		*outcome = !usable ? PCA9685_RESTORE_ADOPTED : wrote ? PCA9685_RESTORE_REPAIRED : PCA9685_RESTORE_RESUMED;
+
+	return PROBE_RETURN(config, PCA9685_ERR_NOERR);
+}
+
+/*
+ *
+ * MODE1 through LED15_OFF_H and PRESCALE in one transfer, relying on auto increment. A device
+ * without it (e.g. just powered up) returns MODE1 over and over, so the rest is then read again
+ * in a second transfer with auto increment switched on around the read; RESTART is written as 0,
+ * which leaves it alone.
+ */
+static int __read_state(uint8_t* regs,
+		uint8_t* prescale,
+		PCA9685_config* config)
+{
+	PCA9685_msg msgs[4];
+	uint8_t ptrs[2] = {PCA9685_REG_MODE1, PCA9685_REG_PRESCALE}, ai_on[2], ai_off[2];
+	int i, err;
+
+	for(i=0;i<4;++i)
+		msgs[i].addr = config->dev_i2c_address >> 1;
+
+	msgs[0].flags = 0;
+	msgs[0].len = 1;
+	msgs[0].buf = &ptrs[0];
+	msgs[1].flags = PCA9685_MSG_RD;
+	msgs[1].len = PCA9685_REG_LEDX_ON_L + PCA9685_LED_REGS;
+	msgs[1].buf = regs;
+	msgs[2].flags = 0;
+	msgs[2].len = 1;
+	msgs[2].buf = &ptrs[1];
+	msgs[3].flags = PCA9685_MSG_RD;
+	msgs[3].len = 1;
+	msgs[3].buf = prescale;
+
+	if(err = __xfer(msgs, 4, config))
+		return err;
+
+	if(regs[PCA9685_REG_MODE1] & PCA9685_SETTING_MODE1_AUTOINCR)
+		return PCA9685_ERR_NOERR;
+
+	ptrs[0] = PCA9685_REG_MODE2;
+	__reg_msg(PCA9685_REG_MODE1, (regs[PCA9685_REG_MODE1] | PCA9685_SETTING_MODE1_AUTOINCR) & ~PCA9685_SETTING_MODE1_RESTART, &msgs[0], ai_on, config);
+	msgs[1].flags = 0;
+	msgs[1].len = 1;
+	msgs[1].buf = &ptrs[0];
+	msgs[2].flags = PCA9685_MSG_RD;
+	msgs[2].len = PCA9685_REG_LEDX_ON_L + PCA9685_LED_REGS - PCA9685_REG_MODE2;
+	msgs[2].buf = &regs[PCA9685_REG_MODE2];
+	__reg_msg(PCA9685_REG_MODE1, regs[PCA9685_REG_MODE1] & ~PCA9685_SETTING_MODE1_RESTART, &msgs[3], ai_off, config);
+
+	return __xfer(msgs, 4, config);
 }
-*/
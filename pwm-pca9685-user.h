@@ -12,7 +12,6 @@
  *	TODO: add support for auto increment
  *	TODO: add duty cycle param support
  *	TODO: add allcall LED support
- *	TODO: resolve I2C_SLAVE set so we can have multiple slaves
  *	TODO: add support for STOP vs ACK
  *	TODO: add support for phase
  *
@@ -43,6 +42,12 @@ extern "C"{
 #define PCA9685_ERR_NO_FILE					-10
 #define PCA9685_ERR_TRIVIAL_ACTION			-11
 #define PCA9685_ERR_BOUNDS					-12
+#define PCA9685_ERR_TRACE					-13
+#define PCA9685_ERR_BUS_LOCK				-14
+#define PCA9685_ERR_NO_CALIBRATION			-15
+#define PCA9685_ERR_RT						-16
+#define PCA9685_ERR_CANCELLED				-17
+#define PCA9685_ERR_STATE					-18
 
 /////////////////////////////////////////////
 /////////////// REGISTER LIST ///////////////
@@ -92,6 +97,15 @@ extern "C"{
 #define PCA9685_PRESCALE_DEFAULT 0b11111110
 #define PCA9685_MIN_PRESCALE 3
 
+//internal oscillator start-up after SLEEP is cleared
+#define PCA9685_OSC_STARTUP_us 500
+
+//measured internal oscillator, per 25 MHz nominal, at low and high prescales (linear in between)
+#define PCA9685_INTOSC_LOW_PRESCALE 3
+#define PCA9685_INTOSC_LOW_Hz 21000000
+#define PCA9685_INTOSC_HIGH_PRESCALE 80
+#define PCA9685_INTOSC_HIGH_Hz 28000000
+
 //////////////////////////////////////////////
 ///////////// COMPANY SETTINGS ///////////////
 //////////////////////////////////////////////
@@ -106,11 +120,27 @@ extern "C"{
 #define FUTABA_MAX_PERIOD_us 1200
 #define PCA9685_FUTABAS3004_PWM_PERIOD 14000 //us
 
+// I2C bus
+#define PCA9685_DEFAULT_BUS_CLOCK 100000 //Hz, standard mode
+#define PCA9685_FASTMODE_BUS_CLOCK 400000 //Hz
+
 //////////////////////////////////////////////
 ////////////////// A P I /////////////////////
 //////////////////////////////////////////////
 
 #define PCA9685_MAXCHAN         16
+#define PCA9685_LED_REGS        (PCA9685_MAXCHAN*4)
+#define PCA9685_MAX_TICK        4095
+
+//channel output modes
+#define PCA9685_CHANNEL_PWM			0
+#define PCA9685_CHANNEL_FULL_ON		1
+#define PCA9685_CHANNEL_FULL_OFF	2
+
+//channel phase modes
+#define PCA9685_PHASE_NONE			0
+#define PCA9685_PHASE_MANUAL		1
+#define PCA9685_PHASE_AUTO			2
 
 typedef uint16_t PCA9685_WORD_t;
 
@@ -139,6 +169,84 @@ typedef struct PCA9685_channel{
 	uint32_t dutyPhase_us;
 } PCA9685_channel;
 
+//one I2C message, laid out like the kernel's struct i2c_msg
+#define PCA9685_MSG_RD 0x0001
+
+typedef struct PCA9685_msg{
+	uint16_t addr;//7-bit
+	uint16_t flags;
+	uint16_t len;
+	uint8_t* buf;
+} PCA9685_msg;
+
+//every bus transaction goes through transfer(); the messages are joined by repeated STARTs.
+//urgent() is used for emergency stops and should skip any queue, NULL falls back to transfer()
+typedef struct PCA9685_transport{
+	int (*transfer)(void* ctx, PCA9685_msg* msgs, int n_msgs);
+	void* ctx;
+	int (*urgent)(void* ctx, PCA9685_msg* msgs, int n_msgs);
+} PCA9685_transport;
+
+//per-channel calibration: normalized command (0 - 65535) -> pulse width, piecewise linear
+#define PCA9685_CAL_MAXPOINTS		16
+#define PCA9685_CAL_SEGMENTS_LOG2	6
+#define PCA9685_CAL_SEGMENTS		(1 << PCA9685_CAL_SEGMENTS_LOG2)
+
+typedef struct PCA9685_calibration{
+	uint16_t n_points;
+	uint16_t command[PCA9685_CAL_MAXPOINTS];//ascending
+	uint32_t pulse_us[PCA9685_CAL_MAXPOINTS];
+
+	//compiled for pwm_period by the driver: ticks * 16 at every 1024th command
+	uint32_t compiled_period;
+	PCA9685_WORD_t ticks_q4[PCA9685_CAL_SEGMENTS + 1];
+} PCA9685_calibration;
+
+typedef struct PCA9685_stats{
+	uint32_t frames;//flushes that put something on the bus
+	uint32_t msgs;
+	uint32_t bytes;
+	uint64_t wire_ns;//planner estimate, summed over frames
+	uint32_t updates_deferred;//updates held back by the governor
+	uint32_t updates_forced;//updates that bypassed the governor
+	uint32_t estops;
+	uint32_t estop_latency_ns;//last PCA9685_emergencyStop call, entry to STOP on the bus
+	uint32_t updates_suppressed;//channel updates dropped by the deadband
+	uint32_t suppressed[PCA9685_MAXCHAN];//the same, per channel
+	uint32_t dither_steps;
+	uint32_t dither_flips;//dithered channel ticks that changed, i.e. were sent
+	uint32_t auto_sleeps;
+	uint32_t auto_wakes;
+	uint32_t wake_latency_ns;//last auto-wake, first update to RESTART written
+	uint32_t wake_latency_max_ns;
+} PCA9685_stats;
+
+//what a board was last sent, kept up to date by every flush when config->state is set.
+//Lives in a file mapping (pwm-pca9685-state) so it outlives the process.
+typedef struct PCA9685_boardState{
+	uint32_t generation;//odd while an update is being written, 0: never written
+	int32_t i2c_bus;
+	uint8_t dev_address;
+	uint8_t mode1;//without SLEEP / RESTART
+	uint8_t mode2;
+	uint8_t prescale;
+	uint32_t pwm_period;
+	uint32_t osc_freq;
+	PCA9685_WORD_t valid;//channels whose leds are known to match the device
+	PCA9685_WORD_t tick_domain;
+	PCA9685_WORD_t full_on;
+	PCA9685_WORD_t full_off;
+	uint8_t estop;
+	uint8_t pad[3];
+	uint32_t duty_us[PCA9685_MAXCHAN];
+	uint8_t leds[PCA9685_LED_REGS];
+} PCA9685_boardState;
+
+//PCA9685_restoreState outcomes
+#define PCA9685_RESTORE_RESUMED		0 //the device matched the record, nothing was written
+#define PCA9685_RESTORE_REPAIRED	1 //registers that differed from the record were rewritten
+#define PCA9685_RESTORE_ADOPTED		2 //no usable record, the device's outputs were taken as they are
+
 typedef struct PCA9685_config{
 
 	PCA9685_channel channels[PCA9685_MAXCHAN];
@@ -153,8 +261,49 @@ typedef struct PCA9685_config{
 	char mode2_settings;
 	uint8_t prescale;
 	char int_settings;
+	PCA9685_transport* transport;//NULL: /dev/i2c-N through i2cFile
+	uint32_t bus_clock;//Hz, used by the transaction planner, 0: PCA9685_DEFAULT_BUS_CLOCK
+	uint32_t last_flush_wire_ns;//planner estimate for the last flush
+	uint8_t governor;//at most one frame per pwm_period
+	PCA9685_WORD_t pending;//channels staged but held back by the governor
+	PCA9685_WORD_t pending_flips;//dither flips among pending, sent past the deadband
+	uint64_t last_frame_ns;
+	PCA9685_stats stats;
+	PCA9685_WORD_t shadow_valid;//channels whose led_shadow matches the device
+	PCA9685_WORD_t full_on;//channels held fully on
+	PCA9685_WORD_t full_off;//channels held fully off, wins over full_on
+	PCA9685_WORD_t duty_full_on;//channels staged with duty time == period
+	uint8_t phase_mode;//PCA9685_PHASE_*
+	PCA9685_WORD_t phase_ticks[PCA9685_MAXCHAN];//on tick of each channel
+	PCA9685_WORD_t dither_channels;
+	uint64_t last_dither_ns;
+	uint32_t dither_q8[PCA9685_MAXCHAN];//target, 1/256 ticks
+	uint32_t dither_acc[PCA9685_MAXCHAN];//sigma-delta error, 1/256 ticks
+	uint32_t dither_out[PCA9685_MAXCHAN];//tick last staged by the dither
+	uint32_t idle_timeout_ms;//auto-sleep after this long with every output off, 0: never
+	uint64_t idle_since_ns;//0: some output is on
+	uint8_t auto_asleep;
+	uint8_t restart_pending;
+	uint64_t wake_started_ns;
+	PCA9685_WORD_t tick_domain;//channels last staged from ticks or commands rather than a duty time
+	uint8_t estop;//latched by PCA9685_emergencyStop: every channel full off
+	uint64_t tick_scale;//ticks per us << 32, rounded up, so duty -> ticks needs no division (see __us_ticks)
+	PCA9685_calibration* cal[PCA9685_MAXCHAN];
+	PCA9685_WORD_t deadband[PCA9685_MAXCHAN];//off tick changes up to this size are not sent
+	uint16_t deadband_refresh;//send anyway after this many suppressed updates in a row, 0: never
+	uint16_t suppressed_run[PCA9685_MAXCHAN];
+	uint8_t led_image[PCA9685_LED_REGS];//LEDn_ON_L..LEDn_OFF_H staged for the next flush
+	uint8_t led_shadow[PCA9685_LED_REGS];//last values written to the device
+	PCA9685_boardState* state;//persisted copy of the above, NULL: none
 } PCA9685_config;
 
+//one board's part of PCA9685_updateChannelTicks_batch
+typedef struct PCA9685_tickFrame{
+	PCA9685_config* config;
+	PCA9685_WORD_t channels;//in: channels to send, out: 0 once the board is done
+	const PCA9685_WORD_t* off_ticks;//indexed by channel
+} PCA9685_tickFrame;
+
 #ifdef __cplusplus
 #define DEFAULT_PARAM(x) =x
 #else
@@ -179,6 +328,18 @@ int PCA9685_config_and_open_i2c(PCA9685_config* config,
 		uint32_t osc_freq_Hz  DEFAULT_PARAM(PCA9685_DEFAULT_OSC)//Hz
 		);
 
+int PCA9685_config_prepare(PCA9685_config* config,
+		int i2cfile,
+		uint8_t dev_address,
+		uint8_t mode1_settings  DEFAULT_PARAM(PCA9685_SETTING_MODE1_DEFAULTS),
+		uint8_t mode2_settings  DEFAULT_PARAM(PCA9685_SETTING_MODE2_DEFAULTS),
+		uint32_t default_pwm_period_us  DEFAULT_PARAM(PCA9685_DEFAULT_PERIOD_FOR_INTOSC),
+		uint32_t osc_freq_Hz  DEFAULT_PARAM(PCA9685_DEFAULT_OSC)//Hz
+		);
+
+int PCA9685_config_batch(PCA9685_config** configs,
+		int n_configs);
+
 int PCA9685_close_i2c(PCA9685_config* config);
 
 int PCA9685_setAllChannelsToZero(PCA9685_config* config);
@@ -193,6 +354,69 @@ int PCA9685_updateChannels(PCA9685_WORD_t channels,
 int PCA9685_updateChannel(uint8_t channel,
 		PCA9685_config* config);
 
+int PCA9685_updateChannelTicks(PCA9685_WORD_t channels,
+		const PCA9685_WORD_t* off_ticks,
+		PCA9685_config* config);
+
+int PCA9685_updateChannelTicks_batch(PCA9685_tickFrame* frames,
+		int n_frames);
+
+int PCA9685_updateChannelsForce(PCA9685_WORD_t channels,
+		PCA9685_config* config);
+
+int PCA9685_calibrationLinear(PCA9685_calibration* cal,
+		uint32_t min_pulse_us  DEFAULT_PARAM(FUTABA_MIN_PERIOD_us),
+		uint32_t max_pulse_us  DEFAULT_PARAM(FUTABA_MAX_PERIOD_us));
+
+int PCA9685_setCalibration(uint8_t channel,
+		PCA9685_calibration* cal,
+		PCA9685_config* config);
+
+PCA9685_WORD_t PCA9685_calibrationTicks(const PCA9685_calibration* cal,
+		uint16_t command);
+
+int PCA9685_updateChannelCommands(PCA9685_WORD_t channels,
+		const uint16_t* commands,
+		PCA9685_config* config);
+
+int PCA9685_setChannelsFull(PCA9685_WORD_t channels,
+		uint8_t mode,
+		PCA9685_config* config);
+
+int PCA9685_emergencyStop(PCA9685_config** configs,
+		int n_configs,
+		uint8_t whole_bus DEFAULT_PARAM(0));//1: configs hold every board on their buses, ALLCALL may be used
+
+int PCA9685_clearEmergencyStop(PCA9685_config* config);
+
+int PCA9685_setDeadband(PCA9685_WORD_t channels,
+		PCA9685_WORD_t ticks,
+		uint16_t refresh,
+		PCA9685_config* config);
+
+int PCA9685_setPhaseMode(uint8_t mode,
+		PCA9685_WORD_t offset_ticks,
+		PCA9685_config* config);
+
+int PCA9685_allocatePhases(PCA9685_config** configs,
+		int n_configs);
+
+int PCA9685_setDither(PCA9685_WORD_t channels,
+		PCA9685_config* config);
+
+int PCA9685_setIdleSleep(uint32_t timeout_ms,
+		PCA9685_config* config);
+
+int PCA9685_setGovernor(uint8_t enable,
+		PCA9685_config* config);
+
+int PCA9685_service(PCA9685_config* config);
+
+int PCA9685_getStats(PCA9685_stats* stats,
+		PCA9685_config* config);
+
+int PCA9685_clearStats(PCA9685_config* config);
+
 int PCA9685_writeReg(uint8_t reg,
 		uint8_t val,
 		PCA9685_config* config,
@@ -202,8 +426,22 @@ int PCA9685_readReg(uint8_t reg,
 		char* buf,
 		PCA9685_config* config);
 
+int PCA9685_setBusClock(uint32_t bus_clock_Hz,
+		PCA9685_config* config);
+
+int PCA9685_setTransport(PCA9685_transport* transport,
+		PCA9685_config* config);
+
+int PCA9685_i2cdevTransfer(void* i2cfile,
+		PCA9685_msg* msgs,
+		int n_msgs);
+
 int PCA9685_wake(PCA9685_config* config);
 
+int PCA9685_wake_batch(PCA9685_config** configs,
+		int n_configs,
+		uint8_t wait DEFAULT_PARAM(1));
+
 int PCA9685_sleep(PCA9685_config* config);
 
 int PCA9685_softReset(PCA9685_config* config);
@@ -212,11 +450,16 @@ int PCA9685_enableAutoIncrement(PCA9685_config* config);
 
 int PCA9685_disableAutoIncrement(PCA9685_config* config);
 
-int PCA9685_changePWMPeriod(uint32_t newPeriod_us);
+int PCA9685_changePWMPeriod(uint32_t newPeriod_us,
+		PCA9685_config* config);
 
 int PCA9685_changeExtOSC(uint32_t new_osc_freq_hz,
 		PCA9685_config* config);
 
+int PCA9685_restoreState(PCA9685_boardState* state,
+		uint8_t* outcome,//may be NULL
+		PCA9685_config* config);
+
 ///////////////////////////////////////////////////
 
 #ifdef __cplusplus
@@ -0,0 +1,297 @@
+/*
+ * test_pwm_coro.cpp
+ *
+ *	Tests of the C++20 coroutine layer against the simulated bus, no hardware needed: awaited
+ *	calls reach the board and resume on the polling thread, stop tokens and shutdown cancel calls
+ *	that have not started without touching the bus, and buses spread over the workers.
+ *
+ *	Build and run: make test (needs g++ -std=c++20)
+ *	Usage: ./test_pwm_coro [name substring]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <stop_token>
+#include <thread>
+
+#include "pwm-pca9685-coro.hpp"
+#include "pwm-pca9685-sim.h"
+
+#define ADDRESS 0x80
+#define MODE1_AI (PCA9685_SETTING_MODE1_DEFAULTS | PCA9685_SETTING_MODE1_AUTOINCR)
+
+#define CHECK(cond) do{ \
+		if(!(cond)){ \
+			fprintf(stderr, "%s:%d: %s: CHECK(%s) failed\n", __FILE__, __LINE__, __func__, #cond); \
+			failures++; \
+		} \
+	}while(0)
+
+typedef struct coro_test{
+	const char* name;
+	void (*fn)(void);
+} coro_test;
+
+static int failures;
+
+static void __board(PCA9685_sim* sim, PCA9685_config* config);
+static PCA9685_WORD_t __off(PCA9685_sim* sim, uint8_t channel);
+static int __run(pca9685::Executor& ex, const bool& done);
+
+static pca9685::Task<void> __ramp(pca9685::Executor& ex,
+		PCA9685_config* config,
+		std::thread::id* resumed_on,
+		int* err,
+		bool* done)
+{
+	uint32_t us;
+
+	for(us=1000;us<=1100;us+=20){
+		config->channels[0].dutyTime_us = us;
+		if(*err = co_await ex.flush(config, 1 << 0))
+			break;
+	}
+
+	*resumed_on = std::this_thread::get_id();
+
+	char mode1 = 0;
+	if(!*err && !(*err = co_await ex.readReg(config, PCA9685_REG_MODE1, &mode1)))
+		*err = (mode1 & PCA9685_SETTING_MODE1_AUTOINCR) ? PCA9685_ERR_NOERR : PCA9685_ERR_I2C_READ;
+
+	*done = true;
+}
+
+static pca9685::Task<void> __await_one(pca9685::Executor& ex,
+		PCA9685_config* config,
+		std::stop_token st,
+		int* err,
+		bool* done)
+{
+	*err = co_await ex.call(config, [config]{ return PCA9685_updateChannel(1, config); }, st);
+	*done = true;
+}
+
+static pca9685::Task<void> __await_blocker(pca9685::Executor& ex,
+		PCA9685_config* config,
+		std::atomic<int>* gate,
+		bool* done)
+{
+	co_await ex.call(config, [gate]{
+		gate->store(1);
+		while(gate->load() != 2)
+			std::this_thread::yield();
+		return PCA9685_ERR_NOERR; });
+	*done = true;
+}
+
+static pca9685::Task<void> __await_thread(pca9685::Executor& ex,
+		PCA9685_config* config,
+		std::thread::id* ran_on,
+		bool* done)
+{
+	co_await ex.call(config, [ran_on]{
+		*ran_on = std::this_thread::get_id();
+		return PCA9685_ERR_NOERR; });
+	*done = true;
+}
+
+/*
+ *
+ * A ramp of awaited flushes and a register read: every value reaches the board, and the
+ * coroutine runs on the thread calling poll(), not on the worker.
+ */
+static void test_flush(void)
+{
+	PCA9685_sim sim;
+	PCA9685_config config;
+	pca9685::Executor ex(2);
+	std::thread::id resumed_on;
+	int err = -1;
+	bool done = false;
+
+	__board(&sim, &config);
+
+	pca9685::spawn(__ramp(ex, &config, &resumed_on, &err, &done));
+	CHECK(__run(ex, done) == 0);
+	CHECK(err == PCA9685_ERR_NOERR);
+	CHECK(__off(&sim, 0) == 225);
+	CHECK(resumed_on == std::this_thread::get_id());
+}
+
+/*
+ *
+ * Cancellation: a call whose token is already stopped never queues; one stopped while queued
+ * behind a running call completes as cancelled and leaves the bus alone.
+ */
+static void test_cancel(void)
+{
+	PCA9685_sim sim;
+	PCA9685_config config;
+	pca9685::Executor ex(1);
+	std::stop_source stopped, later;
+	std::atomic<int> gate(0);
+	uint32_t transfers;
+	int err = -1;
+	bool done = false, blocker_done = false;
+
+	__board(&sim, &config);
+	config.channels[1].dutyTime_us = 1500;
+
+	stopped.request_stop();
+	pca9685::spawn(__await_one(ex, &config, stopped.get_token(), &err, &done));
+	CHECK(done && err == PCA9685_ERR_CANCELLED);
+
+	//the only worker is held by the blocker, the update waits in its queue
+	pca9685::spawn(__await_blocker(ex, &config, &gate, &blocker_done));
+	while(gate.load() != 1)
+		std::this_thread::yield();
+
+	transfers = sim.n_transfers;
+	done = false;
+	err = -1;
+	pca9685::spawn(__await_one(ex, &config, later.get_token(), &err, &done));
+	later.request_stop();
+	CHECK(__run(ex, done) == 0);
+	CHECK(err == PCA9685_ERR_CANCELLED);
+
+	gate.store(2);
+	CHECK(__run(ex, blocker_done) == 0);
+	CHECK(sim.n_transfers == transfers && __off(&sim, 1) == 0);
+}
+
+/*
+ *
+ * Routing: boards set up from a descriptor (no i2c_bus) on two buses run on two workers, two
+ * boards of one bus on the same worker.
+ */
+static void test_routing(void)
+{
+	PCA9685_sim sims[2];
+	PCA9685_config configs[3];
+	pca9685::Executor ex(2);
+	std::thread::id ran_on[3];
+	bool done[3] = {false, false, false};
+	int i;
+
+	__board(&sims[0], &configs[0]);
+	__board(&sims[1], &configs[1]);
+	configs[2] = configs[0];
+	CHECK(configs[0].i2c_bus == 0 && configs[1].i2c_bus == 0);
+
+	for(i=0;i<3;++i){
+		pca9685::spawn(__await_thread(ex, &configs[i], &ran_on[i], &done[i]));
+		CHECK(__run(ex, done[i]) == 0);
+	}
+	CHECK(ran_on[0] != ran_on[1]);
+	CHECK(ran_on[0] == ran_on[2]);
+}
+
+/*
+ *
+ * Shutdown: the running call finishes, the one queued behind it completes as cancelled without
+ * touching the bus, and both coroutines are resumed by the destructor.
+ */
+static void test_shutdown(void)
+{
+	PCA9685_sim sim;
+	PCA9685_config config;
+	std::atomic<int> gate(0);
+	std::optional<pca9685::Executor> ex;
+	std::thread release;
+	uint32_t transfers;
+	int err = -1;
+	bool done = false, blocker_done = false;
+
+	__board(&sim, &config);
+	config.channels[1].dutyTime_us = 1500;
+	ex.emplace(1);
+
+	pca9685::spawn(__await_blocker(*ex, &config, &gate, &blocker_done));
+	while(gate.load() != 1)
+		std::this_thread::yield();
+	pca9685::spawn(__await_one(*ex, &config, {}, &err, &done));
+
+	//the blocker is let go only once the destructor is already waiting for it
+	transfers = sim.n_transfers;
+	release = std::thread([&gate]{
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		gate.store(2); });
+	ex.reset();
+	release.join();
+
+	CHECK(blocker_done && done && err == PCA9685_ERR_CANCELLED);
+	CHECK(sim.n_transfers == transfers && __off(&sim, 1) == 0);
+}
+
+static const coro_test tests[] = {
+	{"flush", test_flush},
+	{"cancel", test_cancel},
+	{"routing", test_routing},
+	{"shutdown", test_shutdown},
+};
+
+int main(int argc, char** argv)
+{
+	size_t i;
+	int before, ran = 0;
+
+	for(i=0;i<sizeof(tests)/sizeof(tests[0]);++i){
+		if(argc > 1 && !strstr(tests[i].name, argv[1]))
+			continue;
+
+		before = failures;
+		tests[i].fn();
+		printf("%-32s %s\n", tests[i].name, failures == before ? "ok" : "FAIL");
+		++ran;
+	}
+
+	printf("%d tests, %d failed checks\n", ran, failures);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//one awake board at ADDRESS on a fresh simulated bus
+static void __board(PCA9685_sim* sim,
+		PCA9685_config* config)
+{
+	PCA9685_simInit(sim);
+	PCA9685_simAddDevice(sim, ADDRESS);
+
+	memset(config, 0, sizeof(*config));
+	PCA9685_setTransport(&sim->transport, config);
+
+	if(PCA9685_config_only(config, 0, ADDRESS, MODE1_AI, PCA9685_SETTING_MODE2_DEFAULTS, 20000, PCA9685_DEFAULT_OSC) ||
+			PCA9685_wake(config)){
+		fprintf(stderr, "board setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static PCA9685_WORD_t __off(PCA9685_sim* sim,
+		uint8_t channel)
+{
+	uint8_t* r = &sim->devs[0].regs[PCA9685_REG_LEDX_ON_L + 4*channel];
+
+	return (PCA9685_WORD_t)(((r[3] & 0x1F) << 8) | r[2]);
+}
+
+//the event loop: polls the executor's eventfd until done is set, -1 after 5s without progress
+static int __run(pca9685::Executor& ex,
+		const bool& done)
+{
+	struct pollfd pfd = {ex.fd(), POLLIN, 0};
+
+	while(!done){
+		if(poll(&pfd, 1, 5000) <= 0)
+			return -1;
+		ex.poll();
+	}
+
+	return 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * test_pwm_emu.c
+ *
+ *	Driver tests against the waveform emulator, no hardware needed. Each test checks the output
+ *	edges the driver's register writes produce: pulse widths, the PWM period, and glitches or
+ *	dropped values around updates.
+ *
+ *	Build and run: make test
+ *	Usage: ./test_pwm_emu [name substring]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pwm-pca9685-user.h"
+#include "pwm-pca9685-emu.h"
+
+#define ADDRESS 0x80
+#define MODE1_AI (PCA9685_SETTING_MODE1_DEFAULTS | PCA9685_SETTING_MODE1_AUTOINCR)
+#define BUS_CLOCK 400000
+
+#define CHECK(cond) do{ \
+		if(!(cond)){ \
+			fprintf(stderr, "%s:%d: %s: CHECK(%s) failed\n", __FILE__, __LINE__, __func__, #cond); \
+			failures++; \
+		} \
+	}while(0)
+
+typedef struct emu_test{
+	const char* name;
+	void (*fn)(void);
+} emu_test;
+
+typedef struct edge_log{
+	uint64_t rise_ns[2];//last two rising edges of channel 0
+} edge_log;
+
+static int failures;
+
+static void __board(PCA9685_emu* emu, PCA9685_config* config, uint32_t period_us);
+static int __near(uint64_t ns, uint64_t expected_ns, uint64_t tol_ns);
+static void __log_edge(void* ctx, int dev, int channel, uint64_t t_ns, int level);
+
+/*
+ *
+ * A duty time comes out as a pulse of that width, once per requested period.
+ */
+static void test_pulse_width(void)
+{
+	static const uint32_t periods[] = {20000, 14000, 5000};
+	PCA9685_emu emu;
+	PCA9685_config config;
+	PCA9685_emuChannel* c;
+	edge_log log;
+	uint64_t period_ns;
+	size_t i;
+
+	for(i=0;i<sizeof(periods)/sizeof(periods[0]);++i){
+		__board(&emu, &config, periods[i]);
+		memset(&log, 0, sizeof(log));
+		emu.on_edge = __log_edge;
+		emu.edge_ctx = &log;
+
+		config.channels[0].dutyTime_us = 1500;
+		CHECK(PCA9685_updateChannel(0, &config) == PCA9685_ERR_NOERR);
+		PCA9685_emuAdvance(&emu, 5ull * periods[i] * 1000);
+
+		c = PCA9685_emuChannelOf(&emu, ADDRESS, 0);
+		CHECK(c->pulses >= 3 && c->glitches == 0 && c->dropped == 0);
+
+		//the period the driver asked for, within one prescale step
+		period_ns = log.rise_ns[1] - log.rise_ns[0];
+		CHECK(__near(period_ns, periods[i] * 1000ull, periods[i] * 1000ull / (config.prescale + 1)));
+		//the duty time as a fraction of the requested period, to one tick
+		CHECK(__near(c->last_width_ns, 1500000 * period_ns / (periods[i] * 1000ull), period_ns / 4096 + 1));
+	}
+}
+
+/*
+ *
+ * Updates latched per cycle: a stream of changes mid-cycle never produces a pulse of a width
+ * that was not commanded.
+ */
+static void test_update_stream(void)
+{
+	PCA9685_emu emu;
+	PCA9685_config config;
+	PCA9685_emuChannel* c;
+	int i;
+
+	__board(&emu, &config, 20000);
+
+	for(i=0;i<50;++i){
+		config.channels[0].dutyTime_us = 1000 + 20 * i;
+		CHECK(PCA9685_updateChannel(0, &config) == PCA9685_ERR_NOERR);
+		PCA9685_emuAdvance(&emu, 7300000);
+	}
+
+	c = PCA9685_emuChannelOf(&emu, ADDRESS, 0);
+	CHECK(c->pulses > 10 && c->glitches == 0);
+}
+
+/*
+ *
+ * Several writes within one cycle: only the last one runs, the rest count as dropped. The
+ * governor holds them back to one frame per period instead.
+ */
+static void test_dropped(void)
+{
+	PCA9685_emu emu;
+	PCA9685_config config;
+	PCA9685_emuChannel* c;
+	int i;
+
+	__board(&emu, &config, 20000);
+	for(i=0;i<4;++i){
+		config.channels[0].dutyTime_us = 1000 + 100 * i;
+		CHECK(PCA9685_updateChannel(0, &config) == PCA9685_ERR_NOERR);
+	}
+	PCA9685_emuAdvance(&emu, 40000000);
+
+	c = PCA9685_emuChannelOf(&emu, ADDRESS, 0);
+	CHECK(c->dropped == 3);
+	CHECK(__near(c->last_width_ns, 1300000, 20000000 / 4096 + 1));
+}
+
+/*
+ *
+ * Full on / full off and sleep drive the output level directly.
+ */
+static void test_full_and_sleep(void)
+{
+	PCA9685_emu emu;
+	PCA9685_config config;
+	PCA9685_emuChannel* c;
+
+	__board(&emu, &config, 20000);
+	c = PCA9685_emuChannelOf(&emu, ADDRESS, 2);
+
+	config.channels[2].dutyTime_us = 20000;
+	CHECK(PCA9685_updateChannel(2, &config) == PCA9685_ERR_NOERR);
+	PCA9685_emuAdvance(&emu, 40000000);
+	CHECK(c->level == 1);
+
+	CHECK(PCA9685_sleep(&config) == PCA9685_ERR_NOERR);
+	CHECK(c->level == 0);
+}
+
+static const emu_test tests[] = {
+	{"pulse_width", test_pulse_width},
+	{"update_stream", test_update_stream},
+	{"dropped", test_dropped},
+	{"full_and_sleep", test_full_and_sleep},
+};
+
+int main(int argc, char** argv)
+{
+	size_t i;
+	int before, ran = 0;
+
+	for(i=0;i<sizeof(tests)/sizeof(tests[0]);++i){
+		if(argc > 1 && !strstr(tests[i].name, argv[1]))
+			continue;
+
+		before = failures;
+		tests[i].fn();
+		printf("%-32s %s\n", tests[i].name, failures == before ? "ok" : "FAIL");
+		++ran;
+	}
+
+	printf("%d tests, %d failed checks\n", ran, failures);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//one awake board at ADDRESS on a fresh emulator
+static void __board(PCA9685_emu* emu,
+		PCA9685_config* config,
+		uint32_t period_us)
+{
+	PCA9685_emuInit(emu, PCA9685_DEFAULT_OSC, BUS_CLOCK);
+	PCA9685_emuAddDevice(emu, ADDRESS);
+
+	memset(config, 0, sizeof(*config));
+	PCA9685_setTransport(&emu->transport, config);
+
+	if(PCA9685_config_only(config, 0, ADDRESS, MODE1_AI, PCA9685_SETTING_MODE2_DEFAULTS, period_us, PCA9685_DEFAULT_OSC) ||
+			PCA9685_wake(config)){
+		fprintf(stderr, "board setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	//past the oscillator start-up and the cycle that latches the wake's writes
+	PCA9685_emuAdvance(emu, PCA9685_EMU_OSC_STARTUP_ns + period_us * 1000ull);
+}
+
+static int __near(uint64_t ns,
+		uint64_t expected_ns,
+		uint64_t tol_ns)
+{
+	return ns + tol_ns >= expected_ns && ns <= expected_ns + tol_ns;
+}
+
+static void __log_edge(void* ctx,
+		int dev,
+		int channel,
+		uint64_t t_ns,
+		int level)
+{
+	edge_log* log = (edge_log*)ctx;
+
+	(void)dev;
+	if(channel || !level)
+		return;
+
+	log->rise_ns[0] = log->rise_ns[1];
+	log->rise_ns[1] = t_ns;
+}
@@ -0,0 +1,1459 @@
+/*
+ * test_pwm_sim.c
+ *
+ *	Driver tests against the simulated bus, no hardware needed. Each test checks what reaches the
+ *	register files (and how many transfers / messages / bytes it took), not the driver's own state.
+ *
+ *	Build and run: make test
+ *	Usage: ./test_pwm_sim [name substring]
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <linux/i2c-dev.h>
+#include "pwm-pca9685-user.h"
+#include "pwm-pca9685-sim.h"
+#include "pwm-pca9685-trace.h"
+#include "pwm-pca9685-shm.h"
+#include "pwm-pca9685-fleet.h"
+#include "pwm-pca9685-bus.h"
+#include "pwm-pca9685-map.h"
+#include "pwm-pca9685-state.h"
+
+#define ADDRESS 0x80
+#define MODE1_AI (PCA9685_SETTING_MODE1_DEFAULTS | PCA9685_SETTING_MODE1_AUTOINCR)
+#define LED_FULL (1<<4)
+#define MODE1_SLEEP (1<<4)
+
+#define CHECK(cond) do{ \
+		if(!(cond)){ \
+			fprintf(stderr, "%s:%d: %s: CHECK(%s) failed\n", __FILE__, __LINE__, __func__, #cond); \
+			failures++; \
+		} \
+	}while(0)
+
+typedef struct sim_test{
+	const char* name;
+	void (*fn)(void);
+} sim_test;
+
+//the simulated bus, failing one chosen transfer
+typedef struct fail_bus{
+	PCA9685_transport transport;
+	PCA9685_sim* sim;
+	int fail_after;//transfers let through before the failing one, -1: none
+	int max_msgs;//largest transfer seen
+} fail_bus;
+
+//the simulated bus, with another writer finishing an update of a state record during each read
+typedef struct record_bus{
+	PCA9685_transport transport;
+	PCA9685_sim* sim;
+	PCA9685_boardState* rec;
+	int rewrites;//reads that see a rewrite, -1: all of them
+} record_bus;
+
+typedef struct bus_waiter{
+	PCA9685_bus* bus;
+	int prio;
+	int* order;
+	int* n_order;
+} bus_waiter;
+
+static int failures;
+
+static void __board(PCA9685_sim* sim, PCA9685_config* config, uint8_t mode1, uint32_t period_us);
+static PCA9685_WORD_t __off(PCA9685_sim* sim, uint8_t channel);
+static PCA9685_WORD_t __on(PCA9685_sim* sim, uint8_t channel);
+static PCA9685_WORD_t __dev_off(PCA9685_sim* sim, uint8_t dev_address, uint8_t channel);
+static void __mark(PCA9685_sim* sim, uint32_t* transfers, uint32_t* msgs, uint32_t* bytes);
+static const char* __tmp_path(const char* name);
+static void __corrupt_record(const char* trace_path, int index);
+static uint32_t __dead_pid(void);
+static void* __bus_wait(void* arg);
+static void __fail_init(fail_bus* f, PCA9685_sim* sim, int fail_after);
+static int __fail_transfer(void* ctx, PCA9685_msg* msgs, int n_msgs);
+static void __bus_queued(PCA9685_bus* bus, int prio, uint32_t n);
+static void __record_init(record_bus* r, PCA9685_sim* sim, PCA9685_boardState* rec, int rewrites);
+static int __record_transfer(void* ctx, PCA9685_msg* msgs, int n_msgs);
+
+/*
+ *
+ * Planner: what a flush puts on the bus.
+ */
+static void test_planner_full_burst(void)
+{
+	PCA9685_sim sim;
+	PCA9685_config config;
+	PCA9685_WORD_t ticks[PCA9685_MAXCHAN];
+	uint32_t t, m, b;
+	int i;
+
+	__board(&sim, &config, MODE1_AI, 20000);
+	for(i=0;i<PCA9685_MAXCHAN;++i)
+		ticks[i] = (PCA9685_WORD_t)(0x101 + i);
+
+	__mark(&sim, &t, &m, &b);
+	CHECK(PCA9685_updateChannelTicks(0xFFFF, ticks, &config) == PCA9685_ERR_NOERR);
+	__mark(&sim, &t, &m, &b);
+
+	//the wake wrote zeros; every OFF pair changed and the clean ON pairs between them are bridged:
+	//one burst from LED0_OFF_L to LED15_OFF_H
+	CHECK(t == 1 && m == 1 && b == 1 + PCA9685_LED_REGS - 2);
+	for(i=0;i<PCA9685_MAXCHAN;++i){
+		CHECK(__on(&sim, i) == 0);
+		CHECK(__off(&sim, i) == 0x101 + i);
+	}
+
+	//nothing changed, nothing sent
+	CHECK(PCA9685_updateChannelTicks(0xFFFF, ticks, &config) == PCA9685_ERR_NOERR);
+	__mark(&sim, &t, &m, &b);
+	CHECK(t == 0);
+}
+
+static void test_planner_sparse(void)
+{
+	PCA9685_sim sim;
+	PCA9685_config config;
+	PCA9685_WORD_t ticks[PCA9685_MAXCHAN] = {0};
+	uint32_t t, m, b;
+
+	__board(&sim, &config, MODE1_AI, 20000);
+	CHECK(PCA9685_updateChannelTicks(0xFFFF, ticks, &config) == PCA9685_ERR_NOERR);
+
+	//one channel: only its OFF_L / OFF_H
+	ticks[3] = 0x123;
+	__mark(&sim, &t, &m, &b);
+	CHECK(PCA9685_updateChannelTicks(0xFFFF, ticks, &config) == PCA9685_ERR_NOERR);
+	__mark(&sim, &t, &m, &b);
+	CHECK(t == 1 && m == 1 && b == 3);
+	CHECK(__off(&sim, 3) == 0x123);
+
+	//neighbours: the two clean ON registers in between are cheaper to rewrite than a new message
+	ticks[0] = 0x10A;
+	ticks[1] = 0x10B;
+	__mark(&sim, &t, &m, &b);
+	CHECK(PCA9685_updateChannelTicks(0x0003, ticks, &config) == PCA9685_ERR_NOERR);
+	__mark(&sim, &t, &m, &b);
+	CHECK(t == 1 && m == 1 && b == 1 + 6);
+
+	//further apart: two messages, still one transfer
+	ticks[0] = 0x214;
+	ticks[2] = 0x216;
+	__mark(&sim, &t, &m, &b);
+	CHECK(PCA9685_updateChannelTicks(0x0005, ticks, &config) == PCA9685_ERR_NOERR);
+	__mark(&sim, &t, &m, &b);
+	CHECK(t == 1 && m == 2 && b == 2 * 3);
+	CHECK(__off(&sim, 0) == 0x214 && __off(&sim, 1) == 0x10B && __off(&sim, 2) == 0x216 && __off(&sim, 3) == 0x123);
+
+	//a lone OFF_L: 2 bytes
+	ticks[3] = 0x124;
+	__mark(&sim, &t, &m, &b);
+	CHECK(PCA9685_updateChannelTicks(0xFFFF, ticks, &config) == PCA9685_ERR_NOERR);
+	__mark(&sim, &t, &m, &b);
+	CHECK(t == 1 && m == 1 && b == 2);
+
+	//a config filled in by hand has no bus clock: the wire estimate uses the default one
+	memset(&config, 0, sizeof(config));
+	PCA9685_setTransport(&sim.transport, &config);
+	config.dev_i2c_address = ADDRESS;
+	config.mode1_settings = MODE1_AI;
+	ticks[3] = 0x125;
+	CHECK(PCA9685_updateChannelTicks(1 << 3, ticks, &config) == PCA9685_ERR_NOERR);
+	CHECK(__off(&sim, 3) == 0x125 && config.last_flush_wire_ns > 0);
+}
+
+static void test_planner_no_autoincrement(void)
+{
+	PCA9685_sim sim;
+	PCA9685_config config;
+	PCA9685_WORD_t ticks[PCA9685_MAXCHAN] = {0};
+	uint32_t t, m, b;
+
+	__board(&sim, &config, PCA9685_SETTING_MODE1_DEFAULTS, 20000);
+	CHECK(PCA9685_updateChannelTicks(0xFFFF, ticks, &config) == PCA9685_ERR_NOERR);
+
+	ticks[0] = 10;
+	ticks[1] = 0x211;
+	__mark(&sim, &t, &m, &b);
+	CHECK(PCA9685_updateChannelTicks(0x0003, ticks, &config) == PCA9685_ERR_NOERR);
+	__mark(&sim, &t, &m, &b);
+
+	//ch0 OFF_L, ch1 OFF_L, ch1 OFF_H: a 2-byte message each
+	CHECK(t == 1 && m == 3 && b == 3 * 2);
+	CHECK(__off(&sim, 0) == 10 && __off(&sim, 1) == 0x211);
+}
+
+static void test_planner_duty(void)
+{
+	PCA9685_sim sim;
+	PCA9685_config config;
+
+	__board(&sim, &config, MODE1_AI, 20000);
+
+	//1500 us of 20000: 307.2 ticks
+	config.channels[0].dutyTime_us = 1500;
+	config.channels[1].dutyTime_us = 20000;
+	CHECK(PCA9685_updateChannelRange(0, 1, &config) == PCA9685_ERR_NOERR);
+	CHECK(__off(&sim, 0) == 307);
+	CHECK(sim.devs[0].regs[PCA9685_REG_LEDX_ON_H + 4] & LED_FULL);
+
+	config.channels[2].dutyTime_us = 20001;
+	CHECK(PCA9685_updateChannel(2, &config) == PCA9685_ERR_DUTY_OVERFLOW);
+
+	//a 500 ms period (slow external clock): 303833 us is 2488.99 ticks, not 2489
+	memset(&config, 0, sizeof(config));
+	PCA9685_setTransport(&sim.transport, &config);
+	CHECK(PCA9685_config_only(&config, 0, ADDRESS, MODE1_AI | PCA9685_SETTING_MODE1_EXTCLK, PCA9685_SETTING_MODE2_DEFAULTS, 500000, 1000000) == PCA9685_ERR_NOERR);
+	config.channels[3].dutyTime_us = 303833;
+	CHECK(PCA9685_updateChannel(3, &config) == PCA9685_ERR_NOERR);
+	CHECK(__off(&sim, 3) == 2488);
+}
+
+/*
+ *
+ * Trace: a recorded session replays to the same registers, and damaged traces are refused.
+ */
+static void test_trace_replay(void)
+{
+	PCA9685_sim sim, replay;
+	PCA9685_config config;
+	PCA9685_trace* trace;
+	PCA9685_traceRecord rec;
+	PCA9685_WORD_t ticks[PCA9685_MAXCHAN] = {0};
+	const char* path = __tmp_path("trace");
+	int i;
+
+	CHECK(PCA9685_traceOpen(&trace, path, 256) == PCA9685_ERR_NOERR);
+
+	PCA9685_simInit(&sim);
+	PCA9685_simAddDevice(&sim, ADDRESS);
+	memset(&config, 0, sizeof(config));
+	PCA9685_setTransport(&sim.transport, &config);
+	CHECK(PCA9685_traceAttach(trace, &config) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_config_only(&config, 0, ADDRESS, MODE1_AI, PCA9685_SETTING_MODE2_DEFAULTS, 20000, PCA9685_DEFAULT_OSC) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_wake(&config) == PCA9685_ERR_NOERR);
+
+	for(i=0;i<PCA9685_MAXCHAN;++i)
+		ticks[i] = (PCA9685_WORD_t)(0x101 * (i % 15 + 1));
+	CHECK(PCA9685_updateChannelTicks(0xFFFF, ticks, &config) == PCA9685_ERR_NOERR);
+
+	//two messages in one transfer
+	ticks[0] = 0x0AB;
+	ticks[2] = 0x0CD;
+	CHECK(PCA9685_updateChannelTicks(0x0005, ticks, &config) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_traceDetach(&config) == PCA9685_ERR_NOERR);
+
+	PCA9685_simInit(&replay);
+	PCA9685_simAddDevice(&replay, ADDRESS);
+	CHECK(PCA9685_traceReplay(trace, &replay.transport, 0) == PCA9685_ERR_NOERR);
+	CHECK(memcmp(replay.devs[0].regs, sim.devs[0].regs, PCA9685_SIM_NUMREGS) == 0);
+
+	//lose the last message of the last transfer: the first alone must not be replayed
+	CHECK(PCA9685_traceGet(trace, PCA9685_traceEnd(trace) - 1, &rec) == PCA9685_ERR_NOERR);
+	CHECK(rec.msg_index == 1 && (rec.flags & PCA9685_TRACE_LAST));
+	CHECK(PCA9685_traceClose(trace) == PCA9685_ERR_NOERR);
+	__corrupt_record(path, (int)(rec.seq - 1));
+
+	CHECK(PCA9685_traceOpen(&trace, path, 0) == PCA9685_ERR_NOERR);
+	PCA9685_simInit(&replay);
+	PCA9685_simAddDevice(&replay, ADDRESS);
+	CHECK(PCA9685_traceReplay(trace, &replay.transport, 0) == PCA9685_ERR_NOERR);
+	CHECK(__off(&replay, 0) == 0x101 && __off(&replay, 2) == 0x303);
+	CHECK(PCA9685_traceClose(trace) == PCA9685_ERR_NOERR);
+
+	unlink(path);
+}
+
+static void test_trace_damaged(void)
+{
+	PCA9685_trace* trace;
+	const char* path = __tmp_path("trace");
+	uint64_t capacity = 1u << 20;
+	int fd;
+
+	CHECK(PCA9685_traceOpen(&trace, path, 64) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_traceClose(trace) == PCA9685_ERR_NOERR);
+
+	//a header claiming more records than the file holds
+	fd = open(path, O_RDWR);
+	CHECK(pwrite(fd, &capacity, sizeof(capacity), 16) == sizeof(capacity));
+	close(fd);
+	CHECK(PCA9685_traceOpen(&trace, path, 0) == PCA9685_ERR_TRACE);
+
+	//not a power of 2
+	capacity = 48;
+	fd = open(path, O_RDWR);
+	CHECK(pwrite(fd, &capacity, sizeof(capacity), 16) == sizeof(capacity));
+	close(fd);
+	CHECK(PCA9685_traceOpen(&trace, path, 0) == PCA9685_ERR_TRACE);
+
+	//truncated
+	capacity = 64;
+	fd = open(path, O_RDWR);
+	CHECK(pwrite(fd, &capacity, sizeof(capacity), 16) == sizeof(capacity));
+	CHECK(ftruncate(fd, 64 + 10 * sizeof(PCA9685_traceRecord)) == 0);
+	close(fd);
+	CHECK(PCA9685_traceOpen(&trace, path, 0) == PCA9685_ERR_TRACE);
+
+	unlink(path);
+}
+
+/*
+ *
+ * Governor: at most one frame per PWM period, the held back updates merged into the next one.
+ */
+static void test_governor(void)
+{
+	PCA9685_sim sim;
+	PCA9685_config config;
+	PCA9685_stats stats;
+	uint32_t t, m, b;
+
+	__board(&sim, &config, MODE1_AI, 20000);
+	CHECK(PCA9685_setGovernor(1, &config) == PCA9685_ERR_NOERR);
+
+	config.channels[0].dutyTime_us = 1000;
+	__mark(&sim, &t, &m, &b);
+	CHECK(PCA9685_updateChannel(0, &config) == PCA9685_ERR_NOERR);
+	__mark(&sim, &t, &m, &b);
+	CHECK(t == 1);
+
+	//within the period: held back, latest value wins
+	config.channels[0].dutyTime_us = 1100;
+	CHECK(PCA9685_updateChannel(0, &config) == PCA9685_ERR_NOERR);
+	config.channels[0].dutyTime_us = 1200;
+	CHECK(PCA9685_updateChannel(0, &config) == PCA9685_ERR_NOERR);
+	config.channels[5].dutyTime_us = 1500;
+	CHECK(PCA9685_updateChannel(5, &config) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_service(&config) == PCA9685_ERR_NOERR);
+	__mark(&sim, &t, &m, &b);
+	CHECK(t == 0);
+	CHECK(__off(&sim, 0) == 204);
+
+	usleep(20000);
+	CHECK(PCA9685_service(&config) == PCA9685_ERR_NOERR);
+	__mark(&sim, &t, &m, &b);
+	CHECK(t == 1);
+	CHECK(__off(&sim, 0) == 245 && __off(&sim, 5) == 307);
+
+	//forced updates go out at once
+	config.channels[1].dutyTime_us = 1000;
+	CHECK(PCA9685_updateChannelsForce(1 << 1, &config) == PCA9685_ERR_NOERR);
+	__mark(&sim, &t, &m, &b);
+	CHECK(t == 1 && __off(&sim, 1) == 204);
+
+	CHECK(PCA9685_getStats(&stats, &config) == PCA9685_ERR_NOERR);
+	CHECK(stats.updates_deferred == 3 && stats.updates_forced >= 1);
+
+	//turning it off sends what is pending
+	config.channels[2].dutyTime_us = 1000;
+	CHECK(PCA9685_updateChannel(2, &config) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_setGovernor(0, &config) == PCA9685_ERR_NOERR);
+	CHECK(__off(&sim, 2) == 204);
+}
+
+/*
+ *
+ * Shared memory: client writes reach the daemon's config, sleeping daemons are rung once, dead
+ * writers don't stall the daemon and a restarted daemon keeps the clients' segment.
+ */
+static void test_shm(void)
+{
+	char name[64];
+	PCA9685_shm *daemon, *client, *again;
+	PCA9685_config config;
+	PCA9685_shmBoard* slot;
+	uint32_t bell;
+	int board;
+
+	snprintf(name, sizeof(name), "/test_pwm_sim.%d", (int)getpid());
+	memset(&config, 0, sizeof(config));
+
+	CHECK(PCA9685_shmCreate(&daemon, name) == PCA9685_ERR_NOERR);
+	CHECK((board = PCA9685_shmAddBoard(daemon, 1, ADDRESS)) == 0);
+	CHECK(PCA9685_shmOpen(&client, name) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_shmFindBoard(client, 1, ADDRESS) == board);
+	slot = &daemon->boards[board];
+
+	CHECK(PCA9685_shmSetChannel(client, board, 3, 1500) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_shmCollect(daemon, board, &config) == (1 << 3));
+	CHECK(config.channels[3].dutyTime_us == 1500);
+	CHECK(PCA9685_shmCollect(daemon, board, &config) == 0);
+
+	//daemon awake: no ring. Asleep: only the first update rings
+	bell = daemon->doorbell;
+	CHECK(PCA9685_shmSetChannel(client, board, 3, 1600) == PCA9685_ERR_NOERR);
+	CHECK(daemon->doorbell == bell);
+	daemon->daemon_waiting = 1;
+	CHECK(PCA9685_shmSetChannel(client, board, 3, 1700) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_shmSetChannel(client, board, 4, 1700) == PCA9685_ERR_NOERR);
+	CHECK(daemon->doorbell == bell + 1 && !daemon->daemon_waiting);
+
+	//work pending: no wait. Then one polling period before going back to sleep on the doorbell
+	CHECK(PCA9685_shmWait(daemon, 1000) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_shmCollect(daemon, board, &config) == ((1 << 3) | (1 << 4)));
+	CHECK(config.channels[3].dutyTime_us == 1700);
+	CHECK(PCA9685_shmWait(daemon, 1000) == PCA9685_ERR_NOERR);
+	CHECK(!daemon->daemon_polling);
+
+	//a writer that died holding the slot mid-write: taken back by the collect
+	CHECK(PCA9685_shmSetChannel(client, board, 5, 1800) == PCA9685_ERR_NOERR);
+	slot->seq |= 1;
+	slot->lock = __dead_pid();
+	CHECK(PCA9685_shmCollect(daemon, board, &config) == (1 << 5));
+	CHECK(config.channels[5].dutyTime_us == 1800);
+	CHECK(!(slot->seq & 1) && slot->lock == 0 && daemon->reclaimed == 1);
+
+	//died right after taking the lock, nothing dirty yet: the next wait frees it
+	slot->lock = __dead_pid();
+	CHECK(PCA9685_shmWait(daemon, 1000) == PCA9685_ERR_NOERR);
+	CHECK(slot->lock == 0 && !(slot->seq & 1) && daemon->reclaimed == 2);
+
+	//died mid-write, nothing dirty: the next writer takes the slot over
+	slot->seq |= 1;
+	slot->lock = __dead_pid();
+	CHECK(PCA9685_shmSetChannel(client, board, 5, 1850) == PCA9685_ERR_NOERR);
+	CHECK(slot->lock == 0 && !(slot->seq & 1) && daemon->reclaimed == 3);
+	CHECK(PCA9685_shmCollect(daemon, board, &config) == (1 << 5));
+	CHECK(config.channels[5].dutyTime_us == 1850);
+
+	//a live writer that has just taken the lock, seqlock still even: never broken, other writers give up
+	slot->lock = (uint32_t)getppid();
+	CHECK(PCA9685_shmWait(daemon, 1000) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_shmSetChannel(client, board, 6, 1900) == PCA9685_ERR_BUS_LOCK);
+	CHECK(slot->lock == (uint32_t)getppid() && daemon->reclaimed == 3);
+
+	//the same writer between its dirty store and the seqlock release: skipped, collected once it is done
+	slot->seq |= 1;
+	slot->dirty |= 1 << 6;
+	slot->dutyTime_us[6] = 1900;
+	CHECK(PCA9685_shmCollect(daemon, board, &config) == 0);
+	CHECK(slot->lock == (uint32_t)getppid() && (slot->seq & 1) && daemon->reclaimed == 3);
+	slot->seq += 1;
+	slot->lock = 0;
+	CHECK(PCA9685_shmCollect(daemon, board, &config) == (1 << 6));
+	CHECK(config.channels[6].dutyTime_us == 1900);
+
+	//the creating daemon is alive: refused
+	daemon->daemon_pid = (uint32_t)getppid();
+	CHECK(PCA9685_shmCreate(&again, name) == PCA9685_ERR_NO_FILE);
+
+	//it died: reattached, the client's mapping and pending writes survive
+	daemon->daemon_pid = __dead_pid();
+	CHECK(PCA9685_shmSetChannel(client, board, 7, 2000) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_shmCreate(&again, name) == PCA9685_ERR_NOERR);
+	CHECK(again->n_boards == 0 && again->daemon_pid == (uint32_t)getpid());
+	CHECK(PCA9685_shmAddBoard(again, 1, ADDRESS) == board);
+	CHECK(PCA9685_shmCollect(again, board, &config) == (1 << 7));
+	CHECK(config.channels[7].dutyTime_us == 2000);
+	CHECK(PCA9685_shmSetChannel(client, board, 8, 2100) == PCA9685_ERR_NOERR);
+	CHECK(again->boards[board].dirty == (1 << 8));
+
+	PCA9685_shmClose(client);
+	PCA9685_shmClose(daemon);
+	PCA9685_shmDestroy(again, name);
+}
+
+/*
+ *
+ * Fleet: boards grouped by bus in the arena, each flush reaching the right device.
+ */
+static void test_fleet(void)
+{
+	static const PCA9685_boardDesc descs[] = {
+		{1, 0x80, MODE1_AI, PCA9685_SETTING_MODE2_DEFAULTS, 20000, PCA9685_DEFAULT_OSC},
+		{2, 0x80, MODE1_AI, PCA9685_SETTING_MODE2_DEFAULTS, 20000, PCA9685_DEFAULT_OSC},
+		{1, 0x82, MODE1_AI, PCA9685_SETTING_MODE2_DEFAULTS, 20000, PCA9685_DEFAULT_OSC},
+	};
+	PCA9685_sim sims[2];
+	PCA9685_fleet fleet;
+	uint32_t t, m, b;
+	int i;
+
+	for(i=0;i<2;++i){
+		PCA9685_simInit(&sims[i]);
+		PCA9685_simAddDevice(&sims[i], 0x80);
+		PCA9685_simAddDevice(&sims[i], 0x82);
+	}
+
+	CHECK(PCA9685_fleetCreate(&fleet, descs, 3) == PCA9685_ERR_NOERR);
+	CHECK(fleet.n_buses == 2);
+	CHECK(fleet.slot[0] == 0 && fleet.slot[2] == 1 && fleet.slot[1] == 2);
+	CHECK(fleet.buses[0].first_board == 0 && fleet.buses[0].n_boards == 2);
+	CHECK((uintptr_t)fleet.ticks % 64 == 0 && (uintptr_t)fleet.configs % 64 == 0);
+
+	CHECK(PCA9685_fleetSetBusTransport(&fleet, 1, &sims[0].transport) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_fleetSetBusTransport(&fleet, 2, &sims[1].transport) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_fleetSetBusTransport(&fleet, 3, &sims[1].transport) == PCA9685_ERR_BOUNDS);
+	CHECK(PCA9685_fleetConfig(&fleet) == PCA9685_ERR_NOERR);
+	for(i=0;i<3;++i)
+		CHECK(PCA9685_wake(PCA9685_fleetConfigOf(&fleet, i)) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_fleetConfigOf(&fleet, 3) == NULL);
+
+	PCA9685_fleetSetTicks(&fleet, 0, 0, 100);
+	PCA9685_fleetSetTicks(&fleet, 1, 1, 200);
+	PCA9685_fleetSetTicks(&fleet, 2, 2, 300);
+	__mark(&sims[1], &t, &m, &b);
+	CHECK(PCA9685_fleetFlush(&fleet) == PCA9685_ERR_NOERR);
+	CHECK(__dev_off(&sims[0], 0x80, 0) == 100);
+	CHECK(__dev_off(&sims[1], 0x80, 1) == 200);
+	CHECK(__dev_off(&sims[0], 0x82, 2) == 300);
+	CHECK(__dev_off(&sims[1], 0x82, 1) == LED_FULL << 8);//not in the fleet, still at power-on
+	for(i=0;i<3;++i)
+		CHECK(fleet.dirty[i] == 0);
+
+	//clean boards send nothing
+	__mark(&sims[1], &t, &m, &b);
+	PCA9685_fleetSetTicks(&fleet, 0, 0, 101);
+	CHECK(PCA9685_fleetFlush(&fleet) == PCA9685_ERR_NOERR);
+	__mark(&sims[1], &t, &m, &b);
+	CHECK(t == 0 && __dev_off(&sims[0], 0x80, 0) == 101);
+
+	CHECK(PCA9685_fleetDestroy(&fleet) == PCA9685_ERR_NOERR);
+}
+
+/*
+ *
+ * Bus arbitration: attached configs go through the bus, a queued PWM frame goes ahead of a
+ * sensor read that queued first.
+ */
+static void test_bus(void)
+{
+	PCA9685_sim sim;
+	PCA9685_config config;
+	PCA9685_bus bus;
+	PCA9685_busStats stats;
+	bus_waiter waiters[2];
+	pthread_t threads[2];
+	int order[2], n_order = 0, i;
+
+	__board(&sim, &config, MODE1_AI, 20000);
+	CHECK(PCA9685_busInit(&bus, -1, &sim.transport) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_busAttach(&bus, &config) == PCA9685_ERR_NOERR);
+
+	config.channels[0].dutyTime_us = 1500;
+	CHECK(PCA9685_updateChannel(0, &config) == PCA9685_ERR_NOERR);
+	CHECK(__off(&sim, 0) == 307);
+	CHECK(PCA9685_busGetStats(&bus, &stats) == PCA9685_ERR_NOERR);
+	CHECK(stats.acquisitions[PCA9685_BUS_PRIO_PWM] == 1);
+
+	//held by a sensor driver: a normal waiter queues first, then a PWM one
+	CHECK(PCA9685_busAcquire(&bus, PCA9685_BUS_PRIO_NORMAL, NULL) == PCA9685_ERR_NOERR);
+	for(i=0;i<2;++i){
+		waiters[i].bus = &bus;
+		waiters[i].prio = i ? PCA9685_BUS_PRIO_PWM : PCA9685_BUS_PRIO_NORMAL;
+		waiters[i].order = order;
+		waiters[i].n_order = &n_order;
+		pthread_create(&threads[i], NULL, __bus_wait, &waiters[i]);
+		__bus_queued(&bus, waiters[i].prio, 1);
+	}
+	CHECK(PCA9685_busRelease(&bus) == PCA9685_ERR_NOERR);
+
+	for(i=0;i<2;++i)
+		pthread_join(threads[i], NULL);
+	CHECK(n_order == 2 && order[0] == PCA9685_BUS_PRIO_PWM && order[1] == PCA9685_BUS_PRIO_NORMAL);
+
+	CHECK(PCA9685_busAcquire(&bus, PCA9685_BUS_NPRIO, NULL) == PCA9685_ERR_BOUNDS);
+	PCA9685_busDestroy(&bus);
+}
+
+/*
+ *
+ * Emergency stop: every board ends full off, boards whose batch failed lose their shadow, and
+ * the first error is returned. 43 boards on one bus take two batches.
+ */
+static void test_estop(void)
+{
+	static PCA9685_config configs[I2C_RDWR_IOCTL_MAX_MSGS + 2];
+	PCA9685_config* ptrs[I2C_RDWR_IOCTL_MAX_MSGS + 2];
+	PCA9685_sim sims[2];
+	fail_bus buses[2];
+	uint32_t t, m, b;
+	int i, n = I2C_RDWR_IOCTL_MAX_MSGS + 2;
+
+	PCA9685_simInit(&sims[0]);
+	PCA9685_simInit(&sims[1]);
+	PCA9685_simAddDevice(&sims[0], ADDRESS);
+	PCA9685_simAddDevice(&sims[1], ADDRESS);
+	__fail_init(&buses[0], &sims[0], -1);
+	__fail_init(&buses[1], &sims[1], -1);
+
+	//boards 0 - 42 on bus 0 (the same device, no ALLCALL: one message each), the last one on bus 1
+	for(i=0;i<n;++i){
+		memset(&configs[i], 0, sizeof(configs[i]));
+		PCA9685_setTransport(&buses[i == n - 1].transport, &configs[i]);
+		CHECK(PCA9685_config_only(&configs[i], 0, ADDRESS, MODE1_AI & ~PCA9685_SETTING_MODE1_ALLCALL, PCA9685_SETTING_MODE2_DEFAULTS, 20000, PCA9685_DEFAULT_OSC) == PCA9685_ERR_NOERR);
+		CHECK(PCA9685_wake(&configs[i]) == PCA9685_ERR_NOERR);
+		configs[i].channels[0].dutyTime_us = 1500;
+		CHECK(PCA9685_updateChannel(0, &configs[i]) == PCA9685_ERR_NOERR);
+		ptrs[i] = &configs[i];
+	}
+
+	//bus 0: the first batch of 42 fails, the second (board 42) goes through
+	buses[0].fail_after = 0;
+	CHECK(PCA9685_emergencyStop(ptrs, n, 0) == PCA9685_ERR_I2C_WRITE);
+	for(i=0;i<I2C_RDWR_IOCTL_MAX_MSGS;++i)
+		CHECK(configs[i].shadow_valid == 0 && configs[i].estop);
+	CHECK(configs[n - 2].shadow_valid && configs[n - 1].shadow_valid);
+	CHECK(sims[0].devs[0].regs[PCA9685_REG_LEDX_ON_L + 3] & LED_FULL);
+	CHECK(sims[1].devs[0].regs[PCA9685_REG_LEDX_ON_L + 3] & LED_FULL);
+
+	//stopped boards stay off until cleared
+	configs[n - 1].channels[0].dutyTime_us = 1000;
+	CHECK(PCA9685_updateChannel(0, &configs[n - 1]) == PCA9685_ERR_NOERR);
+	CHECK(sims[1].devs[0].regs[PCA9685_REG_LEDX_ON_L + 3] & LED_FULL);
+	CHECK(PCA9685_clearEmergencyStop(&configs[n - 1]) == PCA9685_ERR_NOERR);
+	CHECK(__off(&sims[1], 0) == 204);
+
+	//two ALLCALL boards on bus 1, only one listed: addressed on its own, the other keeps running
+	PCA9685_simAddDevice(&sims[1], 0x82);
+	for(i=0;i<2;++i){
+		memset(&configs[i], 0, sizeof(configs[i]));
+		PCA9685_setTransport(&sims[1].transport, &configs[i]);
+		CHECK(PCA9685_config_only(&configs[i], 0, (uint8_t)(0x80 + 2 * i), MODE1_AI, PCA9685_SETTING_MODE2_DEFAULTS, 20000, PCA9685_DEFAULT_OSC) == PCA9685_ERR_NOERR);
+		CHECK(PCA9685_wake(&configs[i]) == PCA9685_ERR_NOERR);
+		configs[i].channels[0].dutyTime_us = 1500;
+		CHECK(PCA9685_updateChannel(0, &configs[i]) == PCA9685_ERR_NOERR);
+	}
+	__mark(&sims[1], &t, &m, &b);
+	CHECK(PCA9685_emergencyStop(ptrs, 1, 0) == PCA9685_ERR_NOERR);
+	__mark(&sims[1], &t, &m, &b);
+	CHECK(t == 1 && m == 1);
+	CHECK(__dev_off(&sims[1], 0x80, 0) & (LED_FULL << 8));
+	CHECK(__dev_off(&sims[1], 0x82, 0) == 307);
+
+	//the caller vouches for the whole bus: one ALLCALL message stops both
+	CHECK(PCA9685_clearEmergencyStop(&configs[0]) == PCA9685_ERR_NOERR);
+	__mark(&sims[1], &t, &m, &b);
+	CHECK(PCA9685_emergencyStop(ptrs, 2, 1) == PCA9685_ERR_NOERR);
+	__mark(&sims[1], &t, &m, &b);
+	CHECK(t == 1 && m == 1);
+	CHECK((__dev_off(&sims[1], 0x80, 0) & (LED_FULL << 8)) && (__dev_off(&sims[1], 0x82, 0) & (LED_FULL << 8)));
+}
+
+/*
+ *
+ * Calibration: commands map through the compiled tick table, a curve reaching past the period
+ * saturates instead of wrapping.
+ */
+static void test_calibration(void)
+{
+	PCA9685_sim sim;
+	PCA9685_config config;
+	PCA9685_calibration linear, wide, reversed;
+	uint16_t commands[PCA9685_MAXCHAN] = {0};
+	PCA9685_WORD_t prev;
+	uint32_t cmd;
+
+	__board(&sim, &config, MODE1_AI, 20000);
+
+	CHECK(PCA9685_calibrationLinear(&linear, 1000, 2000) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_setCalibration(0, &linear, &config) == PCA9685_ERR_NOERR);
+	commands[0] = 0x8000;
+	CHECK(PCA9685_updateChannelCommands(1 << 0, commands, &config) == PCA9685_ERR_NOERR);
+	CHECK(__off(&sim, 0) == 307);
+	CHECK(PCA9685_updateChannelCommands(1 << 1, commands, &config) == PCA9685_ERR_NO_CALIBRATION);
+
+	//0 - 60000us over the whole command range: the interpolation needs more than 32 bits
+	CHECK(PCA9685_calibrationLinear(&wide, 0, 60000) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_setCalibration(1, &wide, &config) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_calibrationTicks(&wide, 0x4000) == 3072);
+	CHECK(PCA9685_calibrationTicks(&wide, 0x8000) == PCA9685_MAX_TICK);
+	CHECK(PCA9685_calibrationTicks(&wide, 0xFFFF) == PCA9685_MAX_TICK);
+	for(prev=0, cmd=0;cmd<=0xFFFF;cmd+=0x100){
+		CHECK(PCA9685_calibrationTicks(&wide, (uint16_t)cmd) >= prev);
+		prev = PCA9685_calibrationTicks(&wide, (uint16_t)cmd);
+	}
+
+	commands[1] = 0xFFFF;
+	CHECK(PCA9685_updateChannelCommands(1 << 1, commands, &config) == PCA9685_ERR_NOERR);
+	CHECK(__off(&sim, 1) == PCA9685_MAX_TICK);
+
+	//34000 - 0us, reversed, at a 35ms period: every value in range, the products still need 64 bits
+	__board(&sim, &config, MODE1_AI, 35000);
+	memset(&reversed, 0, sizeof(reversed));
+	reversed.n_points = 2;
+	reversed.command[1] = 0xFFFF;
+	reversed.pulse_us[0] = 34000;
+	CHECK(PCA9685_setCalibration(2, &reversed, &config) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_calibrationTicks(&reversed, 0) == (34000 * 4096 + 17500) / 35000);
+	CHECK(PCA9685_calibrationTicks(&reversed, 0xC000) == (8500 * 4096 + 17500) / 35000);
+	CHECK(PCA9685_calibrationTicks(&reversed, 0xFC00) == (531 * 4096 + 17500) / 35000);
+	CHECK(PCA9685_calibrationTicks(&reversed, 0xFFFF) == 0);
+}
+
+/*
+ *
+ * Parallel bring-up: every board configured, written and awake, in a few batched transfers per
+ * bus, with one oscillator wait for the whole fleet.
+ */
+static void test_fleet_init(void)
+{
+	static const PCA9685_boardDesc descs[] = {
+		{1, 0x80, MODE1_AI, PCA9685_SETTING_MODE2_DEFAULTS, 20000, PCA9685_DEFAULT_OSC},
+		{2, 0x80, MODE1_AI, PCA9685_SETTING_MODE2_DEFAULTS, 14000, PCA9685_DEFAULT_OSC},
+		{1, 0x82, MODE1_AI, PCA9685_SETTING_MODE2_DEFAULTS, 20000, PCA9685_DEFAULT_OSC},
+	};
+	PCA9685_sim sims[2];
+	PCA9685_fleet fleet;
+	PCA9685_fleetInitReport report;
+	PCA9685_simDevice* dev;
+	int i;
+
+	for(i=0;i<2;++i){
+		PCA9685_simInit(&sims[i]);
+		PCA9685_simAddDevice(&sims[i], 0x80);
+		PCA9685_simAddDevice(&sims[i], 0x82);
+	}
+
+	CHECK(PCA9685_fleetCreate(&fleet, descs, 3) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_fleetSetBusTransport(&fleet, 1, &sims[0].transport) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_fleetSetBusTransport(&fleet, 2, &sims[1].transport) == PCA9685_ERR_NOERR);
+
+	//channels written during bring-up are whatever the fleet holds
+	PCA9685_fleetSetTicks(&fleet, 2, 4, 1234);
+
+	CHECK(PCA9685_fleetInit(&fleet, &report) == PCA9685_ERR_NOERR);
+	CHECK(report.osc_wait_ns >= PCA9685_OSC_STARTUP_us * 1000ull);
+	CHECK(report.total_ns >= report.osc_wait_ns);
+
+	for(i=0;i<3;++i){
+		dev = PCA9685_simFindDevice(&sims[descs[i].i2cbus - 1], descs[i].dev_address);
+		CHECK(!(dev->regs[PCA9685_REG_MODE1] & MODE1_SLEEP));
+		CHECK(dev->regs[PCA9685_REG_PRESCALE] == PCA9685_fleetConfigOf(&fleet, i)->prescale);
+		CHECK(fleet.dirty[fleet.slot[i]] == 0);
+	}
+	CHECK(PCA9685_fleetConfigOf(&fleet, 0)->prescale != PCA9685_fleetConfigOf(&fleet, 1)->prescale);
+	CHECK(__dev_off(&sims[0], 0x82, 4) == 1234 && __dev_off(&sims[0], 0x80, 4) == 0);
+
+	//settings, channels and wake: one transfer each per bus, whatever the number of boards on it
+	CHECK(sims[0].n_transfers == 3 && sims[1].n_transfers == 3);
+
+	CHECK(PCA9685_fleetDestroy(&fleet) == PCA9685_ERR_NOERR);
+}
+
+/*
+ *
+ * Deadband: off tick moves within the band are not sent, measured against what the device holds,
+ * so drift gets through once it adds up; refresh and forced updates send anyway.
+ */
+static void test_deadband(void)
+{
+	PCA9685_sim sim;
+	PCA9685_config config;
+	PCA9685_stats stats;
+	PCA9685_WORD_t ticks[PCA9685_MAXCHAN] = {0};
+	uint32_t t, m, b;
+	int i;
+
+	__board(&sim, &config, MODE1_AI, 20000);
+	CHECK(PCA9685_setDeadband(1 << 0, 2, 0, &config) == PCA9685_ERR_NOERR);
+
+	ticks[0] = 300;
+	ticks[1] = 300;
+	CHECK(PCA9685_updateChannelTicks(0x0003, ticks, &config) == PCA9685_ERR_NOERR);
+	CHECK(__off(&sim, 0) == 300);
+
+	//within the band: nothing on the bus. Channel 1 has no deadband
+	__mark(&sim, &t, &m, &b);
+	ticks[0] = 301;
+	CHECK(PCA9685_updateChannelTicks(1 << 0, ticks, &config) == PCA9685_ERR_NOERR);
+	ticks[0] = 302;
+	CHECK(PCA9685_updateChannelTicks(1 << 0, ticks, &config) == PCA9685_ERR_NOERR);
+	__mark(&sim, &t, &m, &b);
+	CHECK(t == 0 && __off(&sim, 0) == 300);
+	ticks[1] = 301;
+	CHECK(PCA9685_updateChannelTicks(1 << 1, ticks, &config) == PCA9685_ERR_NOERR);
+	CHECK(__off(&sim, 1) == 301);
+
+	//drift past the band, relative to the device
+	ticks[0] = 303;
+	CHECK(PCA9685_updateChannelTicks(1 << 0, ticks, &config) == PCA9685_ERR_NOERR);
+	CHECK(__off(&sim, 0) == 303);
+
+	//refresh after 3 suppressed in a row
+	CHECK(PCA9685_setDeadband(1 << 0, 2, 3, &config) == PCA9685_ERR_NOERR);
+	for(i=0;i<3;++i){
+		ticks[0] = (PCA9685_WORD_t)(304 + (i & 1));
+		CHECK(PCA9685_updateChannelTicks(1 << 0, ticks, &config) == PCA9685_ERR_NOERR);
+	}
+	CHECK(__off(&sim, 0) == 303);
+	ticks[0] = 304;
+	CHECK(PCA9685_updateChannelTicks(1 << 0, ticks, &config) == PCA9685_ERR_NOERR);
+	CHECK(__off(&sim, 0) == 304);
+
+	//forced
+	config.channels[0].dutyTime_us = 1490;
+	CHECK(PCA9685_updateChannelsForce(1 << 0, &config) == PCA9685_ERR_NOERR);
+	CHECK(__off(&sim, 0) == 305);
+
+	CHECK(PCA9685_getStats(&stats, &config) == PCA9685_ERR_NOERR);
+	CHECK(stats.updates_suppressed == 5 && stats.suppressed[0] == 5 && stats.suppressed[1] == 0);
+}
+
+/*
+ *
+ * Real-time profile: applied to the fleet's bus threads only, never to the thread calling
+ * fleetInit, applying it leaves the process memory unlocked, and the latency probe runs its
+ * frames.
+ */
+static void test_rt(void)
+{
+	static const PCA9685_boardDesc descs[] = {
+		{1, 0x80, MODE1_AI, PCA9685_SETTING_MODE2_DEFAULTS, 20000, PCA9685_DEFAULT_OSC},
+	};
+	PCA9685_rtProfile profile = {1, 0, 0, 0};//SCHED_FIFO 1 on cpu 0, where permitted
+	PCA9685_rtProfile lock_only = {0, -1, 1, 0};
+	PCA9685_rtStatus status;
+	PCA9685_rtReport report;
+	PCA9685_sim sim;
+	PCA9685_fleet fleet;
+	cpu_set_t before, after;
+
+	PCA9685_simInit(&sim);
+	PCA9685_simAddDevice(&sim, 0x80);
+	CHECK(PCA9685_fleetCreate(&fleet, descs, 1) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_fleetSetBusTransport(&fleet, 1, &sim.transport) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_fleetSetRtProfile(&fleet, &profile) == PCA9685_ERR_NOERR);
+
+	CHECK(sched_getaffinity(0, sizeof(before), &before) == 0);
+	CHECK(PCA9685_fleetInit(&fleet, NULL) == PCA9685_ERR_NOERR);
+	CHECK(sched_getaffinity(0, sizeof(after), &after) == 0);
+	CHECK(CPU_EQUAL(&before, &after));
+	CHECK(sched_getscheduler(0) == SCHED_OTHER);
+	CHECK(PCA9685_fleetDestroy(&fleet) == PCA9685_ERR_NOERR);
+
+	//mlockall is process-wide, only PCA9685_rtLockMemory does it
+	CHECK(PCA9685_rtApply(&lock_only) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_rtCheck(&lock_only, &status) == PCA9685_ERR_RT);
+	CHECK(status.requested == PCA9685_RT_MLOCK && !(status.active & PCA9685_RT_MLOCK));
+
+	CHECK(PCA9685_rtLatency(1000, 5, &report) == PCA9685_ERR_NOERR);
+	CHECK(report.frames == 5 && report.frame_max_ns >= report.frame_avg_ns);
+	CHECK(PCA9685_rtLatency(1000, 0, &report) == PCA9685_ERR_BOUNDS);
+}
+
+/*
+ *
+ * Retune: the period changes in one transaction with every channel rescaled, tick-set channels
+ * keeping their time; a failed transfer leaves the config as it was, so a retry rescales once.
+ */
+static void test_retune(void)
+{
+	PCA9685_sim sim;
+	PCA9685_config config;
+	fail_bus bus;
+	PCA9685_WORD_t ticks[PCA9685_MAXCHAN] = {0};
+	uint32_t t, m, b;
+
+	PCA9685_simInit(&sim);
+	PCA9685_simAddDevice(&sim, ADDRESS);
+	__fail_init(&bus, &sim, -1);
+	memset(&config, 0, sizeof(config));
+	PCA9685_setTransport(&bus.transport, &config);
+	CHECK(PCA9685_config_only(&config, 0, ADDRESS, MODE1_AI, PCA9685_SETTING_MODE2_DEFAULTS, 14000, PCA9685_DEFAULT_OSC) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_wake(&config) == PCA9685_ERR_NOERR);
+
+	ticks[0] = 1000;
+	CHECK(PCA9685_updateChannelTicks(1 << 0, ticks, &config) == PCA9685_ERR_NOERR);
+	config.channels[1].dutyTime_us = 1500;
+	CHECK(PCA9685_updateChannel(1, &config) == PCA9685_ERR_NOERR);
+	CHECK(__off(&sim, 1) == 438);
+
+	bus.fail_after = 0;
+	CHECK(PCA9685_changePWMPeriod(20000, &config) == PCA9685_ERR_I2C_WRITE);
+	CHECK(config.pwm_period == 14000);
+
+	__mark(&sim, &t, &m, &b);
+	CHECK(PCA9685_changePWMPeriod(20000, &config) == PCA9685_ERR_NOERR);
+	__mark(&sim, &t, &m, &b);
+	//sleep, prescale, LEDs and wake together; RESTART after the oscillator settled
+	CHECK(t == 2 && m == 5);
+	CHECK(__off(&sim, 0) == 700);
+	CHECK(__off(&sim, 1) == 307);
+	CHECK(sim.devs[0].regs[PCA9685_REG_PRESCALE] == config.prescale);
+	CHECK(!(sim.devs[0].regs[PCA9685_REG_MODE1] & MODE1_SLEEP));
+}
+
+/*
+ *
+ * Phases: manual dutyPhase_us, automatic spreading over the cycle with the off edge wrapping,
+ * and boards of a group offset inside the slot between two channels.
+ */
+static void test_phase(void)
+{
+	PCA9685_sim sim;
+	PCA9685_config config, others[3];
+	PCA9685_config* group[4];
+	PCA9685_WORD_t ticks[PCA9685_MAXCHAN] = {0};
+	int i;
+
+	__board(&sim, &config, MODE1_AI, 20000);
+
+	CHECK(PCA9685_setPhaseMode(PCA9685_PHASE_MANUAL, 0, &config) == PCA9685_ERR_NOERR);
+	config.channels[0].dutyTime_us = 1500;
+	config.channels[0].dutyPhase_us = 5000;
+	CHECK(PCA9685_updateChannel(0, &config) == PCA9685_ERR_NOERR);
+	CHECK(__on(&sim, 0) == 1024 && __off(&sim, 0) == 1024 + 307);
+
+	CHECK(PCA9685_setPhaseMode(PCA9685_PHASE_AUTO, 0, &config) == PCA9685_ERR_NOERR);
+	for(i=0;i<PCA9685_MAXCHAN;++i)
+		ticks[i] = 1000;
+	CHECK(PCA9685_updateChannelTicks(0xFFFF, ticks, &config) == PCA9685_ERR_NOERR);
+	for(i=0;i<PCA9685_MAXCHAN;++i){
+		CHECK(__on(&sim, i) == 256 * i);
+		CHECK(__off(&sim, i) == ((256 * i + 1000) & PCA9685_MAX_TICK));
+	}
+
+	//the phase stays put: a duty change only touches the OFF registers
+	ticks[3] = 1100;
+	CHECK(PCA9685_updateChannelTicks(1 << 3, ticks, &config) == PCA9685_ERR_NOERR);
+	CHECK(__on(&sim, 3) == 768 && __off(&sim, 3) == 1868);
+
+	CHECK(PCA9685_setPhaseMode(PCA9685_PHASE_AUTO + 1, 0, &config) == PCA9685_ERR_BOUNDS);
+
+	group[0] = &config;
+	for(i=0;i<3;++i){
+		memset(&others[i], 0, sizeof(others[i]));
+		group[i + 1] = &others[i];
+	}
+	CHECK(PCA9685_allocatePhases(group, 4) == PCA9685_ERR_NOERR);
+	for(i=0;i<4;++i){
+		CHECK(group[i]->phase_mode == PCA9685_PHASE_AUTO);
+		CHECK(group[i]->phase_ticks[0] == 64 * i && group[i]->phase_ticks[1] == 256 + 64 * i);
+	}
+}
+
+/*
+ *
+ * Dither: the output averages to the sub-tick target, with the flips going out past a 1 tick
+ * deadband; the governor holds a flip stepped right after a frame, and it still skips the
+ * deadband when it goes out with the next one.
+ */
+static void test_dither(void)
+{
+	PCA9685_sim sim;
+	PCA9685_config config;
+	PCA9685_stats stats;
+	uint32_t sum = 0, target_q8, frames;
+	int i, steps = 256;
+
+	__board(&sim, &config, MODE1_AI, 14000);
+	CHECK(PCA9685_setDither(1 << 0, &config) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_setDeadband(1 << 0, 1, 0, &config) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_setGovernor(1, &config) == PCA9685_ERR_NOERR);
+
+	//1501us at 14ms: 439.15 ticks
+	config.channels[0].dutyTime_us = 1501;
+	CHECK(PCA9685_updateChannelsForce(1 << 0, &config) == PCA9685_ERR_NOERR);
+	target_q8 = config.dither_q8[0];
+	CHECK(target_q8 >> 8 == 439 && (target_q8 & 0xFF) > 0);
+
+	for(i=0;i<steps;++i){
+		config.last_dither_ns = 0;//one step per call instead of per 14ms
+		config.last_frame_ns = 0;
+		CHECK(PCA9685_service(&config) == PCA9685_ERR_NOERR);
+		sum += __off(&sim, 0);
+	}
+
+	//the first order sigma-delta lands within a step's worth of the target
+	CHECK(sum * 256 + 256 >= target_q8 * steps && sum * 256 <= target_q8 * steps + 256);
+
+	CHECK(PCA9685_getStats(&stats, &config) == PCA9685_ERR_NOERR);
+	CHECK(stats.dither_flips > 0 && stats.updates_suppressed == 0 && stats.updates_deferred == 0);
+
+	//a frame just went out: the next flip waits for the period instead of being a second frame
+	config.channels[0].dutyTime_us = 1501;
+	CHECK(PCA9685_updateChannelsForce(1 << 0, &config) == PCA9685_ERR_NOERR);
+	frames = stats.frames + 1;
+	for(i=0;i<16 && !config.pending;++i){
+		config.last_dither_ns = 0;
+		CHECK(PCA9685_service(&config) == PCA9685_ERR_NOERR);
+	}
+	CHECK(config.pending == (1 << 0));
+	CHECK(PCA9685_getStats(&stats, &config) == PCA9685_ERR_NOERR);
+	CHECK(stats.frames == frames && __off(&sim, 0) == 439);
+
+	config.last_frame_ns = 0;
+	CHECK(PCA9685_service(&config) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_getStats(&stats, &config) == PCA9685_ERR_NOERR);
+	CHECK(!config.pending && stats.frames == frames + 1 && __off(&sim, 0) == 440);
+	CHECK(stats.updates_suppressed == 0);
+}
+
+/*
+ *
+ * Idle sleep: a board with every output off sleeps after the timeout, the first update that
+ * turns one on wakes it (RESTART once the oscillator has settled), and an explicit wake or a
+ * failing one leaves nothing of the policy's own wake behind.
+ */
+static void test_idle_sleep(void)
+{
+	PCA9685_sim sim;
+	PCA9685_config config;
+	PCA9685_stats stats;
+	fail_bus bus;
+	uint8_t* mode1 = &sim.devs[0].regs[PCA9685_REG_MODE1];
+	uint32_t t, m, b;
+
+	__board(&sim, &config, MODE1_AI, 20000);
+	CHECK(PCA9685_setIdleSleep(1, &config) == PCA9685_ERR_NOERR);
+
+	usleep(2000);
+	CHECK(PCA9685_service(&config) == PCA9685_ERR_NOERR);
+	CHECK(*mode1 & MODE1_SLEEP);
+
+	config.channels[0].dutyTime_us = 1500;
+	CHECK(PCA9685_updateChannel(0, &config) == PCA9685_ERR_NOERR);
+	CHECK(!(*mode1 & MODE1_SLEEP) && __off(&sim, 0) == 307);
+	CHECK(config.restart_pending);
+	usleep(PCA9685_OSC_STARTUP_us);
+	CHECK(PCA9685_service(&config) == PCA9685_ERR_NOERR);
+	CHECK(!config.restart_pending);
+	CHECK(PCA9685_getStats(&stats, &config) == PCA9685_ERR_NOERR);
+	CHECK(stats.auto_sleeps == 1 && stats.auto_wakes == 1);
+
+	//asleep again, then woken explicitly with every output still off
+	config.channels[0].dutyTime_us = 0;
+	CHECK(PCA9685_updateChannel(0, &config) == PCA9685_ERR_NOERR);
+	usleep(2000);
+	CHECK(PCA9685_service(&config) == PCA9685_ERR_NOERR);
+	CHECK(*mode1 & MODE1_SLEEP);
+	CHECK(PCA9685_wake(&config) == PCA9685_ERR_NOERR);
+	CHECK(!(*mode1 & MODE1_SLEEP));
+
+	//the next output on is just a frame: no second wake, no RESTART
+	config.channels[0].dutyTime_us = 1000;
+	__mark(&sim, &t, &m, &b);
+	CHECK(PCA9685_updateChannel(0, &config) == PCA9685_ERR_NOERR);
+	__mark(&sim, &t, &m, &b);
+	CHECK(t == 1 && !config.restart_pending);
+	CHECK(PCA9685_getStats(&stats, &config) == PCA9685_ERR_NOERR);
+	CHECK(stats.auto_sleeps == 2 && stats.auto_wakes == 1);
+
+	//a wake whose channel flush fails reports it
+	__fail_init(&bus, &sim, 0);
+	PCA9685_setTransport(&bus.transport, &config);
+	config.shadow_valid = 0;
+	CHECK(PCA9685_wake(&config) == PCA9685_ERR_I2C_WRITE);
+}
+
+/*
+ *
+ * Actuator map: a batch over many boards goes out as one combined transfer per bus, split only
+ * at the I2C_RDWR message limit, and boards without a changed actuator are left alone.
+ */
+static void test_map(void)
+{
+	PCA9685_boardDesc descs[19];
+	PCA9685_actuatorDesc actuators[50];
+	PCA9685_actuatorValue values[50];
+	PCA9685_sim sims[2];
+	PCA9685_fleet fleet;
+	PCA9685_map map;
+	fail_bus bus;
+	uint32_t t, m, b, bus1;
+	int i;
+
+	//bus 1: 16 boards without auto increment, one message per register; bus 2: 3 boards
+	PCA9685_simInit(&sims[0]);
+	PCA9685_simInit(&sims[1]);
+	for(i=0;i<19;++i){
+		descs[i].i2cbus = i < 16 ? 1 : 2;
+		descs[i].dev_address = (uint8_t)(0x80 + 2 * (i < 16 ? i : i - 16));
+		descs[i].mode1_settings = i < 16 ? PCA9685_SETTING_MODE1_DEFAULTS : MODE1_AI;
+		descs[i].mode2_settings = PCA9685_SETTING_MODE2_DEFAULTS;
+		descs[i].pwm_period_us = 20000;
+		descs[i].osc_freq_Hz = PCA9685_DEFAULT_OSC;
+		PCA9685_simAddDevice(&sims[descs[i].i2cbus - 1], descs[i].dev_address);
+	}
+
+	//ids 0 - 47: channels 0 - 2 of the bus 1 boards; 48, 49 on bus 2, its third board unmapped
+	for(i=0;i<50;++i){
+		actuators[i].id = (uint16_t)i;
+		actuators[i].i2cbus = i < 48 ? 1 : 2;
+		actuators[i].dev_address = (uint8_t)(i < 48 ? 0x80 + 2 * (i / 3) : 0x80 + 2 * (i - 48));
+		actuators[i].channel = (uint8_t)(i < 48 ? i % 3 : 5);
+		actuators[i].cal = NULL;
+	}
+
+	__fail_init(&bus, &sims[0], -1);
+	CHECK(PCA9685_fleetCreate(&fleet, descs, 19) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_fleetSetBusTransport(&fleet, 1, &bus.transport) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_fleetSetBusTransport(&fleet, 2, &sims[1].transport) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_fleetInit(&fleet, NULL) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_mapCreate(&map, &fleet, actuators, 50) == PCA9685_ERR_NOERR);
+
+	//two boards of bus 2: one transfer, nothing for the third
+	values[0].id = 49;
+	values[0].value = 0x234;
+	values[1].id = 48;
+	values[1].value = 0x123;
+	bus1 = sims[0].n_transfers;
+	__mark(&sims[1], &t, &m, &b);
+	CHECK(PCA9685_mapSet(&map, values, 2) == PCA9685_ERR_NOERR);
+	CHECK(sims[0].n_transfers == bus1);
+	__mark(&sims[1], &t, &m, &b);
+	CHECK(t == 1 && m == 2);
+	CHECK(__dev_off(&sims[1], 0x80, 5) == 0x123 && __dev_off(&sims[1], 0x82, 5) == 0x234);
+
+	//every board of bus 1, in reverse id order: 96 register writes in three transfers of at most 42
+	for(i=0;i<48;++i){
+		values[i].id = (uint16_t)(47 - i);
+		values[i].value = (uint16_t)(0x101 + 47 - i);
+	}
+	__mark(&sims[0], &t, &m, &b);
+	bus.max_msgs = 0;
+	CHECK(PCA9685_mapSet(&map, values, 48) == PCA9685_ERR_NOERR);
+	__mark(&sims[0], &t, &m, &b);
+	CHECK(m == 96 && t == 3 && bus.max_msgs <= I2C_RDWR_IOCTL_MAX_MSGS);
+	for(i=0;i<48;++i)
+		CHECK(__dev_off(&sims[0], (uint8_t)(0x80 + 2 * (i / 3)), (uint8_t)(i % 3)) == 0x101 + i);
+	for(i=0;i<(fleet.n_boards + 63) / 64;++i)
+		CHECK(fleet.dirty_boards[i] == 0);
+
+	//a failed transfer leaves its boards dirty, the next flush sends them
+	for(i=0;i<48;++i)
+		values[i].value = (uint16_t)(0x201 + 47 - i);
+	bus.fail_after = 1;
+	CHECK(PCA9685_mapSet(&map, values, 48) == PCA9685_ERR_I2C_WRITE);
+	CHECK(fleet.dirty_boards[0] != 0);
+	__mark(&sims[0], &t, &m, &b);
+	CHECK(PCA9685_fleetFlush(&fleet) == PCA9685_ERR_NOERR);
+	__mark(&sims[0], &t, &m, &b);
+	CHECK(t == 1 && fleet.dirty_boards[0] == 0);
+	for(i=0;i<48;++i)
+		CHECK(__dev_off(&sims[0], (uint8_t)(0x80 + 2 * (i / 3)), (uint8_t)(i % 3)) == 0x201 + i);
+
+	CHECK(PCA9685_mapDestroy(&map) == PCA9685_ERR_NOERR);
+	CHECK(PCA9685_fleetDestroy(&fleet) == PCA9685_ERR_NOERR);
+}
+
+/*
+ *
+ * State restore: a record rewritten while it is being read is read again with the device, and
+ * one that never holds still is refused instead of half used.
+ */
+static void test_state(void)
+{
+	PCA9685_sim sim;
+	PCA9685_config config;
+	PCA9685_boardState rec;
+	record_bus bus;
+	uint8_t regs[PCA9685_SIM_NUMREGS], outcome;
+	uint32_t t, m, b;
+
+	__board(&sim, &config, MODE1_AI, 20000);
+	memset(&rec, 0, sizeof(rec));
+	CHECK(PCA9685_restoreState(&rec, &outcome, &config) == PCA9685_ERR_NOERR);
+	CHECK(outcome == PCA9685_RESTORE_ADOPTED);
+	config.channels[3].dutyTime_us = 1500;
+	CHECK(PCA9685_updateChannel(3, &config) == PCA9685_ERR_NOERR);
+	CHECK(rec.generation && !(rec.generation & 1) && rec.duty_us[3] == 1500);
+
+	//a restart while the record is rewritten once: a second snapshot, then a plain resume
+	memset(&config, 0, sizeof(config));
+	__record_init(&bus, &sim, &rec, 1);
+	PCA9685_setTransport(&bus.transport, &config);
+	CHECK(PCA9685_config_prepare(&config, 0, ADDRESS, MODE1_AI, PCA9685_SETTING_MODE2_DEFAULTS, 20000, PCA9685_DEFAULT_OSC) == PCA9685_ERR_NOERR);
+	__mark(&sim, &t, &m, &b);
+	CHECK(PCA9685_restoreState(&rec, &outcome, &config) == PCA9685_ERR_NOERR);
+	__mark(&sim, &t, &m, &b);
+	CHECK(bus.rewrites == 0 && t == 2);
+	CHECK(outcome == PCA9685_RESTORE_RESUMED && config.channels[3].dutyTime_us == 1500);
+
+	//rewritten on every read: refused, and the device is left alone
+	memset(&config, 0, sizeof(config));
+	__record_init(&bus, &sim, &rec, -1);
+	PCA9685_setTransport(&bus.transport, &config);
+	CHECK(PCA9685_config_prepare(&config, 0, ADDRESS, MODE1_AI, PCA9685_SETTING_MODE2_DEFAULTS, 20000, PCA9685_DEFAULT_OSC) == PCA9685_ERR_NOERR);
+	memcpy(regs, sim.devs[0].regs, sizeof(regs));
+	__mark(&sim, &t, &m, &b);
+	CHECK(PCA9685_restoreState(&rec, &outcome, &config) == PCA9685_ERR_STATE);
+	__mark(&sim, &t, &m, &b);
+	CHECK(t > 1 && config.state == NULL);
+	CHECK(memcmp(regs, sim.devs[0].regs, sizeof(regs)) == 0);
+}
+
+/*
+ *
+ * State file: the same address on two buses, configs set up from a descriptor. Each board gets
+ * its own record back after a restart.
+ */
+static void test_state_buses(void)
+{
+	PCA9685_sim sims[2];
+	PCA9685_config configs[2];
+	PCA9685_state* state;
+	uint8_t outcome;
+	int run, i;
+
+	unlink(__tmp_path("state"));
+	CHECK(PCA9685_stateOpen(&state, __tmp_path("state"), 4) == PCA9685_ERR_NOERR);
+
+	for(i=0;i<2;++i){
+		PCA9685_simInit(&sims[i]);
+		PCA9685_simAddDevice(&sims[i], ADDRESS);
+	}
+
+	for(run=0;run<2;++run){
+		for(i=0;i<2;++i){
+			memset(&configs[i], 0, sizeof(configs[i]));
+			PCA9685_setTransport(&sims[i].transport, &configs[i]);
+			CHECK(PCA9685_config_prepare(&configs[i], 0, ADDRESS, MODE1_AI, PCA9685_SETTING_MODE2_DEFAULTS, 20000, PCA9685_DEFAULT_OSC) == PCA9685_ERR_NOERR);
+			CHECK(PCA9685_stateRestore(state, i + 1, &outcome, &configs[i]) == PCA9685_ERR_NOERR);
+
+			if(run == 0){
+				CHECK(outcome == PCA9685_RESTORE_ADOPTED);
+				configs[i].channels[2].dutyTime_us = 1000 + 500 * i;
+				CHECK(PCA9685_updateChannel(2, &configs[i]) == PCA9685_ERR_NOERR);
+			}
+			else
+				CHECK(outcome == PCA9685_RESTORE_RESUMED && configs[i].channels[2].dutyTime_us == 1000u + 500 * i);
+		}
+
+		for(i=0;i<2;++i)
+			CHECK(PCA9685_stateDetach(&configs[i]) == PCA9685_ERR_NOERR);
+	}
+
+	CHECK(PCA9685_stateClose(state) == PCA9685_ERR_NOERR);
+	unlink(__tmp_path("state"));
+}
+
+static const sim_test tests[] = {
+	{"planner_full_burst", test_planner_full_burst},
+	{"planner_sparse", test_planner_sparse},
+	{"planner_no_autoincrement", test_planner_no_autoincrement},
+	{"planner_duty", test_planner_duty},
+	{"trace_replay", test_trace_replay},
+	{"trace_damaged", test_trace_damaged},
+	{"governor", test_governor},
+	{"shm", test_shm},
+	{"fleet", test_fleet},
+	{"fleet_init", test_fleet_init},
+	{"bus", test_bus},
+	{"estop", test_estop},
+	{"calibration", test_calibration},
+	{"deadband", test_deadband},
+	{"rt", test_rt},
+	{"retune", test_retune},
+	{"phase", test_phase},
+	{"dither", test_dither},
+	{"idle_sleep", test_idle_sleep},
+	{"map", test_map},
+	{"state", test_state},
+	{"state_buses", test_state_buses},
+};
+
+int main(int argc, char** argv)
+{
+	size_t i;
+	int before, ran = 0;
+
+	for(i=0;i<sizeof(tests)/sizeof(tests[0]);++i){
+		if(argc > 1 && !strstr(tests[i].name, argv[1]))
+			continue;
+
+		before = failures;
+		tests[i].fn();
+		printf("%-32s %s\n", tests[i].name, failures == before ? "ok" : "FAIL");
+		++ran;
+	}
+
+	printf("%d tests, %d failed checks\n", ran, failures);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//one awake board at ADDRESS on a fresh simulated bus
+static void __board(PCA9685_sim* sim,
+		PCA9685_config* config,
+		uint8_t mode1,
+		uint32_t period_us)
+{
+	PCA9685_simInit(sim);
+	PCA9685_simAddDevice(sim, ADDRESS);
+
+	memset(config, 0, sizeof(*config));
+	PCA9685_setTransport(&sim->transport, config);
+
+	if(PCA9685_config_only(config, 0, ADDRESS, mode1, PCA9685_SETTING_MODE2_DEFAULTS, period_us, PCA9685_DEFAULT_OSC) ||
+			PCA9685_wake(config)){
+		fprintf(stderr, "board setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static PCA9685_WORD_t __off(PCA9685_sim* sim,
+		uint8_t channel)
+{
+	uint8_t* r = &sim->devs[0].regs[PCA9685_REG_LEDX_ON_L + 4*channel];
+
+	return (PCA9685_WORD_t)(((r[3] & 0x1F) << 8) | r[2]);
+}
+
+static PCA9685_WORD_t __on(PCA9685_sim* sim,
+		uint8_t channel)
+{
+	uint8_t* r = &sim->devs[0].regs[PCA9685_REG_LEDX_ON_L + 4*channel];
+
+	return (PCA9685_WORD_t)(((r[1] & 0x1F) << 8) | r[0]);
+}
+
+static PCA9685_WORD_t __dev_off(PCA9685_sim* sim,
+		uint8_t dev_address,
+		uint8_t channel)
+{
+	uint8_t* r = &PCA9685_simFindDevice(sim, dev_address)->regs[PCA9685_REG_LEDX_ON_L + 4*channel];
+
+	return (PCA9685_WORD_t)(((r[3] & 0x1F) << 8) | r[2]);
+}
+
+//traffic since the last mark
+static void __mark(PCA9685_sim* sim,
+		uint32_t* transfers,
+		uint32_t* msgs,
+		uint32_t* bytes)
+{
+	static uint32_t t0, m0, b0;
+
+	*transfers = sim->n_transfers - t0;
+	*msgs = sim->n_msgs - m0;
+	*bytes = sim->n_bytes - b0;
+	t0 = sim->n_transfers;
+	m0 = sim->n_msgs;
+	b0 = sim->n_bytes;
+}
+
+static const char* __tmp_path(const char* name)
+{
+	static char path[64];
+
+	snprintf(path, sizeof(path), "/tmp/test_pwm_sim.%d.%s", (int)getpid(), name);
+
+	return path;
+}
+
+//clears the sequence number of a trace record, as if its writer died before publishing it
+static void __corrupt_record(const char* trace_path,
+		int index)
+{
+	uint64_t seq = 0;
+	int fd = open(trace_path, O_RDWR);
+
+	//64 byte header, seq first in the record
+	if(fd < 0 || pwrite(fd, &seq, sizeof(seq), 64 + index * sizeof(PCA9685_traceRecord)) != sizeof(seq))
+		failures++;
+	close(fd);
+}
+
+//a pid that no longer exists
+static uint32_t __dead_pid(void)
+{
+	pid_t pid = fork();
+
+	if(!pid)
+		_exit(0);
+	waitpid(pid, NULL, 0);
+
+	return (uint32_t)pid;
+}
+
+//takes the bus and logs its priority, in the order the bus was granted
+static void* __bus_wait(void* arg)
+{
+	bus_waiter* w = (bus_waiter*)arg;
+
+	if(PCA9685_busAcquire(w->bus, w->prio, NULL) == PCA9685_ERR_NOERR){
+		w->order[(*w->n_order)++] = w->prio;
+		PCA9685_busRelease(w->bus);
+	}
+
+	return NULL;
+}
+
+static void __bus_queued(PCA9685_bus* bus,
+		int prio,
+		uint32_t n)
+{
+	uint32_t waiting;
+
+	do{
+		usleep(100);
+		pthread_mutex_lock(&bus->mutex);
+		waiting = bus->waiting[prio];
+		pthread_mutex_unlock(&bus->mutex);
+	}while(waiting < n);
+}
+
+static void __fail_init(fail_bus* f,
+		PCA9685_sim* sim,
+		int fail_after)
+{
+	f->transport.transfer = __fail_transfer;
+	f->transport.ctx = f;
+	f->transport.urgent = NULL;
+	f->sim = sim;
+	f->fail_after = fail_after;
+	f->max_msgs = 0;
+}
+
+static int __fail_transfer(void* ctx,
+		PCA9685_msg* msgs,
+		int n_msgs)
+{
+	fail_bus* f = (fail_bus*)ctx;
+
+	if(n_msgs > f->max_msgs)
+		f->max_msgs = n_msgs;
+
+	if(f->fail_after == 0){
+		f->fail_after = -1;
+		return PCA9685_ERR_I2C_WRITE;
+	}
+	if(f->fail_after > 0)
+		f->fail_after--;
+
+	return PCA9685_simTransfer(f->sim, msgs, n_msgs);
+}
+
+static void __record_init(record_bus* r,
+		PCA9685_sim* sim,
+		PCA9685_boardState* rec,
+		int rewrites)
+{
+	r->transport.transfer = __record_transfer;
+	r->transport.ctx = r;
+	r->transport.urgent = NULL;
+	r->sim = sim;
+	r->rec = rec;
+	r->rewrites = rewrites;
+}
+
+static int __record_transfer(void* ctx,
+		PCA9685_msg* msgs,
+		int n_msgs)
+{
+	record_bus* r = (record_bus*)ctx;
+	int i;
+
+	for(i=0;i<n_msgs;++i){
+		if(msgs[i].flags && r->rewrites){
+			r->rec->generation += 2;
+			if(r->rewrites > 0)
+				r->rewrites--;
+			break;
+		}
+	}
+
+	return PCA9685_simTransfer(r->sim, msgs, n_msgs);
+}